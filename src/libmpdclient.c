@@ -43,6 +43,7 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 
 #include <glib.h>
 
@@ -71,6 +72,23 @@
 
 #ifndef WIN32
 #include <sys/un.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#endif
+
+#ifdef __linux__
+#  include <sys/epoll.h>
+#  define MPD_HAVE_EPOLL
+#endif
+
+#if defined(__GNUC__) && defined(__SSE2__)
+#  include <emmintrin.h>
+#  define MPD_HAVE_SSE2
+#  if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#    include <immintrin.h>
+#    define MPD_HAVE_AVX2
+#  endif
 #endif
 
 #ifndef MSG_DONTWAIT
@@ -78,16 +96,44 @@
 #endif
 
 #ifdef WIN32
-#  define SELECT_ERRNO_IGNORE   (errno == WSAEINTR || errno == WSAEINPROGRESS)
-#  define SENDRECV_ERRNO_IGNORE SELECT_ERRNO_IGNORE
+#  define WAIT_ERRNO_IGNORE     (errno == WSAEINTR || errno == WSAEINPROGRESS)
+#  define SENDRECV_ERRNO_IGNORE WAIT_ERRNO_IGNORE
 #else
-#  define SELECT_ERRNO_IGNORE   (errno == EINTR)
+#  define WAIT_ERRNO_IGNORE     (errno == EINTR)
 #  define SENDRECV_ERRNO_IGNORE (errno == EINTR || errno == EAGAIN)
 #  define winsock_dll_error(c)  0
 #  define closesocket(s)        close(s)
 #  define WSACleanup()          do { /* nothing */ } while (0)
 #endif
 
+#define MPD_WAIT_READ  0
+#define MPD_WAIT_WRITE 1
+
+/* wait up to the connection timeout for the socket to become readable
+ * or writable; returns >0 when it has, 0 on timeout and <0 on error.
+ * poll has no FD_SETSIZE limit on the socket number, winsock's select
+ * doesn't either */
+static int mpd_wait(mpd_Connection * connection, int direction) {
+#ifdef WIN32
+	struct timeval tv = connection->timeout;
+	fd_set fds;
+
+	FD_ZERO(&fds);
+	FD_SET(connection->sock, &fds);
+	if(direction == MPD_WAIT_READ)
+		return select(connection->sock+1, &fds, NULL, NULL, &tv);
+	return select(connection->sock+1, NULL, &fds, NULL, &tv);
+#else
+	struct pollfd pfd;
+
+	pfd.fd = connection->sock;
+	pfd.events = direction == MPD_WAIT_READ ? POLLIN : POLLOUT;
+	pfd.revents = 0;
+	return poll(&pfd, 1, connection->timeout.tv_sec*1000 +
+	                     (connection->timeout.tv_usec+999)/1000);
+#endif
+}
+
 #ifdef WIN32
 static int winsock_dll_error(mpd_Connection *connection)
 {
@@ -128,8 +174,6 @@ static int do_connect_fail(mpd_Connection *connection,
                            const struct sockaddr *serv_addr, int addrlen)
 {
 	int flags, res,valopt;
-	struct timeval tv;
-	fd_set myset;
 	flags = fcntl(connection->sock, F_GETFL, 0);
 	fcntl(connection->sock, F_SETFL, flags | O_NONBLOCK);
 	/*if (connect(connection->sock, serv_addr, addrlen) < 0)
@@ -138,11 +182,7 @@ static int do_connect_fail(mpd_Connection *connection,
     res = connect(connection->sock, serv_addr, addrlen);
     if (res < 0) { 
         if (errno == EINPROGRESS) { 
-            tv.tv_sec = connection->timeout.tv_sec;
-            tv.tv_usec = connection->timeout.tv_usec;
-            FD_ZERO(&myset); 
-            FD_SET(connection->sock, &myset); 
-            if (select(connection->sock+1, NULL, &myset, NULL, &tv) > 0) { 
+            if (mpd_wait(connection, MPD_WAIT_WRITE) > 0) { 
                 socklen_t lon; 
                 lon = sizeof(int); 
                 /* Check for errors */
@@ -321,42 +361,461 @@ char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES] =
 	"Any"
 };
 
-static char * mpd_sanitizeArg(const char * arg) {
-	size_t i;
-	char * ret;
-	register const char *c;
-	register char *rc;
+/* KEY LOOKUP */
+
+/* every key the decoders below care about gets an id; the names are
+ * case sensitive, so "time" from status and "Time" from a song are
+ * different keys */
+enum mpd_Key {
+	MPD_KEY_UNKNOWN = 0,
+	MPD_KEY_VOLUME,
+	MPD_KEY_REPEAT,
+	MPD_KEY_SINGLE,
+	MPD_KEY_CONSUME,
+	MPD_KEY_RANDOM,
+	MPD_KEY_PLAYLIST,
+	MPD_KEY_PLAYLISTLENGTH,
+	MPD_KEY_BITRATE,
+	MPD_KEY_STATE,
+	MPD_KEY_SONG,
+	MPD_KEY_SONGID,
+	MPD_KEY_NEXTSONG,
+	MPD_KEY_NEXTSONGID,
+	MPD_KEY_TIME,
+	MPD_KEY_ERROR,
+	MPD_KEY_XFADE,
+	MPD_KEY_UPDATING_DB,
+	MPD_KEY_AUDIO,
+	MPD_KEY_ARTISTS,
+	MPD_KEY_ALBUMS,
+	MPD_KEY_SONGS,
+	MPD_KEY_UPTIME,
+	MPD_KEY_DB_UPDATE,
+	MPD_KEY_PLAYTIME,
+	MPD_KEY_DB_PLAYTIME,
+	MPD_KEY_OUTPUTID,
+	MPD_KEY_OUTPUTNAME,
+	MPD_KEY_OUTPUTENABLED,
+	MPD_KEY_FILE,
+	MPD_KEY_DIRECTORY,
+	MPD_KEY_CPOS,
+	MPD_KEY_ARTIST,
+	MPD_KEY_ALBUM,
+	MPD_KEY_TITLE,
+	MPD_KEY_TRACK,
+	MPD_KEY_NAME,
+	MPD_KEY_SONG_TIME,
+	MPD_KEY_POS,
+	MPD_KEY_ID,
+	MPD_KEY_DATE,
+	MPD_KEY_GENRE,
+	MPD_KEY_COMPOSER,
+	MPD_KEY_PERFORMER,
+	MPD_KEY_DISC,
+	MPD_KEY_COMMENT,
+	MPD_KEY_ALBUMARTIST,
+	MPD_KEY_LAST_MODIFIED,
+	MPD_KEY_FILENAME,
+	MPD_KEY_ANY,
+	MPD_KEY_COUNT
+};
 
-	/* instead of counting in that loop above, just
-	 * use a bit more memory and half running time
-	 */
-	ret = malloc(strlen(arg) * 2 + 1);
+/* perfect hash over the known keys: FNV-1a with a seed picked so that
+ * no two of them share a slot.  when adding a key, add it to the table
+ * and, if it collides, search for a new seed */
+#define MPD_KEY_HASH_SEED	0x811d4a85
+#define MPD_KEY_TABLE_BITS	7
+
+static const struct {
+	const char * name;
+	int length;
+	int key;
+} mpd_keyTable[1 << MPD_KEY_TABLE_BITS] = {
+	[3] = { "Composer", 8, MPD_KEY_COMPOSER },
+	[4] = { "state", 5, MPD_KEY_STATE },
+	[6] = { "Artist", 6, MPD_KEY_ARTIST },
+	[7] = { "song", 4, MPD_KEY_SONG },
+	[9] = { "albums", 6, MPD_KEY_ALBUMS },
+	[11] = { "playlistlength", 14, MPD_KEY_PLAYLISTLENGTH },
+	[12] = { "playtime", 8, MPD_KEY_PLAYTIME },
+	[25] = { "Performer", 9, MPD_KEY_PERFORMER },
+	[26] = { "artists", 7, MPD_KEY_ARTISTS },
+	[29] = { "Date", 4, MPD_KEY_DATE },
+	[31] = { "Comment", 7, MPD_KEY_COMMENT },
+	[39] = { "cpos", 4, MPD_KEY_CPOS },
+	[41] = { "bitrate", 7, MPD_KEY_BITRATE },
+	[42] = { "nextsongid", 10, MPD_KEY_NEXTSONGID },
+	[45] = { "outputid", 8, MPD_KEY_OUTPUTID },
+	[46] = { "time", 4, MPD_KEY_TIME },
+	[47] = { "Last-Modified", 13, MPD_KEY_LAST_MODIFIED },
+	[48] = { "single", 6, MPD_KEY_SINGLE },
+	[51] = { "outputname", 10, MPD_KEY_OUTPUTNAME },
+	[52] = { "consume", 7, MPD_KEY_CONSUME },
+	[53] = { "songs", 5, MPD_KEY_SONGS },
+	[55] = { "updating_db", 11, MPD_KEY_UPDATING_DB },
+	[61] = { "db_playtime", 11, MPD_KEY_DB_PLAYTIME },
+	[62] = { "nextsong", 8, MPD_KEY_NEXTSONG },
+	[64] = { "outputenabled", 13, MPD_KEY_OUTPUTENABLED },
+	[67] = { "directory", 9, MPD_KEY_DIRECTORY },
+	[70] = { "audio", 5, MPD_KEY_AUDIO },
+	[76] = { "db_update", 9, MPD_KEY_DB_UPDATE },
+	[77] = { "xfade", 5, MPD_KEY_XFADE },
+	[79] = { "playlist", 8, MPD_KEY_PLAYLIST },
+	[81] = { "Disc", 4, MPD_KEY_DISC },
+	[85] = { "file", 4, MPD_KEY_FILE },
+	[86] = { "Genre", 5, MPD_KEY_GENRE },
+	[88] = { "Any", 3, MPD_KEY_ANY },
+	[93] = { "Filename", 8, MPD_KEY_FILENAME },
+	[95] = { "repeat", 6, MPD_KEY_REPEAT },
+	[96] = { "songid", 6, MPD_KEY_SONGID },
+	[97] = { "Time", 4, MPD_KEY_SONG_TIME },
+	[100] = { "Album", 5, MPD_KEY_ALBUM },
+	[102] = { "random", 6, MPD_KEY_RANDOM },
+	[103] = { "uptime", 6, MPD_KEY_UPTIME },
+	[105] = { "volume", 6, MPD_KEY_VOLUME },
+	[108] = { "Pos", 3, MPD_KEY_POS },
+	[111] = { "error", 5, MPD_KEY_ERROR },
+	[112] = { "AlbumArtist", 11, MPD_KEY_ALBUMARTIST },
+	[114] = { "Id", 2, MPD_KEY_ID },
+	[121] = { "Name", 4, MPD_KEY_NAME },
+	[125] = { "Track", 5, MPD_KEY_TRACK },
+	[127] = { "Title", 5, MPD_KEY_TITLE },
+};
+
+static int mpd_lookupKey(const char * name, int length) {
+	guint32 hash = MPD_KEY_HASH_SEED;
+	int i;
+
+	for(i = 0; i < length; i++)
+		hash = (hash ^ (unsigned char)name[i]) * 16777619;
+	hash >>= 32 - MPD_KEY_TABLE_BITS;
+
+	if(mpd_keyTable[hash].length != length ||
+	   memcmp(mpd_keyTable[hash].name, name, length))
+		return MPD_KEY_UNKNOWN;
+	return mpd_keyTable[hash].key;
+}
+
+/* how a key's value is stored into the struct being decoded */
+enum mpd_FieldType {
+	MPD_FIELD_NONE = 0,
+	/* int, last value wins */
+	MPD_FIELD_INT,
+	/* int that is only set while it is still -1 */
+	MPD_FIELD_NUM,
+	MPD_FIELD_ULONG,
+	MPD_FIELD_LONGLONG,
+	/* string, first value wins */
+	MPD_FIELD_STRING,
+	/* string, further values are appended; only songs have these,
+	 * and they are put together by mpd_packSong */
+	MPD_FIELD_JOIN
+};
+
+/* a decoder's table is indexed by key; keys not in it are skipped */
+typedef struct _mpd_KeyField {
+	unsigned short offset;
+	unsigned char type;
+} mpd_KeyField;
+
+static const mpd_KeyField mpd_statusFields[MPD_KEY_COUNT] = {
+	[MPD_KEY_VOLUME] = { offsetof(mpd_Status, volume), MPD_FIELD_INT },
+	[MPD_KEY_REPEAT] = { offsetof(mpd_Status, repeat), MPD_FIELD_INT },
+	[MPD_KEY_SINGLE] = { offsetof(mpd_Status, single), MPD_FIELD_INT },
+	[MPD_KEY_CONSUME] = { offsetof(mpd_Status, consume), MPD_FIELD_INT },
+	[MPD_KEY_RANDOM] = { offsetof(mpd_Status, random), MPD_FIELD_INT },
+	[MPD_KEY_PLAYLIST] = { offsetof(mpd_Status, playlist), MPD_FIELD_LONGLONG },
+	[MPD_KEY_PLAYLISTLENGTH] = { offsetof(mpd_Status, playlistLength), MPD_FIELD_INT },
+	[MPD_KEY_BITRATE] = { offsetof(mpd_Status, bitRate), MPD_FIELD_INT },
+	[MPD_KEY_SONG] = { offsetof(mpd_Status, song), MPD_FIELD_INT },
+	[MPD_KEY_SONGID] = { offsetof(mpd_Status, songid), MPD_FIELD_INT },
+	[MPD_KEY_NEXTSONG] = { offsetof(mpd_Status, nextsong), MPD_FIELD_INT },
+	[MPD_KEY_NEXTSONGID] = { offsetof(mpd_Status, nextsongid), MPD_FIELD_INT },
+	[MPD_KEY_XFADE] = { offsetof(mpd_Status, crossfade), MPD_FIELD_INT },
+	[MPD_KEY_UPDATING_DB] = { offsetof(mpd_Status, updatingDb), MPD_FIELD_INT },
+};
+
+static const mpd_KeyField mpd_statsFields[MPD_KEY_COUNT] = {
+	[MPD_KEY_ARTISTS] = { offsetof(mpd_Stats, numberOfArtists), MPD_FIELD_INT },
+	[MPD_KEY_ALBUMS] = { offsetof(mpd_Stats, numberOfAlbums), MPD_FIELD_INT },
+	[MPD_KEY_SONGS] = { offsetof(mpd_Stats, numberOfSongs), MPD_FIELD_INT },
+	[MPD_KEY_UPTIME] = { offsetof(mpd_Stats, uptime), MPD_FIELD_ULONG },
+	[MPD_KEY_DB_UPDATE] = { offsetof(mpd_Stats, dbUpdateTime), MPD_FIELD_ULONG },
+	[MPD_KEY_PLAYTIME] = { offsetof(mpd_Stats, playTime), MPD_FIELD_ULONG },
+	[MPD_KEY_DB_PLAYTIME] = { offsetof(mpd_Stats, dbPlayTime), MPD_FIELD_ULONG },
+};
+
+static const mpd_KeyField mpd_searchStatsFields[MPD_KEY_COUNT] = {
+	[MPD_KEY_SONGS] = { offsetof(mpd_SearchStats, numberOfSongs), MPD_FIELD_INT },
+	[MPD_KEY_PLAYTIME] = { offsetof(mpd_SearchStats, playTime), MPD_FIELD_ULONG },
+};
+
+static const mpd_KeyField mpd_songFields[MPD_KEY_COUNT] = {
+	[MPD_KEY_ARTIST] = { offsetof(mpd_Song, artist), MPD_FIELD_JOIN },
+	[MPD_KEY_ALBUM] = { offsetof(mpd_Song, album), MPD_FIELD_STRING },
+	[MPD_KEY_TITLE] = { offsetof(mpd_Song, title), MPD_FIELD_STRING },
+	[MPD_KEY_TRACK] = { offsetof(mpd_Song, track), MPD_FIELD_STRING },
+	[MPD_KEY_NAME] = { offsetof(mpd_Song, name), MPD_FIELD_STRING },
+	[MPD_KEY_SONG_TIME] = { offsetof(mpd_Song, time), MPD_FIELD_NUM },
+	[MPD_KEY_POS] = { offsetof(mpd_Song, pos), MPD_FIELD_NUM },
+	[MPD_KEY_ID] = { offsetof(mpd_Song, id), MPD_FIELD_NUM },
+	[MPD_KEY_DATE] = { offsetof(mpd_Song, date), MPD_FIELD_STRING },
+	[MPD_KEY_GENRE] = { offsetof(mpd_Song, genre), MPD_FIELD_STRING },
+	[MPD_KEY_COMPOSER] = { offsetof(mpd_Song, composer), MPD_FIELD_JOIN },
+	[MPD_KEY_PERFORMER] = { offsetof(mpd_Song, performer), MPD_FIELD_JOIN },
+	[MPD_KEY_DISC] = { offsetof(mpd_Song, disc), MPD_FIELD_STRING },
+	[MPD_KEY_COMMENT] = { offsetof(mpd_Song, comment), MPD_FIELD_STRING },
+	[MPD_KEY_ALBUMARTIST] = { offsetof(mpd_Song, albumartist), MPD_FIELD_STRING },
+};
+
+static const mpd_KeyField mpd_playlistFileFields[MPD_KEY_COUNT] = {
+	[MPD_KEY_LAST_MODIFIED] = { offsetof(mpd_PlaylistFile, mtime), MPD_FIELD_STRING },
+};
+
+static char * mpd_keepValue(mpd_Connection * connection,
+                            const mpd_ReturnElement * re);
+
+/* store the current value into object as fields says, returns 0 if
+ * the key isn't one of them */
+static int mpd_decodeField(mpd_Connection * connection, void * object,
+                           const mpd_KeyField * fields,
+                           const mpd_ReturnElement * re)
+{
+	const mpd_KeyField * field = &fields[re->key];
+	char * p = (char *)object + field->offset;
 
-	c = arg;
-	rc = ret;
-	for(i = strlen(arg)+1; i != 0; --i) {
-		if(*c=='"' || *c=='\\')
-			*rc++ = '\\';
-		*(rc++) = *(c++);
+	switch(field->type) {
+	case MPD_FIELD_INT:
+		*(int *)p = atoi(re->value);
+		break;
+	case MPD_FIELD_NUM:
+		if(*(int *)p == -1) *(int *)p = atoi(re->value);
+		break;
+	case MPD_FIELD_ULONG:
+		*(unsigned long *)p = strtol(re->value,NULL,10);
+		break;
+	case MPD_FIELD_LONGLONG:
+		*(long long *)p = strtol(re->value,NULL,10);
+		break;
+	case MPD_FIELD_STRING:
+		if(!*(char **)p) *(char **)p = mpd_keepValue(connection, re);
+		break;
+	default:
+		return 0;
 	}
+	return 1;
+}
+
+/* the element points into the response buffer, where the line has
+ * been split in place; it is only good until the next line is read, so
+ * anything kept from it has to be copied */
+static mpd_ReturnElement * mpd_setReturnElement(mpd_Connection * connection,
+                                                char * name, int nameLen,
+                                                char * value, int valueLen)
+{
+	mpd_ReturnElement * ret = &connection->element;
+
+	ret->name = name;
+	ret->nameLen = nameLen;
+	ret->value = value;
+	ret->valueLen = valueLen;
+	ret->key = mpd_lookupKey(name, nameLen);
 
 	return ret;
 }
 
-static mpd_ReturnElement * mpd_newReturnElement(const char * name, const char * value)
+void mpd_setMaxBufferLength(mpd_Connection * connection, int length) {
+	connection->maxBuffer = length;
+}
+
+/* Make room after buflen for more input and return how much there is,
+ * or 0 if the unread line already fills as much buffer as we may have.
+ * Input is appended until everything read has been used up, which
+ * with responses being whole lines is most of the time; then we start
+ * again at the front.  Only when the end of the buffer is reached with
+ * part of a line unread is that part moved to the front, or the buffer
+ * grown to hold it. */
+static int mpd_reserveBuffer(mpd_Connection * connection) {
+	int unread = connection->buflen - connection->bufstart;
+
+	if(unread == 0) {
+		connection->buflen = connection->bufstart = 0;
+	}
+	if(connection->buflen < connection->bufsize) {
+		return connection->bufsize - connection->buflen;
+	}
+
+	if(connection->bufstart > 0 && (unread <= connection->bufsize/2 ||
+	                                connection->bufsize >= connection->maxBuffer)) {
+		int i;
+
+		memmove(connection->buffer,
+		        connection->buffer+connection->bufstart, unread);
+		for(i = connection->lineNext; i < connection->lineCount; i++) {
+			mpd_LineSpan * line = &connection->lines[i];
+			line->start -= connection->bufstart;
+			if(line->colon >= 0) line->colon -= connection->bufstart;
+			line->end -= connection->bufstart;
+		}
+		connection->buflen = unread;
+		connection->bufstart = 0;
+	}
+	else if(connection->bufsize < connection->maxBuffer) {
+		int size = connection->bufsize ?
+			connection->bufsize*2 : MPD_BUFFER_INITIAL_LENGTH;
+		if(size > connection->maxBuffer) size = connection->maxBuffer;
+		connection->buffer = realloc(connection->buffer, size+1);
+		connection->bufsize = size;
+	}
+	return connection->bufsize - connection->buflen;
+}
+
+/* once a response has been read, give back what a big one needed */
+static void mpd_shrinkBuffer(mpd_Connection * connection) {
+	if(connection->buflen == connection->bufstart &&
+	   connection->bufsize > 16*MPD_BUFFER_INITIAL_LENGTH)
+	{
+		free(connection->buffer);
+		connection->buffer = NULL;
+		connection->bufsize = connection->buflen = connection->bufstart = 0;
+	}
+}
+
+/* TOKENIZER */
+
+/* Split the buffered input after bufstart into lines and find the ':'
+ * in each, filling connection->lines.  The scan looks at each byte of
+ * input once, using SSE2 or AVX2 compares to test 16 or 32 bytes at a
+ * time where the cpu has them. */
+
+typedef struct _mpd_LineScan {
+	mpd_Connection * connection;
+	const char * buffer;
+	int start;
+	int colon;
+} mpd_LineScan;
+
+/* record the line ending at end; returns 1 once the index is full */
+static int mpd_addLine(mpd_LineScan * scan, int end) {
+	mpd_Connection * connection = scan->connection;
+	mpd_LineSpan * line = &connection->lines[connection->lineCount++];
+
+	line->start = scan->start;
+	line->colon = scan->colon;
+	line->end = end;
+	scan->start = end+1;
+	scan->colon = -1;
+	return connection->lineCount == MPD_LINE_INDEX_LENGTH;
+}
+
+/* scalar scan of [pos, end), returns where it stopped */
+static int mpd_scanBytes(mpd_LineScan * scan, int pos, int end) {
+	const char * buffer = scan->buffer;
+
+	for(; pos < end; pos++) {
+		if(buffer[pos] == '\n') {
+			if(mpd_addLine(scan, pos)) return pos+1;
+		}
+		else if(buffer[pos] == ':' && scan->colon < 0) scan->colon = pos;
+	}
+	return pos;
+}
+
+/* handle a block at base with newline and colon bit masks, bit i
+ * standing for byte base+i; returns the byte after the last line
+ * taken if the index filled up, else -1 */
+static inline int mpd_scanMasks(mpd_LineScan * scan, int base,
+                                guint32 newlines, guint32 colons)
 {
-	mpd_ReturnElement* ret = g_slice_new(mpd_ReturnElement);
+	while(newlines) {
+		int bit = __builtin_ctz(newlines);
+		guint32 before = colons & (((guint32)1 << bit)-1);
+
+		if(before && scan->colon < 0) scan->colon = base+__builtin_ctz(before);
+		colons &= ~(((guint32)2 << bit)-1);
+		newlines &= newlines-1;
+		if(mpd_addLine(scan, base+bit)) return base+bit+1;
+	}
+	if(colons && scan->colon < 0) scan->colon = base+__builtin_ctz(colons);
+	return -1;
+}
+
+#ifdef MPD_HAVE_SSE2
+static int mpd_scanSse2(mpd_LineScan * scan, int pos, int end) {
+	const __m128i newline = _mm_set1_epi8('\n');
+	const __m128i colon = _mm_set1_epi8(':');
+	int stop;
+
+	for(; pos+16 <= end; pos += 16) {
+		__m128i bytes = _mm_loadu_si128((const __m128i *)(scan->buffer+pos));
+		stop = mpd_scanMasks(scan, pos,
+			_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline)),
+			_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, colon)));
+		if(stop >= 0) return stop;
+	}
+	return mpd_scanBytes(scan, pos, end);
+}
+#endif
 
-	ret->name = strdup(name);
-	ret->value = strdup(value);
+#ifdef MPD_HAVE_AVX2
+__attribute__((target("avx2")))
+static int mpd_scanAvx2(mpd_LineScan * scan, int pos, int end) {
+	const __m256i newline = _mm256_set1_epi8('\n');
+	const __m256i colon = _mm256_set1_epi8(':');
+	int stop;
+
+	for(; pos+32 <= end; pos += 32) {
+		__m256i bytes = _mm256_loadu_si256((const __m256i *)(scan->buffer+pos));
+		stop = mpd_scanMasks(scan, pos,
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, newline)),
+			_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, colon)));
+		if(stop >= 0) return stop;
+	}
+	return mpd_scanBytes(scan, pos, end);
+}
+#endif
 
-	return ret;
+#ifdef MPD_HAVE_SSE2
+static int (*mpd_scanLines)(mpd_LineScan * scan, int pos, int end) = mpd_scanSse2;
+#else
+static int (*mpd_scanLines)(mpd_LineScan * scan, int pos, int end) = mpd_scanBytes;
+#endif
+
+#ifdef MPD_HAVE_AVX2
+/* runs at load time, before any thread can be tokenizing */
+__attribute__((constructor))
+static void mpd_pickScanner(void) {
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) mpd_scanLines = mpd_scanAvx2;
+}
+#endif
+
+/* index the complete lines after bufstart, returns how many there are */
+static int mpd_tokenize(mpd_Connection * connection) {
+	mpd_LineScan scan;
+	int pos;
+
+	connection->lineNext = connection->lineCount = 0;
+	if(!connection->buffer) return 0;
+
+	scan.connection = connection;
+	scan.buffer = connection->buffer;
+	scan.start = connection->bufstart;
+	scan.colon = connection->lineColon < 0 ? -1 :
+	             connection->bufstart+connection->lineColon;
+
+	pos = mpd_scanLines(&scan, connection->bufstart+connection->lineScanned,
+	                    connection->buflen);
+
+	connection->lineScanned = pos-scan.start;
+	connection->lineColon = scan.colon < 0 ? -1 : scan.colon-scan.start;
+	return connection->lineCount;
 }
 
-static void mpd_freeReturnElement(mpd_ReturnElement * re) {
-	free(re->name);
-	free(re->value);
-	g_slice_free(mpd_ReturnElement, re);
+/* whether a whole line is waiting in the buffer */
+static int mpd_hasLine(mpd_Connection * connection) {
+	return connection->lineNext < connection->lineCount ||
+	       mpd_tokenize(connection) > 0;
 }
 
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout) {
@@ -432,13 +891,15 @@ static int mpd_connect_un(mpd_Connection * connection,
 
 	error = connect(connection->sock, (struct sockaddr*)&saun, sizeof(saun));
 	if (error < 0) {
+		int connect_errno = errno;
+
 		/* try the next address family */
 		close(connection->sock);
-		connection->sock = 0;
+		connection->sock = -1;
 
-		snprintf(connection->errorStr,MPD_BUFFER_MAX_LENGTH,
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 			 "problems connecting to \"%s\": %s",
-			 host, strerror(errno));
+			 host, strerror(connect_errno));
 		connection->error = MPD_ERROR_CONNPORT;
 		return -1;
 	}
@@ -452,10 +913,9 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	char * rt;
 	char * output =  NULL;
 	mpd_Connection * connection = g_slice_new0(mpd_Connection);
-	struct timeval tv;
-	fd_set fds;
-	strcpy(connection->buffer,"");
 	connection->sock = -1;
+	connection->maxBuffer = MPD_BUFFER_MAX_LENGTH;
+	connection->lineColon = -1;
 	strcpy(connection->errorStr,"");
 
 	if (winsock_dll_error(connection))
@@ -470,16 +930,21 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	if (err < 0)
 		return connection;
 
-	while(!(rt = strstr(connection->buffer,"\n"))) {
-		tv.tv_sec = connection->timeout.tv_sec;
-		tv.tv_usec = connection->timeout.tv_usec;
-		FD_ZERO(&fds);
-		FD_SET(connection->sock,&fds);
-		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv)) == 1) {
+	while(!connection->buflen ||
+	      !(rt = memchr(connection->buffer,'\n',connection->buflen))) {
+		int space = mpd_reserveBuffer(connection);
+		if(space == 0) {
+			snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+					"no welcome from \"%s\" on port %i",
+					host,port);
+			connection->error = MPD_ERROR_NOTMPD;
+			return connection;
+		}
+		if((err = mpd_wait(connection, MPD_WAIT_READ)) > 0) {
 			int readed;
 			readed = recv(connection->sock,
 					&(connection->buffer[connection->buflen]),
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,0);
+					space,0);
 			if(readed<=0) {
 				snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
 						"problems getting a response from"
@@ -492,7 +957,7 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 			connection->buffer[connection->buflen] = '\0';
 		}
 		else if(err<0) {
- 			if (SELECT_ERRNO_IGNORE)
+			if (WAIT_ERRNO_IGNORE)
 				continue;
 			snprintf(connection->errorStr,
 					MPD_ERRORSTR_MAX_LENGTH,
@@ -511,14 +976,11 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout) {
 	}
 
 	*rt = '\0';
-	output = strdup(connection->buffer);
-	strcpy(connection->buffer,rt+1);
-	connection->buflen = strlen(connection->buffer);
+	output = connection->buffer;
+	connection->bufstart = rt - connection->buffer + 1;
 
 	if(mpd_parseWelcome(connection,host,port,output) == 0) connection->doneProcessing = 1;
 
-	free(output);
-
 	return connection;
 }
 
@@ -527,242 +989,1617 @@ void mpd_clearError(mpd_Connection * connection) {
 	connection->errorStr[0] = '\0';
 }
 
+#ifndef WIN32
+static void mpd_detachAsync(mpd_Connection * connection);
+static void mpd_startMirrorSearch(mpd_Connection * connection);
+static void mpd_addMirrorConstraint(mpd_Connection * connection, int type,
+                                    const char * value);
+static int mpd_searchMirror(mpd_Connection * connection);
+static void mpd_dropMirrorSearch(mpd_Connection * connection);
+static void mpd_dropMirrorResults(mpd_Connection * connection);
+static mpd_InfoEntity * mpd_getNextMirrorEntity(mpd_Connection * connection);
+static int mpd_visitMirrorResults(mpd_Connection * connection,
+                                  unsigned int tags,
+                                  mpd_EntityVisitor visitor, void * userdata);
+#endif
+
 void mpd_closeConnection(mpd_Connection * connection) {
-	closesocket(connection->sock);
-	if(connection->returnElement) free(connection->returnElement);
+#ifndef WIN32
+	if (connection->async)
+		mpd_detachAsync(connection);
+	mpd_dropMirrorSearch(connection);
+	mpd_dropMirrorResults(connection);
+#endif
+	if (connection->sock >= 0)
+		closesocket(connection->sock);
 	if(connection->request) free(connection->request);
+	if(connection->pending) free(connection->pending);
+	if(connection->buffer) free(connection->buffer);
+	if(connection->songText) g_string_free(connection->songText, TRUE);
+	if(connection->songValues) g_array_free(connection->songValues, TRUE);
 	g_slice_free(mpd_Connection, connection);
 	WSACleanup();
 }
 
-static void mpd_executeCommand(mpd_Connection * connection,const char * command) {
-	int ret;
-	struct timeval tv;
-	fd_set fds;
-	const char * commandPtr = command;
-	int commandLen = strlen(command);
+/* REACTOR */
 
-	if(!connection->doneProcessing && !connection->commandList) {
-		strcpy(connection->errorStr,"not done processing current command");
-		connection->error = 1;
-		return;
-	}
+#ifndef WIN32
 
-	mpd_clearError(connection);
+#define MPD_REACTOR_EVENTS	64
+
+typedef struct _mpd_ReactorEntry {
+	mpd_Connection * connection;
+	mpd_ReactorCallback callback;
+	void * userdata;
+	int ready;
+} mpd_ReactorEntry;
+
+struct _mpd_Reactor {
+	/* -1 when there is no epoll, the sockets are polled instead */
+	int epfd;
+	GPtrArray * entries;
+	/* entries removed by a callback, freed once mpd_reactorWait is
+	 * done with them */
+	GSList * removed;
+	int dispatching;
+};
 
-	FD_ZERO(&fds);
-	FD_SET(connection->sock,&fds);
-	tv.tv_sec = connection->timeout.tv_sec;
-	tv.tv_usec = connection->timeout.tv_usec;
-    while((ret = select(connection->sock+1,NULL,&fds,NULL,&tv)==1) ||
-			(ret==-1 && SELECT_ERRNO_IGNORE)) {
-        fflush(NULL);
-		ret = send(connection->sock,commandPtr,commandLen,MSG_DONTWAIT);
-		if(ret<=0)
-		{
-			if (SENDRECV_ERRNO_IGNORE) continue;
-			snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
-			         "problems giving command \"%s\"",command);
-			connection->error = MPD_ERROR_SENDING;
-			return;
-		}
-		else {
-			commandPtr+=ret;
-			commandLen-=ret;
-		}
+mpd_Reactor * mpd_newReactor(void) {
+	mpd_Reactor * reactor = g_slice_new0(mpd_Reactor);
 
-		if(commandLen<=0) break;
-	}
-	if(commandLen>0) {
-		perror("");
-		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
-		         "timeout sending command \"%s\"",command);
-		connection->error = MPD_ERROR_TIMEOUT;
-		return;
+	reactor->entries = g_ptr_array_new();
+	reactor->epfd = -1;
+#ifdef MPD_HAVE_EPOLL
+	reactor->epfd = epoll_create(MPD_REACTOR_EVENTS);
+	if(reactor->epfd >= 0)
+		fcntl(reactor->epfd, F_SETFD, FD_CLOEXEC);
+#endif
+	return reactor;
+}
+
+int mpd_reactorAdd(mpd_Reactor * reactor, mpd_Connection * connection,
+                   mpd_ReactorCallback callback, void * userdata)
+{
+	mpd_ReactorEntry * entry;
+
+	if(connection->sock < 0) return -1;
+
+	entry = g_slice_new0(mpd_ReactorEntry);
+	entry->connection = connection;
+	entry->callback = callback;
+	entry->userdata = userdata;
+#ifdef MPD_HAVE_EPOLL
+	if(reactor->epfd >= 0) {
+		struct epoll_event event;
+
+		memset(&event, 0, sizeof(event));
+		event.events = EPOLLIN;
+		event.data.ptr = entry;
+		if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, connection->sock,
+		             &event) < 0) {
+			g_slice_free(mpd_ReactorEntry, entry);
+			return -1;
+		}
 	}
+#endif
+	g_ptr_array_add(reactor->entries, entry);
+	return 0;
+}
 
-	if(!connection->commandList) connection->doneProcessing = 0;
-	else if(connection->commandList == COMMAND_LIST_OK) {
-		connection->listOks++;
+static void mpd_freeReactorEntry(mpd_Reactor * reactor,
+                                 mpd_ReactorEntry * entry)
+{
+	if(reactor->dispatching) {
+		entry->connection = NULL;
+		reactor->removed = g_slist_prepend(reactor->removed, entry);
+	}
+	else {
+		g_slice_free(mpd_ReactorEntry, entry);
 	}
 }
 
-static void mpd_getNextReturnElement(mpd_Connection * connection) {
-	char * output = NULL;
-	char * rt = NULL;
-	char * name = NULL;
-	char * value = NULL;
-	fd_set fds;
-	struct timeval tv;
-	char * tok = NULL;
-	int readed;
-	char * bufferCheck = NULL;
-	int err;
-	int pos;
+void mpd_reactorRemove(mpd_Reactor * reactor, mpd_Connection * connection) {
+	guint i;
 
-	if(connection->returnElement) mpd_freeReturnElement(connection->returnElement);
-	connection->returnElement = NULL;
+	for(i = 0; i < reactor->entries->len; i++) {
+		mpd_ReactorEntry * entry = g_ptr_array_index(reactor->entries, i);
 
-	if(connection->doneProcessing || (connection->listOks &&
-	   connection->doneListOk))
-	{
-		strcpy(connection->errorStr,"already done processing current command");
-		connection->error = 1;
+		if(entry->connection != connection) continue;
+#ifdef MPD_HAVE_EPOLL
+		if(reactor->epfd >= 0) {
+			struct epoll_event event;
+			epoll_ctl(reactor->epfd, EPOLL_CTL_DEL, connection->sock,
+			          &event);
+		}
+#endif
+		g_ptr_array_remove_index_fast(reactor->entries, i);
+		mpd_freeReactorEntry(reactor, entry);
 		return;
 	}
+}
 
-	bufferCheck = connection->buffer+connection->bufstart;
-	while(connection->bufstart>=connection->buflen ||
-			!(rt = strchr(bufferCheck,'\n'))) {
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			memmove(connection->buffer,
-					connection->buffer+
-					connection->bufstart,
-					connection->buflen-
-					connection->bufstart+1);
-			connection->buflen-=connection->bufstart;
-			connection->bufstart = 0;
-		}
-		if(connection->buflen>=MPD_BUFFER_MAX_LENGTH) {
-			strcpy(connection->errorStr,"buffer overrun");
-			connection->error = MPD_ERROR_BUFFEROVERRUN;
-			connection->doneProcessing = 1;
-			connection->doneListOk = 0;
-			return;
-		}
-		bufferCheck = connection->buffer+connection->buflen;
-		tv.tv_sec = connection->timeout.tv_sec;
-		tv.tv_usec = connection->timeout.tv_usec;
-		FD_ZERO(&fds);
-		FD_SET(connection->sock,&fds);
-		if((err = select(connection->sock+1,&fds,NULL,NULL,&tv) == 1)) {
-			readed = recv(connection->sock,
-					connection->buffer+connection->buflen,
-					MPD_BUFFER_MAX_LENGTH-connection->buflen,
-					MSG_DONTWAIT);
-			if(readed<0 && SENDRECV_ERRNO_IGNORE) {
-				continue;
-			}
-			if(readed<=0) {
-				strcpy(connection->errorStr,"connection"
-				       " closed");
-				connection->error = MPD_ERROR_CONNCLOSED;
-				connection->doneProcessing = 1;
-				connection->doneListOk = 0;
-				return;
-			}
-			connection->buflen+=readed;
-			connection->buffer[connection->buflen] = '\0';
-		}
-		else if(err<0 && SELECT_ERRNO_IGNORE) continue;
-		else {
-			strcpy(connection->errorStr,"connection timeout");
-			connection->error = MPD_ERROR_TIMEOUT;
-			connection->doneProcessing = 1;
-			connection->doneListOk = 0;
-			return;
-		}
-	}
+/* collect the entries whose sockets are readable into ready */
+static int mpd_reactorPoll(mpd_Reactor * reactor, GPtrArray * ready,
+                           int timeout)
+{
+	int i, n;
 
-	*rt = '\0';
-	output = connection->buffer+connection->bufstart;
-	connection->bufstart = rt - connection->buffer + 1;
+#ifdef MPD_HAVE_EPOLL
+	if(reactor->epfd >= 0) {
+		struct epoll_event events[MPD_REACTOR_EVENTS];
 
-	if(strcmp(output,"OK")==0) {
-		if(connection->listOks > 0) {
-			strcpy(connection->errorStr, "expected more list_OK's");
-			connection->error = 1;
+		n = epoll_wait(reactor->epfd, events, MPD_REACTOR_EVENTS, timeout);
+		for(i = 0; i < n; i++) {
+			mpd_ReactorEntry * entry = events[i].data.ptr;
+			if(!entry->ready) g_ptr_array_add(ready, entry);
+			entry->ready = 1;
 		}
-		connection->listOks = 0;
-		connection->doneProcessing = 1;
-		connection->doneListOk = 0;
-		return;
+		return n;
 	}
-
-	if(strcmp(output, "list_OK") == 0) {
-		if(!connection->listOks) {
-			strcpy(connection->errorStr,
-					"got an unexpected list_OK");
-			connection->error = 1;
+#endif
+	{
+		int count = reactor->entries->len;
+		struct pollfd * fds = g_new(struct pollfd, count);
+
+		for(i = 0; i < count; i++) {
+			mpd_ReactorEntry * entry = g_ptr_array_index(reactor->entries, i);
+			fds[i].fd = entry->connection->sock;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
 		}
-		else {
-			connection->doneListOk = 1;
-			connection->listOks--;
+		n = poll(fds, count, timeout);
+		for(i = 0; n > 0 && i < count; i++) {
+			mpd_ReactorEntry * entry = g_ptr_array_index(reactor->entries, i);
+			if(!fds[i].revents || entry->ready) continue;
+			g_ptr_array_add(ready, entry);
+			entry->ready = 1;
 		}
-		return;
+		g_free(fds);
+		return n;
 	}
+}
 
-	if(strncmp(output,"ACK",strlen("ACK"))==0) {
-		char * test;
-		char * needle;
-		int val;
+int mpd_reactorWait(mpd_Reactor * reactor, int timeout) {
+	GPtrArray * ready = g_ptr_array_new();
+	int dispatched = 0;
+	guint i;
 
-		strcpy(connection->errorStr, output);
-		connection->error = MPD_ERROR_ACK;
-		connection->errorCode = MPD_ACK_ERROR_UNK;
-		connection->errorAt = MPD_ERROR_AT_UNK;
-		connection->doneProcessing = 1;
-		connection->doneListOk = 0;
+	/* a response that is already in a connection's buffer won't make
+	 * its socket readable again.  Only a whole line counts: with part
+	 * of one the callback would block reading the rest. */
+	for(i = 0; i < reactor->entries->len; i++) {
+		mpd_ReactorEntry * entry = g_ptr_array_index(reactor->entries, i);
+		mpd_Connection * connection = entry->connection;
 
-		needle = strchr(output, '[');
-		if(!needle) return;
-		val = strtol(needle+1, &test, 10);
-		if(*test != '@') return;
-		connection->errorCode = val;
-		val = strtol(test+1, &test, 10);
-		if(*test != ']') return;
-		connection->errorAt = val;
-		return;
+		if(mpd_hasLine(connection)) {
+			g_ptr_array_add(ready, entry);
+			entry->ready = 1;
+		}
 	}
 
-	tok = strchr(output, ':');
-	if (!tok) return;
-	pos = tok - output;
-	value = ++tok;
-	name = output;
-	name[pos] = '\0';
-
-	if(value[0]==' ') {
-		connection->returnElement = mpd_newReturnElement(name,&(value[1]));
+	if(mpd_reactorPoll(reactor, ready, ready->len ? 0 : timeout) < 0 &&
+	   !WAIT_ERRNO_IGNORE) {
+		for(i = 0; i < ready->len; i++)
+			((mpd_ReactorEntry *)g_ptr_array_index(ready, i))->ready = 0;
+		g_ptr_array_free(ready, TRUE);
+		return -1;
 	}
-	else {
-		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
-					"error parsing: %s:%s",name,value);
-		connection->error = 1;
+
+	reactor->dispatching = 1;
+	for(i = 0; i < ready->len; i++) {
+		mpd_ReactorEntry * entry = g_ptr_array_index(ready, i);
+
+		entry->ready = 0;
+		if(!entry->connection) continue;
+		entry->callback(entry->connection, entry->userdata);
+		dispatched++;
 	}
-}
+	reactor->dispatching = 0;
 
-void mpd_finishCommand(mpd_Connection * connection) {
-	while(!connection->doneProcessing) {
-		if(connection->doneListOk) connection->doneListOk = 0;
-		mpd_getNextReturnElement(connection);
+	while(reactor->removed) {
+		g_slice_free(mpd_ReactorEntry, reactor->removed->data);
+		reactor->removed = g_slist_delete_link(reactor->removed,
+		                                       reactor->removed);
 	}
+	g_ptr_array_free(ready, TRUE);
+	return dispatched;
 }
 
-static void mpd_finishListOkCommand(mpd_Connection * connection) {
-	while(!connection->doneProcessing && connection->listOks &&
-			!connection->doneListOk)
-	{
-		mpd_getNextReturnElement(connection);
-	}
+void mpd_freeReactor(mpd_Reactor * reactor) {
+	guint i;
+
+	for(i = 0; i < reactor->entries->len; i++)
+		g_slice_free(mpd_ReactorEntry,
+		             g_ptr_array_index(reactor->entries, i));
+	g_ptr_array_free(reactor->entries, TRUE);
+	if(reactor->epfd >= 0) close(reactor->epfd);
+	g_slice_free(mpd_Reactor, reactor);
 }
 
-int mpd_nextListOkCommand(mpd_Connection * connection) {
-	mpd_finishListOkCommand(connection);
-	if(!connection->doneProcessing) connection->doneListOk = 0;
-	if(connection->listOks == 0 || connection->doneProcessing) return -1;
+#endif /* !WIN32 */
+
+/* ASYNC */
+
+#ifndef WIN32
+
+typedef struct _mpd_AsyncRequest {
+	char * command;
+	int commandLen;
+	int listOks;
+	int idle;
+	mpd_AsyncCallback callback;
+	void * userdata;
+} mpd_AsyncRequest;
+
+/* requests are written as soon as they are queued and wait in inflight
+ * for their responses, which mpd sends in the same order.  only noidle
+ * may follow an idle, so whatever is queued behind one is held back in
+ * requests until the idle has been answered */
+struct _mpd_AsyncSource {
+	GSource source;
+	GPollFD pollfd;
+	/* NULL once the connection has been closed */
+	mpd_Connection * connection;
+	GQueue * requests;
+	GQueue * inflight;
+	/* bytes still to be written start at sent */
+	GString * output;
+	gsize sent;
+	/* bytes of the first response known not to hold its end */
+	int scanned;
+	/* callback for the next command queued */
+	mpd_AsyncCallback callback;
+	void * userdata;
+	/* MPD_ERROR_* once the connection is lost, all requests fail */
+	int failed;
+	char failStr[MPD_ERRORSTR_MAX_LENGTH+1];
+};
+
+static void mpd_freeAsyncRequest(mpd_AsyncRequest * request) {
+	g_free(request->command);
+	g_slice_free(mpd_AsyncRequest, request);
+}
+
+static void mpd_asyncFail(mpd_AsyncSource * async, int error,
+                          const char * message)
+{
+	if(async->failed) return;
+	async->failed = error;
+	g_strlcpy(async->failStr, message, sizeof(async->failStr));
+	g_source_remove_poll(&async->source, &async->pollfd);
+}
+
+static void mpd_asyncWrite(mpd_AsyncSource * async) {
+	mpd_Connection * connection = async->connection;
+	int ret;
+
+	while(!async->failed && async->sent < async->output->len) {
+		ret = send(connection->sock, async->output->str+async->sent,
+		           async->output->len-async->sent, MSG_DONTWAIT);
+		if(ret<0 && SENDRECV_ERRNO_IGNORE) break;
+		if(ret<=0) {
+			mpd_asyncFail(async, MPD_ERROR_SENDING,
+			              "problems giving command");
+			return;
+		}
+		async->sent += ret;
+	}
+	if(async->sent == async->output->len) {
+		g_string_truncate(async->output, 0);
+		async->sent = 0;
+		async->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	}
+	else {
+		async->pollfd.events = G_IO_IN | G_IO_OUT | G_IO_HUP | G_IO_ERR;
+	}
+}
+
+static void mpd_asyncRead(mpd_AsyncSource * async) {
+	mpd_Connection * connection = async->connection;
+	int space, readed;
+
+	while(!async->failed) {
+		space = mpd_reserveBuffer(connection);
+		if(space == 0) {
+			mpd_asyncFail(async, MPD_ERROR_BUFFEROVERRUN, "buffer overrun");
+			return;
+		}
+		readed = recv(connection->sock,
+		              connection->buffer+connection->buflen, space,
+		              MSG_DONTWAIT);
+		if(readed<0 && SENDRECV_ERRNO_IGNORE) return;
+		if(readed<=0) {
+			mpd_asyncFail(async, MPD_ERROR_CONNCLOSED, "connection closed");
+			return;
+		}
+		connection->buflen += readed;
+		connection->buffer[connection->buflen] = '\0';
+		if(readed < space) return;
+	}
+}
+
+/* whether the whole response to the first request in flight is
+ * buffered; it ends with a line that is "OK" or starts with "ACK " */
+static int mpd_asyncComplete(mpd_AsyncSource * async) {
+	mpd_Connection * connection = async->connection;
+	char * start, * line, * end, * nl;
+
+	if(g_queue_is_empty(async->inflight)) return 0;
+	if(async->failed) return 1;
+	if(!connection->buffer) return 0;
+
+	start = connection->buffer+connection->bufstart;
+	line = start+async->scanned;
+	end = connection->buffer+connection->buflen;
+	while((nl = memchr(line, '\n', end-line))) {
+		if((nl-line == 2 && memcmp(line, "OK", 2) == 0) ||
+		   (nl-line >= 4 && memcmp(line, "ACK ", 4) == 0))
+			return 1;
+		line = nl+1;
+		async->scanned = line-start;
+	}
+	return 0;
+}
+
+/* send what is queued, up to and including the next idle */
+static void mpd_asyncFlush(mpd_AsyncSource * async) {
+	mpd_AsyncRequest * request = g_queue_peek_tail(async->inflight);
+	int sent = 0;
+
+	while((!request || !request->idle) &&
+	      (request = g_queue_pop_head(async->requests))) {
+		g_queue_push_tail(async->inflight, request);
+		if(async->failed) continue;
+		g_string_append_len(async->output, request->command,
+		                    request->commandLen);
+		sent = 1;
+	}
+	if(sent) mpd_asyncWrite(async);
+}
+
+/* hand the first buffered response to its request's callback */
+static void mpd_asyncDeliver(mpd_AsyncSource * async) {
+	mpd_Connection * connection = async->connection;
+	mpd_AsyncRequest * request = g_queue_pop_head(async->inflight);
+
+	async->scanned = 0;
+	connection->returnElement = NULL;
+	connection->doneListOk = 0;
+	connection->listOks = request->listOks;
+	connection->idle = request->idle;
+	if(async->failed) {
+		connection->doneProcessing = 1;
+		connection->error = async->failed;
+		strcpy(connection->errorStr, async->failStr);
+	}
+	else {
+		connection->doneProcessing = 0;
+		mpd_clearError(connection);
+	}
+
+	if(request->callback)
+		request->callback(connection, request->userdata);
+	mpd_freeAsyncRequest(request);
+
+	/* the callback may have closed the connection or destroyed the
+	 * source */
+	if(!async->connection) return;
+	/* drop whatever the callback didn't read */
+	if(!async->failed) mpd_finishCommand(connection);
+	connection->idle = 0;
+	if(!g_source_is_destroyed(&async->source)) mpd_asyncFlush(async);
+}
+
+static gboolean mpd_asyncPrepare(GSource * source, gint * timeout) {
+	mpd_AsyncSource * async = (mpd_AsyncSource *)source;
+
+	*timeout = -1;
+	return mpd_asyncComplete(async);
+}
+
+static gboolean mpd_asyncCheck(GSource * source) {
+	mpd_AsyncSource * async = (mpd_AsyncSource *)source;
+
+	return async->pollfd.revents != 0 || mpd_asyncComplete(async);
+}
+
+static gboolean mpd_asyncDispatch(GSource * source, GSourceFunc callback,
+                                  gpointer data)
+{
+	mpd_AsyncSource * async = (mpd_AsyncSource *)source;
+	gushort revents = async->pollfd.revents;
+
+	async->pollfd.revents = 0;
+	if(revents & G_IO_OUT)
+		mpd_asyncWrite(async);
+	if(revents & (G_IO_IN | G_IO_HUP | G_IO_ERR))
+		mpd_asyncRead(async);
+
+	while(!g_source_is_destroyed(source) && async->connection &&
+	      mpd_asyncComplete(async))
+		mpd_asyncDeliver(async);
+
+	return TRUE;
+}
+
+/* mpd_freeAsyncRequest as a GFunc for g_queue_foreach */
+static void mpd_freeAsyncRequestFunc(gpointer data, gpointer userdata) {
+	mpd_freeAsyncRequest(data);
+}
+
+static void mpd_asyncFinalize(GSource * source) {
+	mpd_AsyncSource * async = (mpd_AsyncSource *)source;
+
+	if(async->connection) async->connection->async = NULL;
+	g_queue_foreach(async->inflight, mpd_freeAsyncRequestFunc, NULL);
+	g_queue_free(async->inflight);
+	g_queue_foreach(async->requests, mpd_freeAsyncRequestFunc, NULL);
+	g_queue_free(async->requests);
+	g_string_free(async->output, TRUE);
+}
+
+static GSourceFuncs mpd_asyncFuncs = {
+	.prepare = mpd_asyncPrepare,
+	.check = mpd_asyncCheck,
+	.dispatch = mpd_asyncDispatch,
+	.finalize = mpd_asyncFinalize
+};
+
+GSource * mpd_newAsyncSource(mpd_Connection * connection) {
+	GSource * source;
+	mpd_AsyncSource * async;
+
+	if(connection->sock < 0 || connection->async ||
+	   !connection->doneProcessing)
+		return NULL;
+
+	source = g_source_new(&mpd_asyncFuncs, sizeof(mpd_AsyncSource));
+	async = (mpd_AsyncSource *)source;
+	async->connection = connection;
+	async->requests = g_queue_new();
+	async->inflight = g_queue_new();
+	async->output = g_string_new(NULL);
+	async->pollfd.fd = connection->sock;
+	async->pollfd.events = G_IO_IN | G_IO_HUP | G_IO_ERR;
+	g_source_add_poll(source, &async->pollfd);
+	connection->async = async;
+	return source;
+}
+
+void mpd_asyncRequest(mpd_Connection * connection,
+                      mpd_AsyncCallback callback, void * userdata)
+{
+	if(!connection->async) return;
+	connection->async->callback = callback;
+	connection->async->userdata = userdata;
+}
+
+/* called by mpd_executeCommand instead of sending */
+static void mpd_asyncQueue(mpd_Connection * connection,
+                           const char * command, int commandLen)
+{
+	mpd_AsyncSource * async = connection->async;
+	mpd_AsyncRequest * request = g_slice_new0(mpd_AsyncRequest);
+
+	request->command = g_strndup(command, commandLen);
+	request->commandLen = commandLen;
+	request->listOks = connection->listOks;
+	request->idle = strncmp(command, "idle", 4) == 0;
+	request->callback = async->callback;
+	request->userdata = async->userdata;
+	async->callback = NULL;
+	async->userdata = NULL;
+	connection->listOks = 0;
+
+	g_queue_push_tail(async->requests, request);
+	mpd_asyncFlush(async);
+}
+
+/* noidle has no response of its own, it just ends the idle in flight */
+static void mpd_asyncNoIdle(mpd_Connection * connection) {
+	mpd_AsyncSource * async = connection->async;
+	mpd_AsyncRequest * last = g_queue_peek_tail(async->inflight);
+
+	if(async->failed || !last || !last->idle) return;
+	g_string_append(async->output, "noidle\n");
+	mpd_asyncWrite(async);
+}
+
+static void mpd_detachAsync(mpd_Connection * connection) {
+	connection->async->connection = NULL;
+	g_source_destroy(&connection->async->source);
+	connection->async = NULL;
+}
+
+#endif /* !WIN32 */
+
+/* COMMAND ENCODING */
+
+/* commands are encoded straight into the pending buffer, behind a
+ * command list being built or pipelined commands not yet written, and
+ * are sent from there; pending+commandStart is the one being encoded
+ * and the first pendingReady bytes are complete and ready to go */
+static void mpd_reservePending(mpd_Connection * connection, int length) {
+	if(connection->pendingLen+length > connection->pendingSize) {
+		connection->pendingSize = (connection->pendingLen+length)*2;
+		connection->pending = realloc(connection->pending,
+		                              connection->pendingSize);
+	}
+}
+
+static void mpd_appendPending(mpd_Connection * connection,
+                              const char * data, int length)
+{
+	mpd_reservePending(connection, length);
+	memcpy(connection->pending+connection->pendingLen, data, length);
+	connection->pendingLen += length;
+}
+
+/* copy arg to dest with '"' and '\\' escaped, dest needs room for twice
+ * its length; returns the end of the copy */
+static char * mpd_escapeArg(char * dest, const char * arg) {
+	for(; *arg; arg++) {
+		if(*arg == '"' || *arg == '\\') *dest++ = '\\';
+		*dest++ = *arg;
+	}
+	return dest;
+}
+
+static void mpd_beginCommand(mpd_Connection * connection, const char * name) {
+	connection->commandStart = connection->pendingLen;
+	mpd_appendPending(connection, name, strlen(name));
+}
+
+static void mpd_addArg(mpd_Connection * connection, const char * arg) {
+	char * p;
+
+	mpd_reservePending(connection, 2*strlen(arg)+3);
+	p = connection->pending+connection->pendingLen;
+	*p++ = ' ';
+	*p++ = '"';
+	p = mpd_escapeArg(p, arg);
+	*p++ = '"';
+	connection->pendingLen = p-connection->pending;
+}
+
+static void mpd_addIntArg(mpd_Connection * connection, long long value) {
+	char arg[LONGLONGLEN+1];
+
+	snprintf(arg, sizeof(arg), "%lld", value);
+	mpd_addArg(connection, arg);
+}
+
+/* write out the first pendingReady bytes of pending */
+static int mpd_flushPending(mpd_Connection * connection) {
+	const char * data = connection->pending;
+	int length = connection->pendingReady;
+	/* whether send failed, rather than the wait for the socket */
+	int sendFailed = 0;
+	int ret;
+
+	while(length > 0 && ((ret = mpd_wait(connection, MPD_WAIT_WRITE)) > 0 ||
+	                     (ret<0 && WAIT_ERRNO_IGNORE))) {
+		if(ret<0) continue;
+		ret = send(connection->sock,data,length,MSG_DONTWAIT);
+		if(ret<=0) {
+			if (SENDRECV_ERRNO_IGNORE) continue;
+			sendFailed = 1;
+			break;
+		}
+		data+=ret;
+		length-=ret;
+	}
+	if(length>0) {
+		const char * end = memchr(connection->pending, '\n',
+		                          connection->pendingReady);
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+		         "%s command \"%.*s\"",
+		         sendFailed ? "problems giving" : "timeout sending",
+		         (int)(end-connection->pending), connection->pending);
+		connection->error = sendFailed ? MPD_ERROR_SENDING :
+		                                 MPD_ERROR_TIMEOUT;
+		connection->pendingLen = connection->pendingReady = 0;
+		return -1;
+	}
+
+	connection->pendingLen -= connection->pendingReady;
+	memmove(connection->pending, connection->pending+connection->pendingReady,
+	        connection->pendingLen);
+	connection->pendingReady = 0;
+	return 0;
+}
+
+/* the command at pending+commandStart is complete: send it, with
+ * whatever was held back in front of it */
+static void mpd_endCommand(mpd_Connection * connection) {
+	const char * command;
+	int commandLen;
+	/* when pipelining, a command sent while responses are still to be
+	 * read gets its own response after theirs */
+	int queued = connection->pipelining &&
+	             (connection->pipelined || !connection->doneProcessing);
+
+	mpd_appendPending(connection, "\n", 1);
+	command = connection->pending+connection->commandStart;
+	commandLen = connection->pendingLen-connection->commandStart;
+
+	if(!connection->doneProcessing && !connection->commandList &&
+	   !connection->async && !queued) {
+		connection->pendingLen = connection->commandStart;
+		strcpy(connection->errorStr,"not done processing current command");
+		connection->error = 1;
+		return;
+	}
+	if(queued && connection->idle &&
+	   (commandLen != 7 || memcmp(command,"noidle\n",7) != 0)) {
+		connection->pendingLen = connection->commandStart;
+		strcpy(connection->errorStr,"only noidle may follow idle");
+		connection->error = 1;
+		return;
+	}
+
+	/* an error still to be seen belongs to the response being read */
+	if(!queued) mpd_clearError(connection);
+#ifndef WIN32
+	/* like an unread response, what a local search found goes */
+	mpd_dropMirrorResults(connection);
+#endif
+
+	if(connection->commandList) {
+		/* held back until mpd_sendCommandListEnd sends the whole
+		 * list at once */
+		if(connection->commandList == COMMAND_LIST_OK) {
+			connection->listOks++;
+		}
+		return;
+	}
+
+#ifndef WIN32
+	if(connection->async) {
+		mpd_asyncQueue(connection,connection->pending,
+		               connection->pendingLen);
+		connection->pendingLen = connection->pendingReady = 0;
+		return;
+	}
+#endif
+
+	connection->pendingReady = connection->pendingLen;
+	if(queued) {
+		/* goes out with the others once a response is read */
+		connection->pipelined++;
+		return;
+	}
+	if(mpd_flushPending(connection) < 0) return;
+
+	connection->idle = 0;
+	connection->doneProcessing = 0;
+}
+
+/* command is a whole line, eg "status\n" */
+static void mpd_executeCommand(mpd_Connection * connection,const char * command) {
+	int length = strlen(command);
+
+	connection->commandStart = connection->pendingLen;
+	mpd_appendPending(connection, command, length-1);
+	mpd_endCommand(connection);
+}
+
+static void mpd_getNextReturnElement(mpd_Connection * connection) {
+	char * output = NULL;
+	char * name = NULL;
+	char * value = NULL;
+	mpd_LineSpan * line;
+	int readed;
+	int space;
+	int err;
+	int length;
+
+	connection->returnElement = NULL;
+
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		strcpy(connection->errorStr,"already done processing current command");
+		connection->error = 1;
+		return;
+	}
+
+	/* pipelined commands are written once a response is wanted */
+	if(connection->pendingReady && mpd_flushPending(connection) < 0) {
+		connection->doneProcessing = 1;
+		connection->doneListOk = 0;
+		return;
+	}
+
+	while(connection->lineNext == connection->lineCount &&
+	      !mpd_tokenize(connection)) {
+		space = mpd_reserveBuffer(connection);
+		if(space == 0) {
+			strcpy(connection->errorStr,"buffer overrun");
+			connection->error = MPD_ERROR_BUFFEROVERRUN;
+			connection->doneProcessing = 1;
+			connection->doneListOk = 0;
+			return;
+		}
+		if((err = mpd_wait(connection, MPD_WAIT_READ)) > 0) {
+			readed = recv(connection->sock,
+					connection->buffer+connection->buflen,
+					space,
+					MSG_DONTWAIT);
+			if(readed<0 && SENDRECV_ERRNO_IGNORE) {
+				continue;
+			}
+			if(readed<=0) {
+				strcpy(connection->errorStr,"connection"
+				       " closed");
+				connection->error = MPD_ERROR_CONNCLOSED;
+				connection->doneProcessing = 1;
+				connection->doneListOk = 0;
+				return;
+			}
+			connection->buflen+=readed;
+			connection->buffer[connection->buflen] = '\0';
+		}
+		else if(err<0 && WAIT_ERRNO_IGNORE) continue;
+		else {
+			strcpy(connection->errorStr,"connection timeout");
+			connection->error = MPD_ERROR_TIMEOUT;
+			connection->doneProcessing = 1;
+			connection->doneListOk = 0;
+			return;
+		}
+	}
+
+	line = &connection->lines[connection->lineNext++];
+	output = connection->buffer+line->start;
+	length = line->end-line->start;
+	output[length] = '\0';
+	connection->bufstart = line->end+1;
+
+	if(length == 2 && memcmp(output,"OK",2)==0) {
+		if(connection->listOks > 0) {
+			strcpy(connection->errorStr, "expected more list_OK's");
+			connection->error = 1;
+		}
+		connection->listOks = 0;
+		connection->doneProcessing = 1;
+		connection->doneListOk = 0;
+		mpd_shrinkBuffer(connection);
+		return;
+	}
+
+	if(length == 7 && memcmp(output,"list_OK",7) == 0) {
+		if(!connection->listOks) {
+			strcpy(connection->errorStr,
+					"got an unexpected list_OK");
+			connection->error = 1;
+		}
+		else {
+			connection->doneListOk = 1;
+			connection->listOks--;
+		}
+		return;
+	}
+
+	if(length >= 3 && memcmp(output,"ACK",3)==0) {
+		char * test;
+		char * needle;
+		int val;
+
+		strcpy(connection->errorStr, output);
+		connection->error = MPD_ERROR_ACK;
+		connection->errorCode = MPD_ACK_ERROR_UNK;
+		connection->errorAt = MPD_ERROR_AT_UNK;
+		connection->doneProcessing = 1;
+		connection->doneListOk = 0;
+
+		needle = strchr(output, '[');
+		if(!needle) return;
+		val = strtol(needle+1, &test, 10);
+		if(*test != '@') return;
+		connection->errorCode = val;
+		val = strtol(test+1, &test, 10);
+		if(*test != ']') return;
+		connection->errorAt = val;
+		return;
+	}
+
+	if (line->colon < 0) return;
+	name = output;
+	value = connection->buffer+line->colon+1;
+	name[line->colon-line->start] = '\0';
+
+	if(value[0]==' ') {
+		connection->returnElement = mpd_setReturnElement(connection,
+				name, line->colon-line->start, value+1,
+				line->end-line->colon-2);
+	}
+	else {
+		snprintf(connection->errorStr,MPD_ERRORSTR_MAX_LENGTH,
+					"error parsing: %s:%s",name,value);
+		connection->error = 1;
+	}
+}
+
+void mpd_finishCommand(mpd_Connection * connection) {
+#ifndef WIN32
+	mpd_dropMirrorResults(connection);
+#endif
+	while(!connection->doneProcessing) {
+		if(connection->doneListOk) connection->doneListOk = 0;
+		mpd_getNextReturnElement(connection);
+	}
+}
+
+static void mpd_finishListOkCommand(mpd_Connection * connection) {
+	while(!connection->doneProcessing && connection->listOks &&
+			!connection->doneListOk)
+	{
+		mpd_getNextReturnElement(connection);
+	}
+}
+
+int mpd_nextListOkCommand(mpd_Connection * connection) {
+	mpd_finishListOkCommand(connection);
+	if(!connection->doneProcessing) connection->doneListOk = 0;
+	if(connection->listOks == 0 || connection->doneProcessing) return -1;
+	return 0;
+}
+
+void mpd_setPipelining(mpd_Connection * connection, int pipelining) {
+	connection->pipelining = pipelining;
+}
+
+int mpd_nextResponse(mpd_Connection * connection) {
+	mpd_finishCommand(connection);
+	if(!connection->pipelined) return -1;
+	/* an ACK only ends its own response, anything else the connection */
+	if(connection->error && connection->error != MPD_ERROR_ACK) return -1;
+
+	connection->pipelined--;
+	mpd_clearError(connection);
+	connection->doneProcessing = 0;
+	connection->doneListOk = 0;
+	connection->listOks = 0;
 	return 0;
 }
 
-void mpd_sendStatusCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"status\n");
+void mpd_sendStatusCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"status\n");
+}
+
+mpd_Status * mpd_getStatus(mpd_Connection * connection) {
+	/*mpd_executeCommand(connection,"status\n");
+
+	if(connection->error) return NULL;*/
+
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		return NULL;
+	}
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+
+	mpd_Status* status = g_slice_new0(mpd_Status);
+	status->volume = -1;
+	status->playlist = -1;
+	status->storedplaylist = -1;
+	status->playlistLength = -1;
+	status->state = -1;
+	status->nextsong = -1;
+	status->nextsongid = -1;
+	status->crossfade = -1;
+
+	if(connection->error) {
+		g_slice_free(mpd_Status, status);
+		return NULL;
+	}
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+		if(re->key == MPD_KEY_STATE) {
+			if(strcmp(re->value,"play")==0) {
+				status->state = MPD_STATUS_STATE_PLAY;
+			}
+			else if(strcmp(re->value,"stop")==0) {
+				status->state = MPD_STATUS_STATE_STOP;
+			}
+			else if(strcmp(re->value,"pause")==0) {
+				status->state = MPD_STATUS_STATE_PAUSE;
+			}
+			else {
+				status->state = MPD_STATUS_STATE_UNKNOWN;
+			}
+		}
+		else if(re->key == MPD_KEY_TIME) {
+			char * tok = strchr(re->value,':');
+			/* the second strchr below is a safety check */
+			if (tok && (strchr(tok,0) > (tok+1))) {
+				/* atoi stops at the first non-[0-9] char: */
+				status->elapsedTime = atoi(re->value);
+				status->totalTime = atoi(tok+1);
+			}
+		}
+		else if(re->key == MPD_KEY_ERROR) {
+			status->error = strdup(re->value);
+		}
+		else if(re->key == MPD_KEY_AUDIO) {
+			char * tok = strchr(re->value,':');
+			if (tok && (strchr(tok,0) > (tok+1))) {
+				status->sampleRate = atoi(re->value);
+				status->bits = atoi(++tok);
+				tok = strchr(tok,':');
+				if (tok && (strchr(tok,0) > (tok+1)))
+					status->channels = atoi(tok+1);
+			}
+		}
+		else {
+			mpd_decodeField(connection, status, mpd_statusFields, re);
+		}
+
+		mpd_getNextReturnElement(connection);
+		if(connection->error) {
+			g_slice_free(mpd_Status, status);
+			return NULL;
+		}
+	}
+
+	if(connection->error) {
+		g_slice_free(mpd_Status, status);
+		return NULL;
+	}
+	else if(status->state<0) {
+		strcpy(connection->errorStr,"state not found");
+		connection->error = 1;
+		g_slice_free(mpd_Status, status);
+		return NULL;
+	}
+
+	return status;
+}
+
+void mpd_freeStatus(mpd_Status * status) {
+	if(status->error) free(status->error);
+	g_slice_free(mpd_Status, status);
+}
+
+void mpd_sendStatsCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"stats\n");
+}
+
+mpd_Stats * mpd_getStats(mpd_Connection * connection) {
+	/*mpd_executeCommand(connection,"stats\n");
+
+	if(connection->error) return NULL;*/
+
+	if(connection->doneProcessing || (connection->listOks &&
+	   connection->doneListOk))
+	{
+		return NULL;
+	}
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+
+	mpd_Stats* stats = g_slice_new0(mpd_Stats);
+
+	if(connection->error) {
+		mpd_freeStats(stats);
+		return NULL;
+	}
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+		mpd_decodeField(connection, stats, mpd_statsFields, re);
+
+		mpd_getNextReturnElement(connection);
+		if(connection->error) {
+			mpd_freeStats(stats);
+			return NULL;
+		}
+	}
+
+	if(connection->error) {
+		mpd_freeStats(stats);
+		return NULL;
+	}
+
+	return stats;
+}
+
+void mpd_freeStats(mpd_Stats * stats) {
+	g_slice_free(mpd_Stats, stats);
+}
+
+mpd_SearchStats * mpd_getSearchStats(mpd_Connection * connection)
+{
+	if (connection->doneProcessing ||
+	    (connection->listOks && connection->doneListOk)) {
+		return NULL;
+	}
+
+	if (!connection->returnElement) mpd_getNextReturnElement(connection);
+
+	if (connection->error)
+		return NULL;
+
+	mpd_ReturnElement* re;
+	mpd_SearchStats* stats = g_slice_new0(mpd_SearchStats);
+
+	while (connection->returnElement) {
+		re = connection->returnElement;
+
+		mpd_decodeField(connection, stats, mpd_searchStatsFields, re);
+
+		mpd_getNextReturnElement(connection);
+		if (connection->error) {
+			mpd_freeSearchStats(stats);
+			return NULL;
+		}
+	}
+
+	if (connection->error) {
+		mpd_freeSearchStats(stats);
+		return NULL;
+	}
+
+	return stats;
+}
+
+void mpd_freeSearchStats(mpd_SearchStats * stats)
+{
+	g_slice_free(mpd_SearchStats, stats);
+}
+
+/* ARENA */
+
+/* memory is handed out from chunks of MPD_ARENA_CHUNK_SIZE, or one of
+ * their own for anything bigger; a reset keeps the first chunk */
+#define MPD_ARENA_CHUNK_SIZE	65536
+
+typedef struct _mpd_ArenaChunk {
+	struct _mpd_ArenaChunk * next;
+	size_t size;
+	size_t used;
+	double data[1]; /* aligned for anything we put here */
+} mpd_ArenaChunk;
+
+struct _mpd_Arena {
+	mpd_ArenaChunk * chunks; /* the one being used first */
+};
+
+mpd_Arena * mpd_newArena(void) {
+	return g_slice_new0(mpd_Arena);
+}
+
+static void * mpd_arenaAlloc(mpd_Arena * arena, size_t size) {
+	mpd_ArenaChunk * chunk = arena->chunks;
+	void * ret;
+
+	size = (size + sizeof(double) - 1) & ~(sizeof(double) - 1);
+	if(!chunk || chunk->size - chunk->used < size) {
+		size_t chunkSize = size > MPD_ARENA_CHUNK_SIZE/4 ?
+			size : MPD_ARENA_CHUNK_SIZE;
+		chunk = malloc(sizeof(mpd_ArenaChunk) + chunkSize);
+		chunk->size = chunkSize;
+		chunk->used = 0;
+		if(chunkSize == size && arena->chunks) {
+			/* keep filling the current chunk */
+			chunk->next = arena->chunks->next;
+			arena->chunks->next = chunk;
+		}
+		else {
+			chunk->next = arena->chunks;
+			arena->chunks = chunk;
+		}
+	}
+	ret = (char *)chunk->data + chunk->used;
+	chunk->used += size;
+	memset(ret, 0, size);
+	return ret;
+}
+
+void mpd_resetArena(mpd_Arena * arena) {
+	mpd_ArenaChunk * chunk;
+	mpd_ArenaChunk * keep = NULL;
+
+	while((chunk = arena->chunks)) {
+		arena->chunks = chunk->next;
+		if(!keep && chunk->size == MPD_ARENA_CHUNK_SIZE) keep = chunk;
+		else free(chunk);
+	}
+	if(keep) {
+		keep->used = 0;
+		keep->next = NULL;
+		arena->chunks = keep;
+	}
+}
+
+void mpd_freeArena(mpd_Arena * arena) {
+	mpd_resetArena(arena);
+	if(arena->chunks) free(arena->chunks);
+	g_slice_free(mpd_Arena, arena);
+}
+
+void mpd_setArena(mpd_Connection * connection, mpd_Arena * arena) {
+	connection->arena = arena;
+}
+
+/* INTERNING */
+
+/* the strings live in an arena, the hash table finds them */
+struct _mpd_InternTable {
+	GHashTable * strings;
+	mpd_Arena * arena;
+};
+
+mpd_InternTable * mpd_newInternTable(void) {
+	mpd_InternTable * table = g_slice_new(mpd_InternTable);
+
+	table->strings = g_hash_table_new(g_str_hash, g_str_equal);
+	table->arena = mpd_newArena();
+	return table;
+}
+
+void mpd_setInternTable(mpd_Connection * connection, mpd_InternTable * table) {
+	connection->intern = table;
+}
+
+const char * mpd_intern(mpd_InternTable * table, const char * string) {
+	char * ret = g_hash_table_lookup(table->strings, string);
+
+	if(!ret) {
+		int length = strlen(string);
+		ret = mpd_arenaAlloc(table->arena, length+1);
+		memcpy(ret, string, length+1);
+		g_hash_table_insert(table->strings, ret, ret);
+	}
+	return ret;
+}
+
+void mpd_freeInternTable(mpd_InternTable * table) {
+	g_hash_table_destroy(table->strings);
+	mpd_freeArena(table->arena);
+	g_slice_free(mpd_InternTable, table);
+}
+
+/* SONG PACKING */
+
+/* a decoded or duplicated song is a single allocation: the mpd_Song,
+ * the arrays of the tags that can have several values, and then all
+ * the strings.  packed holds its size, so a copy is a memcpy and moving
+ * the pointers along with it.  values from an intern table stay there
+ * and are pointed at instead */
+
+/* a string value for the song field at the offset field */
+typedef struct _mpd_SongValue {
+	unsigned short field;
+	int length;
+	const char * value;
+} mpd_SongValue;
+
+static const unsigned short mpd_songStrings[] = {
+	offsetof(mpd_Song, file),
+	offsetof(mpd_Song, artist),
+	offsetof(mpd_Song, title),
+	offsetof(mpd_Song, album),
+	offsetof(mpd_Song, track),
+	offsetof(mpd_Song, name),
+	offsetof(mpd_Song, date),
+	offsetof(mpd_Song, genre),
+	offsetof(mpd_Song, composer),
+	offsetof(mpd_Song, performer),
+	offsetof(mpd_Song, disc),
+	offsetof(mpd_Song, comment),
+	offsetof(mpd_Song, albumartist),
+};
+
+#define MPD_SONG_STRINGS (sizeof(mpd_songStrings)/sizeof(mpd_songStrings[0]))
+
+static const struct {
+	unsigned short field;
+	unsigned short list;
+	/* whether field gets the values joined, or just the first */
+	unsigned char join;
+} mpd_songLists[] = {
+	{ offsetof(mpd_Song, artist), offsetof(mpd_Song, artists), 1 },
+	{ offsetof(mpd_Song, genre), offsetof(mpd_Song, genres), 0 },
+	{ offsetof(mpd_Song, composer), offsetof(mpd_Song, composers), 1 },
+	{ offsetof(mpd_Song, performer), offsetof(mpd_Song, performers), 1 },
+};
+
+#define MPD_SONG_LISTS (sizeof(mpd_songLists)/sizeof(mpd_songLists[0]))
+
+#define MPD_SONG_STRING(song, field) (*(char **)((char *)(song)+(field)))
+#define MPD_SONG_LIST(song, list) (*(char ***)((char *)(song)+(list)))
+
+/* whether a field's values go through an intern table: all but those
+ * that are different for nearly every song */
+static int mpd_internField(int field) {
+	return field != offsetof(mpd_Song, file) &&
+	       field != offsetof(mpd_Song, title) &&
+	       field != offsetof(mpd_Song, comment);
+}
+
+static int mpd_songList(int field) {
+	unsigned int l;
+
+	for(l = 0; l < MPD_SONG_LISTS; l++)
+		if(mpd_songLists[l].field == field) return l;
+	return -1;
+}
+
+/* build a packed song with head's numbers and the values given, in
+ * arena if it isn't NULL and sharing values through intern if that
+ * isn't; of several values for a field that has no list, the first is
+ * taken.  the values must be nul terminated */
+static mpd_Song * mpd_packSong(mpd_Arena * arena, mpd_InternTable * intern,
+                               const mpd_Song * head,
+                               const mpd_SongValue * values, int n)
+{
+	int counts[MPD_SONG_LISTS] = { 0 };
+	int joined[MPD_SONG_LISTS] = { 0 };
+	size_t size = sizeof(mpd_Song);
+	unsigned int seen = 0;
+	mpd_Song * song;
+	char ** lists;
+	char * text;
+	int i, l;
+
+	for(i = 0; i < n; i++) {
+		unsigned int bit = 1u << values[i].field/sizeof(char *);
+
+		if((l = mpd_songList(values[i].field)) >= 0) {
+			counts[l]++;
+			joined[l] += values[i].length+2;
+		}
+		else if(seen & bit) continue;
+		seen |= bit;
+		if(!intern || !mpd_internField(values[i].field))
+			size += values[i].length+1;
+	}
+	for(l = 0; l < (int)MPD_SONG_LISTS; l++) {
+		if(counts[l]) size += (counts[l]+1)*sizeof(char *);
+		if(counts[l] > 1 && mpd_songLists[l].join &&
+		   (!intern || !mpd_internField(mpd_songLists[l].field)))
+			size += joined[l]-1;
+	}
+
+	song = arena ? mpd_arenaAlloc(arena, size) : malloc(size);
+	memset(song, 0, sizeof(mpd_Song));
+	song->time = head->time;
+	song->pos = head->pos;
+	song->id = head->id;
+	song->packed = size;
+
+	lists = (char **)(song+1);
+	for(l = 0; l < (int)MPD_SONG_LISTS; l++) {
+		if(!counts[l]) continue;
+		MPD_SONG_LIST(song, mpd_songLists[l].list) = lists;
+		lists += counts[l]+1;
+		counts[l] = 0;
+	}
+
+	text = (char *)lists;
+	for(i = 0; i < n; i++) {
+		char ** field = &MPD_SONG_STRING(song, values[i].field);
+		char * value;
+
+		l = mpd_songList(values[i].field);
+		if(l < 0 && *field) continue;
+		if(intern && mpd_internField(values[i].field)) {
+			value = (char *)mpd_intern(intern, values[i].value);
+		}
+		else {
+			value = text;
+			memcpy(text, values[i].value, values[i].length);
+			text[values[i].length] = '\0';
+			text += values[i].length+1;
+		}
+		if(l >= 0) MPD_SONG_LIST(song, mpd_songLists[l].list)[counts[l]++] = value;
+		if(!*field) *field = value;
+	}
+
+	for(l = 0; l < (int)MPD_SONG_LISTS; l++) {
+		char ** list = MPD_SONG_LIST(song, mpd_songLists[l].list);
+		int shared = intern && mpd_internField(mpd_songLists[l].field);
+		char * join, * p;
+
+		if(!counts[l]) continue;
+		list[counts[l]] = NULL;
+		if(counts[l] == 1 || !mpd_songLists[l].join) continue;
+		p = join = shared ? malloc(joined[l]-1) : text;
+		for(i = 0; i < counts[l]; i++) {
+			int length = strlen(list[i]);
+			if(i) {
+				memcpy(p, ", ", 2);
+				p += 2;
+			}
+			memcpy(p, list[i], length);
+			p += length;
+		}
+		*p++ = '\0';
+		if(shared) {
+			MPD_SONG_STRING(song, mpd_songLists[l].field) =
+				(char *)mpd_intern(intern, join);
+			free(join);
+		}
+		else {
+			MPD_SONG_STRING(song, mpd_songLists[l].field) = join;
+			text = p;
+		}
+	}
+
+	return song;
+}
+
+/* point the copy song of the packed song from at its own strings;
+ * interned ones stay where they are */
+static void mpd_moveSong(mpd_Song * song, const mpd_Song * from) {
+	const char * start = (const char *)from;
+	const char * end = start+from->packed;
+	unsigned int i, l;
+
+#define MPD_MOVE(p) \
+	if((const char *)(p) >= start && (const char *)(p) < end) \
+		(p) = (void *)((char *)song + ((const char *)(p)-start))
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		char ** field = &MPD_SONG_STRING(song, mpd_songStrings[i]);
+		if(*field) MPD_MOVE(*field);
+	}
+	for(l = 0; l < MPD_SONG_LISTS; l++) {
+		char *** list = &MPD_SONG_LIST(song, mpd_songLists[l].list);
+		if(!*list) continue;
+		MPD_MOVE(*list);
+		for(i = 0; (*list)[i]; i++) MPD_MOVE((*list)[i]);
+	}
+#undef MPD_MOVE
 }
 
-mpd_Status * mpd_getStatus(mpd_Connection * connection) {
-	/*mpd_executeCommand(connection,"status\n");
+static void mpd_finishSong(mpd_Song * song) {
+	if(song->file) free(song->file);
+	if(song->artist) free(song->artist);
+	if(song->album) free(song->album);
+	if(song->title) free(song->title);
+	if(song->track) free(song->track);
+	if(song->name) free(song->name);
+	if(song->date) free(song->date);
+	if(song->genre) free(song->genre);
+	if(song->composer) free(song->composer);
+	if(song->performer) free(song->performer);
+	if(song->disc) free(song->disc);
+	if(song->comment) free(song->comment);
+    if(song->albumartist) free(song->albumartist);
+}
 
-	if(connection->error) return NULL;*/
+mpd_Song * mpd_newSong(void) {
+	mpd_Song * ret = g_slice_new0(mpd_Song);
+	ret->time = MPD_SONG_NO_TIME;
+	ret->pos = MPD_SONG_NO_NUM;
+	ret->id = MPD_SONG_NO_ID;
+	return ret;
+}
+
+void mpd_freeSong(mpd_Song * song) {
+	if(song->packed) {
+		free(song);
+		return;
+	}
+	mpd_finishSong(song);
+	g_slice_free(mpd_Song, song);
+}
+
+mpd_Song * mpd_songDup(const mpd_Song * song) {
+	mpd_SongValue * values;
+	mpd_Song * ret;
+	unsigned int i, l;
+	int n = MPD_SONG_STRINGS;
+
+	if(song->packed) {
+		ret = malloc(song->packed);
+		memcpy(ret, song, song->packed);
+		mpd_moveSong(ret, song);
+		return ret;
+	}
+
+	/* where a song has a list, its values are copied rather than the
+	 * field, which mpd_packSong makes up again from them */
+	for(l = 0; l < MPD_SONG_LISTS; l++) {
+		char ** list = MPD_SONG_LIST(song, mpd_songLists[l].list);
+		for(i = 0; list && list[i]; i++) n++;
+	}
+	values = g_new(mpd_SongValue, n);
+	n = 0;
+	for(i = 0; i < MPD_SONG_STRINGS; i++) {
+		const char * value = MPD_SONG_STRING(song, mpd_songStrings[i]);
+		int list = mpd_songList(mpd_songStrings[i]);
+		char ** each = list < 0 ? NULL :
+			MPD_SONG_LIST(song, mpd_songLists[list].list);
+		int copied = 0;
+
+		for(; each && *each; each++, copied++) {
+			values[n].field = mpd_songStrings[i];
+			values[n].length = strlen(*each);
+			values[n].value = *each;
+			n++;
+		}
+		if(copied || !value) continue;
+		values[n].field = mpd_songStrings[i];
+		values[n].length = strlen(value);
+		values[n].value = value;
+		n++;
+	}
+	ret = mpd_packSong(NULL, NULL, song, values, n);
+	g_free(values);
+	return ret;
+}
+
+
+static void mpd_finishDirectory(mpd_Directory * directory) {
+	if(directory->path) free(directory->path);
+}
+
+mpd_Directory * mpd_newDirectory(void) {
+	return g_slice_new0(mpd_Directory);
+}
+
+void mpd_freeDirectory(mpd_Directory * directory) {
+	mpd_finishDirectory(directory);
+	g_slice_free(mpd_Directory, directory);
+}
+
+mpd_Directory * mpd_directoryDup(mpd_Directory * directory) {
+	mpd_Directory * ret = mpd_newDirectory();
+
+	if(directory->path) ret->path = strdup(directory->path);
+
+	return ret;
+}
+
+static void mpd_finishPlaylistFile(mpd_PlaylistFile * playlist) {
+	if(playlist->path) free(playlist->path);
+    if(playlist->mtime) free(playlist->mtime);
+}
+
+mpd_PlaylistFile * mpd_newPlaylistFile(void) {
+	return g_slice_new0(mpd_PlaylistFile);
+}
+
+void mpd_freePlaylistFile(mpd_PlaylistFile * playlist) {
+	mpd_finishPlaylistFile(playlist);
+	g_slice_free(mpd_PlaylistFile, playlist);
+}
+
+mpd_PlaylistFile * mpd_playlistFileDup(mpd_PlaylistFile * playlist) {
+	mpd_PlaylistFile * ret = mpd_newPlaylistFile();
+
+	if(playlist->path) ret->path = strdup(playlist->path);
+    if(playlist->mtime) ret->mtime = strdup(playlist->mtime);
+
+	return ret;
+}
+
+static void mpd_finishInfoEntity(mpd_InfoEntity * entity) {
+	if(entity->info.directory) {
+		if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+			mpd_freeDirectory(entity->info.directory);
+		}
+		else if(entity->type == MPD_INFO_ENTITY_TYPE_SONG) {
+			mpd_freeSong(entity->info.song);
+		}
+		else if(entity->type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
+			mpd_freePlaylistFile(entity->info.playlistFile);
+		}
+	}
+}
+
+mpd_InfoEntity * mpd_newInfoEntity(void) {
+	return g_slice_new0(mpd_InfoEntity);
+}
+
+void mpd_freeInfoEntity(mpd_InfoEntity * entity) {
+	if(entity->arena) return; /* goes with the arena */
+	mpd_finishInfoEntity(entity);
+	g_slice_free(mpd_InfoEntity, entity);
+}
+
+static void mpd_sendInfoCommand(mpd_Connection * connection,const char * command) {
+	mpd_executeCommand(connection,command);
+}
 
+/* entities decoded while an arena is attached live in it, strings and
+ * all; anything else comes from the heap as before.  a song is only
+ * packed once all of it has been read, see mpd_stageSong */
+static mpd_InfoEntity * mpd_allocInfoEntity(mpd_Connection * connection,
+                                            int type)
+{
+	mpd_Arena * arena = connection->arena;
+	mpd_InfoEntity * entity;
+
+	if(!arena) {
+		entity = mpd_newInfoEntity();
+		entity->type = type;
+		if(type == MPD_INFO_ENTITY_TYPE_SONG)
+			return entity;
+		else if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY)
+			entity->info.directory = mpd_newDirectory();
+		else
+			entity->info.playlistFile = mpd_newPlaylistFile();
+		return entity;
+	}
+
+	entity = mpd_arenaAlloc(arena, sizeof(mpd_InfoEntity));
+	entity->type = type;
+	entity->arena = arena;
+	if(type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		entity->info.directory = mpd_arenaAlloc(arena,
+		                                        sizeof(mpd_Directory));
+	}
+	else if(type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
+		entity->info.playlistFile = mpd_arenaAlloc(arena,
+		                                           sizeof(mpd_PlaylistFile));
+	}
+	return entity;
+}
+
+/* copy the current value for keeping */
+static char * mpd_keepValue(mpd_Connection * connection,
+                            const mpd_ReturnElement * re)
+{
+	char * ret;
+
+	if(!connection->arena) return strdup(re->value);
+	ret = mpd_arenaAlloc(connection->arena, re->valueLen+1);
+	memcpy(ret, re->value, re->valueLen+1);
+	return ret;
+}
+
+/* keep a string value of the song being read, to be packed */
+static void mpd_stageSong(mpd_Connection * connection,
+                          const mpd_ReturnElement * re)
+{
+	mpd_SongValue value;
+
+	if(!connection->songText) {
+		connection->songText = g_string_new(NULL);
+		connection->songValues = g_array_new(FALSE, FALSE,
+		                                     sizeof(mpd_SongValue));
+	}
+	value.field = mpd_songFields[re->key].offset;
+	value.length = re->valueLen;
+	/* an offset into songText until it has stopped moving */
+	value.value = (const char *)(gsize)connection->songText->len;
+	g_string_append_len(connection->songText, re->value, re->valueLen+1);
+	g_array_append_val(connection->songValues, value);
+}
+
+static void mpd_packStagedSong(mpd_Connection * connection,
+                               mpd_InfoEntity * entity, const mpd_Song * head)
+{
+	mpd_SongValue * values = NULL;
+	int n = 0;
+	int i;
+
+	if(connection->songValues) {
+		values = (mpd_SongValue *)connection->songValues->data;
+		n = connection->songValues->len;
+		for(i = 0; i < n; i++)
+			values[i].value = connection->songText->str +
+			                  (gsize)values[i].value;
+	}
+	entity->info.song = mpd_packSong(connection->arena, connection->intern,
+	                                 head, values, n);
+	if(n) {
+		g_string_truncate(connection->songText, 0);
+		g_array_set_size(connection->songValues, 0);
+	}
+}
+
+mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
+	mpd_InfoEntity * entity = NULL;
+	mpd_Song head;
+
+#ifndef WIN32
+	if(connection->mirrorResults) return mpd_getNextMirrorEntity(connection);
+#endif
 	if(connection->doneProcessing || (connection->listOks &&
 	   connection->doneListOk))
 	{
@@ -771,1356 +2608,2130 @@ mpd_Status * mpd_getStatus(mpd_Connection * connection) {
 
 	if(!connection->returnElement) mpd_getNextReturnElement(connection);
 
-	mpd_Status* status = g_slice_new0(mpd_Status);
-	status->volume = -1;
-	status->playlist = -1;
-	status->storedplaylist = -1;
-	status->playlistLength = -1;
-	status->state = -1;
-	status->nextsong = -1;
-	status->nextsongid = -1;
-	status->crossfade = -1;
+	head.time = MPD_SONG_NO_TIME;
+	head.pos = MPD_SONG_NO_NUM;
+	head.id = MPD_SONG_NO_ID;
 
-	if(connection->error) {
-		g_slice_free(mpd_Status, status);
-		return NULL;
-	}
-	while(connection->returnElement) {
+	if(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"volume")==0) {
-			status->volume = atoi(re->value);
-		}
-		else if(strcmp(re->name,"repeat")==0) {
-			status->repeat = atoi(re->value);
-		}
-		else if(strcmp(re->name,"single")==0) {
-			status->single = atoi(re->value);
-		}
-		else if(strcmp(re->name,"consume")==0) {
-			status->consume = atoi(re->value);
-		}
-		else if(strcmp(re->name,"random")==0) {
-			status->random = atoi(re->value);
-		}
-		else if(strcmp(re->name,"playlist")==0) {
-			status->playlist = strtol(re->value,NULL,10);
-		}
-		else if(strcmp(re->name,"playlistlength")==0) {
-			status->playlistLength = atoi(re->value);
-		}
-		else if(strcmp(re->name,"bitrate")==0) {
-			status->bitRate = atoi(re->value);
-		}
-		else if(strcmp(re->name,"state")==0) {
-			if(strcmp(re->value,"play")==0) {
-				status->state = MPD_STATUS_STATE_PLAY;
-			}
-			else if(strcmp(re->value,"stop")==0) {
-				status->state = MPD_STATUS_STATE_STOP;
-			}
-			else if(strcmp(re->value,"pause")==0) {
-				status->state = MPD_STATUS_STATE_PAUSE;
-			}
-			else {
-				status->state = MPD_STATUS_STATE_UNKNOWN;
-			}
+		if(re->key == MPD_KEY_FILE) {
+			entity = mpd_allocInfoEntity(connection,
+			                             MPD_INFO_ENTITY_TYPE_SONG);
+			mpd_stageSong(connection, re);
 		}
-		else if(strcmp(re->name,"song")==0) {
-			status->song = atoi(re->value);
+		else if(re->key == MPD_KEY_DIRECTORY) {
+			entity = mpd_allocInfoEntity(connection,
+			                             MPD_INFO_ENTITY_TYPE_DIRECTORY);
+			entity->info.directory->path = mpd_keepValue(connection, re);
 		}
-		else if(strcmp(re->name,"songid")==0) {
-			status->songid = atoi(re->value);
-		}
-		else if(strcmp(re->name,"nextsong")==0) {
-			status->nextsong = atoi(re->value);
-		}
-		else if(strcmp(re->name,"nextsongid")==0) {
-			status->nextsongid = atoi(re->value);
-		}
-		else if(strcmp(re->name,"time")==0) {
-			char * tok = strchr(re->value,':');
-			/* the second strchr below is a safety check */
-			if (tok && (strchr(tok,0) > (tok+1))) {
-				/* atoi stops at the first non-[0-9] char: */
-				status->elapsedTime = atoi(re->value);
-				status->totalTime = atoi(tok+1);
-			}
+		else if(re->key == MPD_KEY_PLAYLIST) {
+			entity = mpd_allocInfoEntity(connection,
+			                             MPD_INFO_ENTITY_TYPE_PLAYLISTFILE);
+			entity->info.playlistFile->path = mpd_keepValue(connection, re);
 		}
-		else if(strcmp(re->name,"error")==0) {
-			status->error = strdup(re->value);
+		else if(re->key == MPD_KEY_CPOS) {
+			entity = mpd_allocInfoEntity(connection,
+			                             MPD_INFO_ENTITY_TYPE_SONG);
+			head.pos = atoi(re->value);
 		}
-		else if(strcmp(re->name,"xfade")==0) {
-			status->crossfade = atoi(re->value);
+		else {
+			connection->error = 1;
+			strcpy(connection->errorStr,"problem parsing song info");
+			return NULL;
 		}
-		else if(strcmp(re->name,"updating_db")==0) {
-			status->updatingDb = atoi(re->value);
+	}
+	else return NULL;
+
+	mpd_getNextReturnElement(connection);
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+
+		/* the start of the next one */
+		if(re->key == MPD_KEY_FILE || re->key == MPD_KEY_DIRECTORY ||
+		   re->key == MPD_KEY_PLAYLIST || re->key == MPD_KEY_CPOS)
+			break;
+
+		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG &&
+				re->valueLen) {
+			if(mpd_songFields[re->key].type >= MPD_FIELD_STRING)
+				mpd_stageSong(connection, re);
+			else
+				mpd_decodeField(connection, &head, mpd_songFields, re);
 		}
-		else if(strcmp(re->name,"audio")==0) {
-			char * tok = strchr(re->value,':');
-			if (tok && (strchr(tok,0) > (tok+1))) {
-				status->sampleRate = atoi(re->value);
-				status->bits = atoi(++tok);
-				tok = strchr(tok,':');
-				if (tok && (strchr(tok,0) > (tok+1)))
-					status->channels = atoi(tok+1);
-			}
+		else if(entity->type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
+			mpd_decodeField(connection, entity->info.playlistFile,
+			                mpd_playlistFileFields, re);
 		}
 
 		mpd_getNextReturnElement(connection);
-		if(connection->error) {
-			g_slice_free(mpd_Status, status);
-			return NULL;
-		}
-	}
-
-	if(connection->error) {
-		g_slice_free(mpd_Status, status);
-		return NULL;
-	}
-	else if(status->state<0) {
-		strcpy(connection->errorStr,"state not found");
-		connection->error = 1;
-		g_slice_free(mpd_Status, status);
-		return NULL;
 	}
 
-	return status;
+	if(entity->type == MPD_INFO_ENTITY_TYPE_SONG)
+		mpd_packStagedSong(connection, entity, &head);
+	return entity;
 }
 
-void mpd_freeStatus(mpd_Status * status) {
-	if(status->error) free(status->error);
-	g_slice_free(mpd_Status, status);
+/* VISITOR */
+
+/* the tag each song key is, plus one so that 0 means none */
+static const unsigned char mpd_keyTags[MPD_KEY_COUNT] = {
+	[MPD_KEY_ARTIST] = MPD_TAG_ITEM_ARTIST+1,
+	[MPD_KEY_ALBUM] = MPD_TAG_ITEM_ALBUM+1,
+	[MPD_KEY_TITLE] = MPD_TAG_ITEM_TITLE+1,
+	[MPD_KEY_TRACK] = MPD_TAG_ITEM_TRACK+1,
+	[MPD_KEY_NAME] = MPD_TAG_ITEM_NAME+1,
+	[MPD_KEY_GENRE] = MPD_TAG_ITEM_GENRE+1,
+	[MPD_KEY_DATE] = MPD_TAG_ITEM_DATE+1,
+	[MPD_KEY_COMPOSER] = MPD_TAG_ITEM_COMPOSER+1,
+	[MPD_KEY_PERFORMER] = MPD_TAG_ITEM_PERFORMER+1,
+	[MPD_KEY_COMMENT] = MPD_TAG_ITEM_COMMENT+1,
+	[MPD_KEY_DISC] = MPD_TAG_ITEM_DISC+1,
+	[MPD_KEY_ALBUMARTIST] = MPD_TAG_ITEM_ALBUM_ARTIST+1,
+};
+
+/* the entity being read; the values kept are copied into scratch, as
+ * the lines they came from may be gone by the time the entity ends,
+ * and found by their offsets there, or -1 */
+typedef struct _mpd_Visit {
+	mpd_EntityView view;
+	GString * scratch;
+	int path;
+	int tags[MPD_TAG_NUM_OF_ITEM_TYPES];
+} mpd_Visit;
+
+static void mpd_visitStart(mpd_Visit * visit, int type) {
+	int i;
+
+	visit->view.type = type;
+	visit->view.time = visit->view.pos = visit->view.id = -1;
+	g_string_truncate(visit->scratch, 0);
+	visit->path = -1;
+	for(i = 0; i < MPD_TAG_NUM_OF_ITEM_TYPES; i++) visit->tags[i] = -1;
 }
 
-void mpd_sendStatsCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"stats\n");
+/* copy value in, joining it to what there is at old like the song
+ * decoder does for artists etc; returns its offset */
+static int mpd_visitKeep(mpd_Visit * visit, int old, const mpd_ReturnElement * re)
+{
+	int offset = visit->scratch->len;
+
+	if(old >= 0) {
+		/* growing may move str, so copy only once it has */
+		int length = strlen(visit->scratch->str+old);
+		g_string_set_size(visit->scratch, offset+length);
+		memcpy(visit->scratch->str+offset, visit->scratch->str+old, length);
+		g_string_append_len(visit->scratch, ", ", 2);
+	}
+	g_string_append_len(visit->scratch, re->value, re->valueLen+1);
+	return offset;
 }
 
-mpd_Stats * mpd_getStats(mpd_Connection * connection) {
-	/*mpd_executeCommand(connection,"stats\n");
+static int mpd_visitEnd(mpd_Visit * visit, mpd_EntityVisitor visitor,
+                        void * userdata)
+{
+	const char * str = visit->scratch->str;
+	int i;
 
-	if(connection->error) return NULL;*/
+	visit->view.path = visit->path < 0 ? NULL : str+visit->path;
+	for(i = 0; i < MPD_TAG_NUM_OF_ITEM_TYPES; i++)
+		visit->view.tags[i] = visit->tags[i] < 0 ? NULL : str+visit->tags[i];
+	return visitor(&visit->view, userdata);
+}
+
+int mpd_visitInfoEntities(mpd_Connection * connection, unsigned int tags,
+                          mpd_EntityVisitor visitor, void * userdata)
+{
+	mpd_Visit visit;
+	int visited = 0;
+	int skipping = 0;
 
+#ifndef WIN32
+	if(connection->mirrorResults)
+		return mpd_visitMirrorResults(connection, tags, visitor, userdata);
+#endif
 	if(connection->doneProcessing || (connection->listOks &&
 	   connection->doneListOk))
 	{
-		return NULL;
+		return 0;
 	}
 
-	if(!connection->returnElement) mpd_getNextReturnElement(connection);
-
-	mpd_Stats* stats = g_slice_new0(mpd_Stats);
+	visit.view.type = -1;
+	visit.scratch = g_string_sized_new(256);
 
-	if(connection->error) {
-		mpd_freeStats(stats);
-		return NULL;
-	}
-	while(connection->returnElement) {
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+	for(;;) {
 		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"artists")==0) {
-			stats->numberOfArtists = atoi(re->value);
-		}
-		else if(strcmp(re->name,"albums")==0) {
-			stats->numberOfAlbums = atoi(re->value);
-		}
-		else if(strcmp(re->name,"songs")==0) {
-			stats->numberOfSongs = atoi(re->value);
-		}
-		else if(strcmp(re->name,"uptime")==0) {
-			stats->uptime = strtol(re->value,NULL,10);
+		int type = -1;
+		int tag;
+
+		if(re) switch(re->key) {
+		case MPD_KEY_FILE:
+		case MPD_KEY_CPOS:
+			type = MPD_INFO_ENTITY_TYPE_SONG;
+			break;
+		case MPD_KEY_DIRECTORY:
+			type = MPD_INFO_ENTITY_TYPE_DIRECTORY;
+			break;
+		case MPD_KEY_PLAYLIST:
+			type = MPD_INFO_ENTITY_TYPE_PLAYLISTFILE;
+			break;
 		}
-		else if(strcmp(re->name,"db_update")==0) {
-			stats->dbUpdateTime = strtol(re->value,NULL,10);
+
+		if(!re || type >= 0) {
+			if(visit.view.type >= 0 && !skipping) {
+				if(tags & MPD_TAG_MASK(MPD_TAG_ITEM_FILENAME))
+					visit.tags[MPD_TAG_ITEM_FILENAME] = visit.path;
+				skipping = mpd_visitEnd(&visit, visitor, userdata);
+				visited++;
+			}
+			if(!re) break;
+
+			mpd_visitStart(&visit, type);
+			if(re->key == MPD_KEY_CPOS) visit.view.pos = atoi(re->value);
+			else visit.path = mpd_visitKeep(&visit, -1, re);
 		}
-		else if(strcmp(re->name,"playtime")==0) {
-			stats->playTime = strtol(re->value,NULL,10);
+		else if(visit.view.type < 0) {
+			connection->error = 1;
+			strcpy(connection->errorStr,"problem parsing song info");
+			break;
 		}
-		else if(strcmp(re->name,"db_playtime")==0) {
-			stats->dbPlayTime = strtol(re->value,NULL,10);
+		else if(!skipping && visit.view.type == MPD_INFO_ENTITY_TYPE_SONG &&
+		        re->valueLen) {
+			switch(re->key) {
+			case MPD_KEY_SONG_TIME:
+				if(visit.view.time == -1) visit.view.time = atoi(re->value);
+				break;
+			case MPD_KEY_POS:
+				if(visit.view.pos == -1) visit.view.pos = atoi(re->value);
+				break;
+			case MPD_KEY_ID:
+				if(visit.view.id == -1) visit.view.id = atoi(re->value);
+				break;
+			default:
+				tag = mpd_keyTags[re->key]-1;
+				if(tag < 0 || !(tags & MPD_TAG_MASK(tag))) break;
+				if(visit.tags[tag] < 0)
+					visit.tags[tag] = mpd_visitKeep(&visit, -1, re);
+				else if(mpd_songFields[re->key].type == MPD_FIELD_JOIN)
+					visit.tags[tag] = mpd_visitKeep(&visit, visit.tags[tag], re);
+			}
 		}
 
 		mpd_getNextReturnElement(connection);
-		if(connection->error) {
-			mpd_freeStats(stats);
-			return NULL;
-		}
 	}
 
-	if(connection->error) {
-		mpd_freeStats(stats);
+	g_string_free(visit.scratch, TRUE);
+	return visited;
+}
+
+static mpd_ReturnElement * mpd_findNextReturnElement(mpd_Connection * connection,
+		const char * name)
+{
+	if(connection->doneProcessing || (connection->listOks &&
+				connection->doneListOk))
+	{
 		return NULL;
 	}
 
-	return stats;
+	mpd_getNextReturnElement(connection);
+	while(connection->returnElement) {
+		mpd_ReturnElement * re = connection->returnElement;
+
+		if(strcmp(re->name,name)==0) return re;
+		mpd_getNextReturnElement(connection);
+	}
+
+	return NULL;
 }
 
-void mpd_freeStats(mpd_Stats * stats) {
-	g_slice_free(mpd_Stats, stats);
+static char * mpd_getNextReturnElementNamed(mpd_Connection * connection,
+		const char * name)
+{
+	mpd_ReturnElement * re = mpd_findNextReturnElement(connection, name);
+
+	return re ? strdup(re->value) : NULL;
 }
 
-mpd_SearchStats * mpd_getSearchStats(mpd_Connection * connection)
+char *mpd_getNextTag(mpd_Connection *connection, int type)
 {
-	if (connection->doneProcessing ||
-	    (connection->listOks && connection->doneListOk)) {
+	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES ||
+	    type == MPD_TAG_ITEM_ANY)
 		return NULL;
-	}
+	if (type == MPD_TAG_ITEM_FILENAME)
+		return mpd_getNextReturnElementNamed(connection, "file");
+	return mpd_getNextReturnElementNamed(connection, mpdTagItemKeys[type]);
+}
 
-	if (!connection->returnElement) mpd_getNextReturnElement(connection);
+const char * mpd_getNextInternedTag(mpd_Connection *connection, int type)
+{
+	mpd_ReturnElement * re;
 
-	if (connection->error)
+	if (!connection->intern || type < 0 ||
+	    type >= MPD_TAG_NUM_OF_ITEM_TYPES || type == MPD_TAG_ITEM_ANY)
 		return NULL;
+	re = mpd_findNextReturnElement(connection,
+	                               type == MPD_TAG_ITEM_FILENAME ?
+	                               "file" : mpdTagItemKeys[type]);
+	return re ? mpd_intern(connection->intern, re->value) : NULL;
+}
 
-	mpd_ReturnElement* re;
-	mpd_SearchStats* stats = g_slice_new0(mpd_SearchStats);
+char * mpd_getNextArtist(mpd_Connection * connection) {
+	return mpd_getNextReturnElementNamed(connection,"Artist");
+}
 
-	while (connection->returnElement) {
-		re = connection->returnElement;
+char * mpd_getNextAlbum(mpd_Connection * connection) {
+	return mpd_getNextReturnElementNamed(connection,"Album");
+}
 
-		if (strcmp(re->name, "songs") == 0) {
-			stats->numberOfSongs = atoi(re->value);
-		} else if (strcmp(re->name, "playtime") == 0) {
-			stats->playTime = strtol(re->value, NULL, 10);
-		}
+void mpd_sendPlaylistInfoCommand(mpd_Connection * connection, int songPos) {
+	mpd_beginCommand(connection, "playlistinfo");
+	mpd_addIntArg(connection, songPos);
+	mpd_endCommand(connection);
+}
 
-		mpd_getNextReturnElement(connection);
-		if (connection->error) {
-			mpd_freeSearchStats(stats);
-			return NULL;
-		}
+void mpd_sendPlaylistIdCommand(mpd_Connection * connection, int id) {
+	mpd_beginCommand(connection, "playlistid");
+	mpd_addIntArg(connection, id);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendPlChangesCommand(mpd_Connection * connection, long long playlist) {
+	mpd_beginCommand(connection, "plchanges");
+	mpd_addIntArg(connection, playlist);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendPlChangesPosIdCommand(mpd_Connection * connection, long long playlist) {
+	mpd_beginCommand(connection, "plchangesposid");
+	mpd_addIntArg(connection, playlist);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendListallCommand(mpd_Connection * connection, const char * dir) {
+	mpd_beginCommand(connection, "listall");
+	mpd_addArg(connection, dir);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendListallInfoCommand(mpd_Connection * connection, const char * dir) {
+	mpd_beginCommand(connection, "listallinfo");
+	mpd_addArg(connection, dir);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendLsInfoCommand(mpd_Connection * connection, const char * dir) {
+	mpd_beginCommand(connection, "lsinfo");
+	mpd_addArg(connection, dir);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendCurrentSongCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"currentsong\n");
+}
+
+void mpd_sendSearchCommand(mpd_Connection * connection, int table,
+		const char * str)
+{
+	mpd_startSearch(connection, 0);
+	mpd_addConstraintSearch(connection, table, str);
+	mpd_commitSearch(connection);
+}
+
+void mpd_sendFindCommand(mpd_Connection * connection, int table,
+		const char * str)
+{
+	mpd_startSearch(connection, 1);
+	mpd_addConstraintSearch(connection, table, str);
+	mpd_commitSearch(connection);
+}
+
+void mpd_sendListCommand(mpd_Connection * connection, int table,
+		const char * arg1)
+{
+	if(table == MPD_TABLE_ARTIST) mpd_beginCommand(connection,"list artist");
+	else if(table == MPD_TABLE_ALBUM) mpd_beginCommand(connection,"list album");
+	else {
+		connection->error = 1;
+		strcpy(connection->errorStr,"unknown table for list");
+		return;
 	}
+	if(arg1) mpd_addArg(connection,arg1);
+	mpd_endCommand(connection);
+}
 
-	if (connection->error) {
-		mpd_freeSearchStats(stats);
-		return NULL;
+void mpd_sendAddCommand(mpd_Connection * connection, const char * file) {
+	mpd_beginCommand(connection, "add");
+	mpd_addArg(connection, file);
+	mpd_endCommand(connection);
+}
+
+int mpd_sendAddIdCommand(mpd_Connection *connection, const char *file)
+{
+	int retval = -1;
+	char *string;
+
+	mpd_beginCommand(connection, "addid");
+	mpd_addArg(connection, file);
+	mpd_endCommand(connection);
+
+	string = mpd_getNextReturnElementNamed(connection, "Id");
+	if (string) {
+		retval = atoi(string);
+		free(string);
 	}
+	
+	return retval;
+}
 
-	return stats;
+void mpd_sendDeleteCommand(mpd_Connection * connection, int songPos) {
+	mpd_beginCommand(connection, "delete");
+	mpd_addIntArg(connection, songPos);
+	mpd_endCommand(connection);
 }
 
-void mpd_freeSearchStats(mpd_SearchStats * stats)
+void mpd_sendDeleteIdCommand(mpd_Connection * connection, int id) {
+	mpd_beginCommand(connection, "deleteid");
+	mpd_addIntArg(connection, id);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendDeleteRangeCommand(mpd_Connection * connection, int start, int end) {
+	char range[INTLEN+1+INTLEN+1];
+
+	snprintf(range, sizeof(range), "%i:%i", start, end);
+	mpd_beginCommand(connection, "delete");
+	mpd_addArg(connection, range);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendSaveCommand(mpd_Connection * connection, const char * name) {
+	mpd_beginCommand(connection, "save");
+	mpd_addArg(connection, name);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendLoadCommand(mpd_Connection * connection, const char * name) {
+	mpd_beginCommand(connection, "load");
+	mpd_addArg(connection, name);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendRmCommand(mpd_Connection * connection, const char * name) {
+	mpd_beginCommand(connection, "rm");
+	mpd_addArg(connection, name);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendRenameCommand(mpd_Connection *connection, const char *from,
+                           const char *to)
 {
-	g_slice_free(mpd_SearchStats, stats);
+	mpd_beginCommand(connection, "rename");
+	mpd_addArg(connection, from);
+	mpd_addArg(connection, to);
+	mpd_endCommand(connection);
 }
 
-static void mpd_finishSong(mpd_Song * song) {
-	if(song->file) free(song->file);
-	if(song->artist) free(song->artist);
-	if(song->album) free(song->album);
-	if(song->title) free(song->title);
-	if(song->track) free(song->track);
-	if(song->name) free(song->name);
-	if(song->date) free(song->date);
-	if(song->genre) free(song->genre);
-	if(song->composer) free(song->composer);
-	if(song->performer) free(song->performer);
-	if(song->disc) free(song->disc);
-	if(song->comment) free(song->comment);
-    if(song->albumartist) free(song->albumartist);
+void mpd_sendShuffleCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"shuffle\n");
 }
 
-mpd_Song * mpd_newSong(void) {
-	mpd_Song * ret = g_slice_new0(mpd_Song);
-	ret->time = MPD_SONG_NO_TIME;
-	ret->pos = MPD_SONG_NO_NUM;
-	ret->id = MPD_SONG_NO_ID;
-	return ret;
+void mpd_sendClearCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"clear\n");
 }
 
-void mpd_freeSong(mpd_Song * song) {
-	mpd_finishSong(song);
-	g_slice_free(mpd_Song, song);
+void mpd_sendPlayCommand(mpd_Connection * connection, int songPos) {
+	mpd_beginCommand(connection, "play");
+	mpd_addIntArg(connection, songPos);
+	mpd_endCommand(connection);
 }
 
-mpd_Song * mpd_songDup(const mpd_Song * song) {
-	mpd_Song * ret = mpd_newSong();
-
-	if(song->file) ret->file = strdup(song->file);
-	if(song->artist) ret->artist = strdup(song->artist);
-	if(song->album) ret->album = strdup(song->album);
-	if(song->title) ret->title = strdup(song->title);
-	if(song->track) ret->track = strdup(song->track);
-	if(song->name) ret->name = strdup(song->name);
-	if(song->date) ret->date = strdup(song->date);
-	if(song->genre) ret->genre= strdup(song->genre);
-	if(song->composer) ret->composer= strdup(song->composer);
-	if(song->performer) ret->performer = strdup(song->performer);
-	if(song->disc) ret->disc = strdup(song->disc);
-	if(song->comment) ret->comment = strdup(song->comment);
-    if(song->albumartist) ret->albumartist = strdup(song->albumartist);
-	ret->time = song->time;
-	ret->pos = song->pos;
-	ret->id = song->id;
+void mpd_sendPlayIdCommand(mpd_Connection * connection, int id) {
+	mpd_beginCommand(connection, "playid");
+	mpd_addIntArg(connection, id);
+	mpd_endCommand(connection);
+}
 
-	return ret;
+void mpd_sendStopCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"stop\n");
 }
 
+void mpd_sendPauseCommand(mpd_Connection * connection, int pauseMode) {
+	mpd_beginCommand(connection, "pause");
+	mpd_addIntArg(connection, pauseMode);
+	mpd_endCommand(connection);
+}
 
-static void mpd_finishDirectory(mpd_Directory * directory) {
-	if(directory->path) free(directory->path);
+void mpd_sendNextCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"next\n");
 }
 
-mpd_Directory * mpd_newDirectory(void) {
-	return g_slice_new0(mpd_Directory);
+void mpd_sendMoveCommand(mpd_Connection * connection, int from, int to) {
+	mpd_beginCommand(connection, "move");
+	mpd_addIntArg(connection, from);
+	mpd_addIntArg(connection, to);
+	mpd_endCommand(connection);
 }
 
-void mpd_freeDirectory(mpd_Directory * directory) {
-	mpd_finishDirectory(directory);
-	g_slice_free(mpd_Directory, directory);
+void mpd_sendMoveIdCommand(mpd_Connection * connection, int id, int to) {
+	mpd_beginCommand(connection, "moveid");
+	mpd_addIntArg(connection, id);
+	mpd_addIntArg(connection, to);
+	mpd_endCommand(connection);
 }
 
-mpd_Directory * mpd_directoryDup(mpd_Directory * directory) {
-	mpd_Directory * ret = mpd_newDirectory();
+void mpd_sendSwapCommand(mpd_Connection * connection, int song1, int song2) {
+	mpd_beginCommand(connection, "swap");
+	mpd_addIntArg(connection, song1);
+	mpd_addIntArg(connection, song2);
+	mpd_endCommand(connection);
+}
 
-	if(directory->path) ret->path = strdup(directory->path);
+void mpd_sendSwapIdCommand(mpd_Connection * connection, int id1, int id2) {
+	mpd_beginCommand(connection, "swapid");
+	mpd_addIntArg(connection, id1);
+	mpd_addIntArg(connection, id2);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendSeekCommand(mpd_Connection * connection, int song, int seek_time) {
+	mpd_beginCommand(connection, "seek");
+	mpd_addIntArg(connection, song);
+	mpd_addIntArg(connection, seek_time);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendSeekIdCommand(mpd_Connection * connection, int id, int seek_time) {
+	mpd_beginCommand(connection, "seekid");
+	mpd_addIntArg(connection, id);
+	mpd_addIntArg(connection, seek_time);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendUpdateCommand(mpd_Connection * connection,const char * path) {
+	mpd_beginCommand(connection, "update");
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
+}
+
+int mpd_getUpdateId(mpd_Connection * connection) {
+	char * jobid;
+	int ret = 0;
+
+	jobid = mpd_getNextReturnElementNamed(connection,"updating_db");
+	if(jobid) {
+		ret = atoi(jobid);
+		free(jobid);
+	}
 
 	return ret;
 }
 
-static void mpd_finishPlaylistFile(mpd_PlaylistFile * playlist) {
-	if(playlist->path) free(playlist->path);
-    if(playlist->mtime) free(playlist->mtime);
+void mpd_sendPrevCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"previous\n");
+}
+
+void mpd_sendSingleCommand(mpd_Connection * connection, int singleMode) {
+	mpd_beginCommand(connection, "single");
+	mpd_addIntArg(connection, singleMode);
+	mpd_endCommand(connection);
+}
+
+void mpd_sendConsumeCommand(mpd_Connection * connection, int consumeMode) {
+	mpd_beginCommand(connection, "consume");
+	mpd_addIntArg(connection, consumeMode);
+	mpd_endCommand(connection);
 }
 
-mpd_PlaylistFile * mpd_newPlaylistFile(void) {
-	return g_slice_new0(mpd_PlaylistFile);
+void mpd_sendRepeatCommand(mpd_Connection * connection, int repeatMode) {
+	mpd_beginCommand(connection, "repeat");
+	mpd_addIntArg(connection, repeatMode);
+	mpd_endCommand(connection);
 }
 
-void mpd_freePlaylistFile(mpd_PlaylistFile * playlist) {
-	mpd_finishPlaylistFile(playlist);
-	g_slice_free(mpd_PlaylistFile, playlist);
+void mpd_sendRandomCommand(mpd_Connection * connection, int randomMode) {
+	mpd_beginCommand(connection, "random");
+	mpd_addIntArg(connection, randomMode);
+	mpd_endCommand(connection);
 }
 
-mpd_PlaylistFile * mpd_playlistFileDup(mpd_PlaylistFile * playlist) {
-	mpd_PlaylistFile * ret = mpd_newPlaylistFile();
+void mpd_sendSetvolCommand(mpd_Connection * connection, int volumeChange) {
+	mpd_beginCommand(connection, "setvol");
+	mpd_addIntArg(connection, volumeChange);
+	mpd_endCommand(connection);
+}
 
-	if(playlist->path) ret->path = strdup(playlist->path);
-    if(playlist->mtime) ret->mtime = strdup(playlist->mtime);
+void mpd_sendCrossfadeCommand(mpd_Connection * connection, int seconds) {
+	mpd_beginCommand(connection, "crossfade");
+	mpd_addIntArg(connection, seconds);
+	mpd_endCommand(connection);
+}
 
-	return ret;
+void mpd_sendPasswordCommand(mpd_Connection * connection, const char * pass) {
+	mpd_beginCommand(connection, "password");
+	mpd_addArg(connection, pass);
+	mpd_endCommand(connection);
 }
 
-static void mpd_finishInfoEntity(mpd_InfoEntity * entity) {
-	if(entity->info.directory) {
-		if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
-			mpd_freeDirectory(entity->info.directory);
-		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_SONG) {
-			mpd_freeSong(entity->info.song);
-		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
-			mpd_freePlaylistFile(entity->info.playlistFile);
-		}
+void mpd_sendCommandListBegin(mpd_Connection * connection) {
+	if(connection->commandList) {
+		strcpy(connection->errorStr,"already in command list mode");
+		connection->error = 1;
+		return;
 	}
+	connection->commandList = COMMAND_LIST;
+	mpd_executeCommand(connection,"command_list_begin\n");
 }
 
-mpd_InfoEntity * mpd_newInfoEntity(void) {
-	return g_slice_new0(mpd_InfoEntity);
+void mpd_sendCommandListOkBegin(mpd_Connection * connection) {
+	if(connection->commandList) {
+		strcpy(connection->errorStr,"already in command list mode");
+		connection->error = 1;
+		return;
+	}
+	/* listOks is still counting for the response being read */
+	if(connection->pipelined || (connection->pipelining &&
+	                             !connection->doneProcessing)) {
+		strcpy(connection->errorStr,"can't pipeline command_list_ok");
+		connection->error = 1;
+		return;
+	}
+	connection->commandList = COMMAND_LIST_OK;
+	mpd_executeCommand(connection,"command_list_ok_begin\n");
+	connection->listOks = 0;
 }
 
-void mpd_freeInfoEntity(mpd_InfoEntity * entity) {
-	mpd_finishInfoEntity(entity);
-	g_slice_free(mpd_InfoEntity, entity);
+void mpd_sendCommandListEnd(mpd_Connection * connection) {
+	if(!connection->commandList) {
+		strcpy(connection->errorStr,"not in command list mode");
+		connection->error = 1;
+		return;
+	}
+	connection->commandList = 0;
+	mpd_executeCommand(connection,"command_list_end\n");
 }
 
-static void mpd_sendInfoCommand(mpd_Connection * connection,const char * command) {
-	mpd_executeCommand(connection,command);
+void mpd_sendOutputsCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"outputs\n");
 }
 
-mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection) {
-	mpd_InfoEntity * entity = NULL;
-
+mpd_OutputEntity * mpd_getNextOutput(mpd_Connection * connection) {
 	if(connection->doneProcessing || (connection->listOks &&
-	   connection->doneListOk))
+				connection->doneListOk))
 	{
 		return NULL;
 	}
 
-	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+	if(connection->error) return NULL;
 
-	if(connection->returnElement) {
-		if(strcmp(connection->returnElement->name,"file")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->file =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,
-					"directory")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_DIRECTORY;
-			entity->info.directory = mpd_newDirectory();
-			entity->info.directory->path =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name,"playlist")==0) {
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_PLAYLISTFILE;
-			entity->info.playlistFile = mpd_newPlaylistFile();
-			entity->info.playlistFile->path =
-				strdup(connection->returnElement->value);
-		}
-		else if(strcmp(connection->returnElement->name, "cpos") == 0){
-			entity = mpd_newInfoEntity();
-			entity->type = MPD_INFO_ENTITY_TYPE_SONG;
-			entity->info.song = mpd_newSong();
-			entity->info.song->pos = atoi(connection->returnElement->value);
-		}
-		else {
-			connection->error = 1;
-			strcpy(connection->errorStr,"problem parsing song info");
-			return NULL;
-		}
-	}
-	else return NULL;
+	mpd_OutputEntity* output = g_slice_new0(mpd_OutputEntity);
+	output->id = -10;
+
+	if(!connection->returnElement) mpd_getNextReturnElement(connection);
 
-	mpd_getNextReturnElement(connection);
 	while(connection->returnElement) {
 		mpd_ReturnElement * re = connection->returnElement;
-
-		if(strcmp(re->name,"file")==0) return entity;
-		else if(strcmp(re->name,"directory")==0) return entity;
-		else if(strcmp(re->name,"playlist")==0) return entity;
-		else if(strcmp(re->name,"cpos")==0) return entity;
-
-		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG &&
-				strlen(re->value)) {
-			if(strcmp(re->name,"Artist")==0) {
-				if(entity->info.song->artist) {
-					int length = strlen(entity->info.song->artist);
-					entity->info.song->artist = realloc(entity->info.song->artist, 
-					                                    length + strlen(re->value) + 3);
-					strcpy(&((entity->info.song->artist)[length]), ", ");
-					strcpy(&((entity->info.song->artist)[length + 2]), re->value);
-				}
-				else {
-					entity->info.song->artist = strdup(re->value);
-				}
-			}
-			else if(!entity->info.song->album &&
-					strcmp(re->name,"Album")==0) {
-				entity->info.song->album = strdup(re->value);
-			}
-			else if(!entity->info.song->title &&
-					strcmp(re->name,"Title")==0) {
-				entity->info.song->title = strdup(re->value);
-			}
-			else if(!entity->info.song->track &&
-					strcmp(re->name,"Track")==0) {
-				entity->info.song->track = strdup(re->value);
-			}
-			else if(!entity->info.song->name &&
-					strcmp(re->name,"Name")==0) {
-				entity->info.song->name = strdup(re->value);
-			}
-			else if(entity->info.song->time==MPD_SONG_NO_TIME &&
-					strcmp(re->name,"Time")==0) {
-				entity->info.song->time = atoi(re->value);
-			}
-			else if(entity->info.song->pos==MPD_SONG_NO_NUM &&
-					strcmp(re->name,"Pos")==0) {
-				entity->info.song->pos = atoi(re->value);
-			}
-			else if(entity->info.song->id==MPD_SONG_NO_ID &&
-					strcmp(re->name,"Id")==0) {
-				entity->info.song->id = atoi(re->value);
-			}
-			else if(!entity->info.song->date &&
-					strcmp(re->name, "Date") == 0) {
-				entity->info.song->date = strdup(re->value);
-			}
-			else if(!entity->info.song->genre &&
-					strcmp(re->name, "Genre") == 0) {
-				if(entity->info.song->genre) {
-					int length = strlen(entity->info.song->genre);
-					entity->info.song->genre = realloc(entity->info.song->genre, 
-					                                   length + strlen(re->value) + 4);
-					strcpy(&((entity->info.song->genre)[length]), ", ");
-					strcpy(&((entity->info.song->genre)[length + 3]), re->value);
-				}
-				else {
-					entity->info.song->genre = strdup(re->value);
-				}
-			}
-			else if(strcmp(re->name, "Composer") == 0) {
-				if(entity->info.song->composer) {
-					int length = strlen(entity->info.song->composer);
-					entity->info.song->composer = realloc(entity->info.song->composer, 
-					                                      length + strlen(re->value) + 3);
-					strcpy(&((entity->info.song->composer)[length]), ", ");
-					strcpy(&((entity->info.song->composer)[length + 2]), re->value);
-				}
-				else {
-					entity->info.song->composer = strdup(re->value);
-				}
-			}
-			else if(strcmp(re->name, "Performer") == 0) {
-				if(entity->info.song->performer) {
-					int length = strlen(entity->info.song->performer);
-					entity->info.song->performer = realloc(entity->info.song->performer, 
-					                                       length + strlen(re->value) + 3);
-					strcpy(&((entity->info.song->performer)[length]), ", ");
-					strcpy(&((entity->info.song->performer)[length + 2]), re->value);
-				}
-				else {
-					entity->info.song->performer = strdup(re->value);
-				}
-			}
-			else if(!entity->info.song->disc &&
-					strcmp(re->name, "Disc") == 0) {
-				entity->info.song->disc = strdup(re->value);
-			}
-			else if(!entity->info.song->comment &&
-					strcmp(re->name, "Comment") == 0) {
-				entity->info.song->comment = strdup(re->value);
-			}
-
-			else if(!entity->info.song->albumartist &&
-					strcmp(re->name, "AlbumArtist") == 0) {
-				entity->info.song->albumartist = strdup(re->value);
-			}
+		if(re->key == MPD_KEY_OUTPUTID) {
+			if(output!=NULL && output->id>=0) return output;
+			output->id = atoi(re->value);
 		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) {
+		else if(re->key == MPD_KEY_OUTPUTNAME) {
+			output->name = strdup(re->value);
 		}
-		else if(entity->type == MPD_INFO_ENTITY_TYPE_PLAYLISTFILE) {
-            if(!entity->info.playlistFile->mtime &&
-                    strcmp(re->name, "Last-Modified") == 0) {
-                    entity->info.playlistFile->mtime = strdup(re->value);
-            }
+		else if(re->key == MPD_KEY_OUTPUTENABLED) {
+			output->enabled = atoi(re->value);
 		}
 
 		mpd_getNextReturnElement(connection);
+		if(connection->error) {
+			mpd_freeOutputElement(output);
+			return NULL;
+		}
 	}
 
-	return entity;
+	return output;
 }
 
-static char * mpd_getNextReturnElementNamed(mpd_Connection * connection,
-		const char * name)
-{
-	if(connection->doneProcessing || (connection->listOks &&
-				connection->doneListOk))
-	{
-		return NULL;
-	}
-
-	mpd_getNextReturnElement(connection);
-	while(connection->returnElement) {
-		mpd_ReturnElement * re = connection->returnElement;
-
-		if(strcmp(re->name,name)==0) return strdup(re->value);
-		mpd_getNextReturnElement(connection);
-	}
-
-	return NULL;
+void mpd_sendEnableOutputCommand(mpd_Connection * connection, int outputId) {
+	mpd_beginCommand(connection, "enableoutput");
+	mpd_addIntArg(connection, outputId);
+	mpd_endCommand(connection);
 }
 
-char *mpd_getNextTag(mpd_Connection *connection, int type)
-{
-	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES ||
-	    type == MPD_TAG_ITEM_ANY)
-		return NULL;
-	if (type == MPD_TAG_ITEM_FILENAME)
-		return mpd_getNextReturnElementNamed(connection, "file");
-	return mpd_getNextReturnElementNamed(connection, mpdTagItemKeys[type]);
+void mpd_sendDisableOutputCommand(mpd_Connection * connection, int outputId) {
+	mpd_beginCommand(connection, "disableoutput");
+	mpd_addIntArg(connection, outputId);
+	mpd_endCommand(connection);
 }
 
-char * mpd_getNextArtist(mpd_Connection * connection) {
-	return mpd_getNextReturnElementNamed(connection,"Artist");
+void mpd_freeOutputElement(mpd_OutputEntity * output) {
+	if(output->name)
+		free(output->name);
+	g_slice_free(mpd_OutputEntity, output);
 }
 
-char * mpd_getNextAlbum(mpd_Connection * connection) {
-	return mpd_getNextReturnElementNamed(connection,"Album");
-}
+/**
+ * mpd_sendNotCommandsCommand
+ * odd naming, but it gets the not allowed commands
+ */
 
-void mpd_sendPlaylistInfoCommand(mpd_Connection * connection, int songPos) {
-	int len = strlen("playlistinfo")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistinfo \"%i\"\n", songPos);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendNotCommandsCommand(mpd_Connection * connection)
+{
+	mpd_executeCommand(connection, "notcommands\n");
 }
 
-void mpd_sendPlaylistIdCommand(mpd_Connection * connection, int id) {
-	int len = strlen("playlistid")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistid \"%i\"\n", id);
-	mpd_sendInfoCommand(connection, string);
-	free(string);
+/**
+ * mpd_sendCommandsCommand
+ * odd naming, but it gets the allowed commands
+ */
+void mpd_sendCommandsCommand(mpd_Connection * connection)
+{
+	mpd_executeCommand(connection, "commands\n");
 }
 
-void mpd_sendPlChangesCommand(mpd_Connection * connection, long long playlist) {
-	int len = strlen("plchanges")+2+LONGLONGLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "plchanges \"%lld\"\n", playlist);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+/**
+ * Get the next returned command
+ */
+char * mpd_getNextCommand(mpd_Connection * connection)
+{
+	return mpd_getNextReturnElementNamed(connection, "command");
 }
 
-void mpd_sendPlChangesPosIdCommand(mpd_Connection * connection, long long playlist) {
-	int len = strlen("plchangesposid")+2+LONGLONGLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "plchangesposid \"%lld\"\n", playlist);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendUrlHandlersCommand(mpd_Connection * connection)
+{
+	mpd_executeCommand(connection, "urlhandlers\n");
 }
 
-void mpd_sendListallCommand(mpd_Connection * connection, const char * dir) {
-	char * sDir = mpd_sanitizeArg(dir);
-	int len = strlen("listall")+2+strlen(sDir)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "listall \"%s\"\n", sDir);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-	free(sDir);
+char * mpd_getNextHandler(mpd_Connection * connection)
+{
+	return mpd_getNextReturnElementNamed(connection, "handler");
 }
 
-void mpd_sendListallInfoCommand(mpd_Connection * connection, const char * dir) {
-	char * sDir = mpd_sanitizeArg(dir);
-	int len = strlen("listallinfo")+2+strlen(sDir)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "listallinfo \"%s\"\n", sDir);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-	free(sDir);
+void mpd_sendTagTypesCommand(mpd_Connection * connection)
+{
+	mpd_executeCommand(connection, "tagtypes\n");
 }
 
-void mpd_sendLsInfoCommand(mpd_Connection * connection, const char * dir) {
-	char * sDir = mpd_sanitizeArg(dir);
-	int len = strlen("lsinfo")+2+strlen(sDir)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "lsinfo \"%s\"\n", sDir);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-	free(sDir);
+char * mpd_getNextTagType(mpd_Connection * connection)
+{
+	return mpd_getNextReturnElementNamed(connection, "tagtype");
 }
 
-void mpd_sendCurrentSongCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"currentsong\n");
+void mpd_startSearch(mpd_Connection *connection, int exact)
+{
+	if (connection->request) {
+		strcpy(connection->errorStr, "search already in progress");
+		connection->error = 1;
+		return;
+	}
+
+	if (exact) connection->request = strdup("find");
+	else connection->request = strdup("search");
+#ifndef WIN32
+	if (connection->mirror) mpd_startMirrorSearch(connection);
+#endif
 }
 
-void mpd_sendSearchCommand(mpd_Connection * connection, int table,
-		const char * str)
+void mpd_startStatsSearch(mpd_Connection *connection)
 {
-	mpd_startSearch(connection, 0);
-	mpd_addConstraintSearch(connection, table, str);
-	mpd_commitSearch(connection);
+	if (connection->request) {
+		strcpy(connection->errorStr, "search already in progress");
+		connection->error = 1;
+		return;
+	}
+
+	connection->request = strdup("count");
 }
 
-void mpd_sendFindCommand(mpd_Connection * connection, int table,
-		const char * str)
+void mpd_startPlaylistSearch(mpd_Connection *connection, int exact)
 {
-	mpd_startSearch(connection, 1);
-	mpd_addConstraintSearch(connection, table, str);
-	mpd_commitSearch(connection);
+	if (connection->request) {
+		strcpy(connection->errorStr, "search already in progress");
+		connection->error = 1;
+		return;
+	}
+
+	if (exact) connection->request = strdup("playlistfind");
+	else connection->request = strdup("playlistsearch");
 }
 
-void mpd_sendListCommand(mpd_Connection * connection, int table,
-		const char * arg1)
+void mpd_startFieldSearch(mpd_Connection *connection, int type)
 {
-	char st[10];
+	char *strtype;
 	int len;
-	char *string;
-	if(table == MPD_TABLE_ARTIST) strcpy(st,"artist");
-	else if(table == MPD_TABLE_ALBUM) strcpy(st,"album");
-	else {
+
+	if (connection->request) {
+		strcpy(connection->errorStr, "search already in progress");
+		connection->error = 1;
+		return;
+	}
+
+	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES) {
+		strcpy(connection->errorStr, "invalid type specified");
 		connection->error = 1;
-		strcpy(connection->errorStr,"unknown table for list");
 		return;
 	}
-	if(arg1) {
-		char * sanitArg1 = mpd_sanitizeArg(arg1);
-		len = strlen("list")+1+strlen(sanitArg1)+2+strlen(st)+3;
-		string = malloc(len);
-		snprintf(string, len, "list %s \"%s\"\n", st, sanitArg1);
-		free(sanitArg1);
-	}
-	else {
-		len = strlen("list")+1+strlen(st)+2;
-		string = malloc(len);
-		snprintf(string, len, "list %s\n", st);
-	}
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
 
-void mpd_sendAddCommand(mpd_Connection * connection, const char * file) {
-	char * sFile = mpd_sanitizeArg(file);
-	int len = strlen("add")+2+strlen(sFile)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "add \"%s\"\n", sFile);
-	mpd_executeCommand(connection,string);
-	free(string);
-	free(sFile);
+	strtype = mpdTagItemKeys[type];
+
+	len = 5+strlen(strtype)+1;
+	connection->request = malloc(len);
+
+	snprintf(connection->request, len, "list %c%s",
+	         tolower(strtype[0]), strtype+1);
 }
 
-int mpd_sendAddIdCommand(mpd_Connection *connection, const char *file)
+void mpd_addConstraintSearch(mpd_Connection *connection, int type, const char *name)
 {
-	int retval = -1;
-	char *sFile = mpd_sanitizeArg(file);
-	int len = strlen("addid")+2+strlen(sFile)+3;
-	char *string = malloc(len);
-
-	snprintf(string, len, "addid \"%s\"\n", sFile);
-	mpd_sendInfoCommand(connection, string);
-	free(string);
-	free(sFile);
+	char *strtype;
+	char *p;
+	int len;
 
-	string = mpd_getNextReturnElementNamed(connection, "Id");
-	if (string) {
-		retval = atoi(string);
-		free(string);
+	if (!connection->request) {
+		strcpy(connection->errorStr, "no search in progress");
+		connection->error = 1;
+		return;
 	}
-	
-	return retval;
-}
-
-void mpd_sendDeleteCommand(mpd_Connection * connection, int songPos) {
-	int len = strlen("delete")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "delete \"%i\"\n", songPos);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
 
-void mpd_sendDeleteIdCommand(mpd_Connection * connection, int id) {
-	int len = strlen("deleteid")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "deleteid \"%i\"\n", id);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
+	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES) {
+		strcpy(connection->errorStr, "invalid type specified");
+		connection->error = 1;
+		return;
+	}
 
-void mpd_sendSaveCommand(mpd_Connection * connection, const char * name) {
-	char * sName = mpd_sanitizeArg(name);
-	int len = strlen("save")+2+strlen(sName)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "save \"%s\"\n", sName);
-	mpd_executeCommand(connection,string);
-	free(string);
-	free(sName);
-}
+	if (name == NULL) {
+		strcpy(connection->errorStr, "no name specified");
+		connection->error = 1;
+		return;
+	}
 
-void mpd_sendLoadCommand(mpd_Connection * connection, const char * name) {
-	char * sName = mpd_sanitizeArg(name);
-	int len = strlen("load")+2+strlen(sName)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "load \"%s\"\n", sName);
-	mpd_executeCommand(connection,string);
-	free(string);
-	free(sName);
-}
+	strtype = mpdTagItemKeys[type];
+	len = strlen(connection->request);
+	connection->request = realloc(connection->request,
+	                              len+1+strlen(strtype)+2+2*strlen(name)+2);
+
+	p = connection->request+len;
+	*p++ = ' ';
+	*p++ = tolower(strtype[0]);
+	strcpy(p, strtype+1);
+	p += strlen(p);
+	*p++ = ' ';
+	*p++ = '"';
+	p = mpd_escapeArg(p, name);
+	*p++ = '"';
+	*p = '\0';
 
-void mpd_sendRmCommand(mpd_Connection * connection, const char * name) {
-	char * sName = mpd_sanitizeArg(name);
-	int len = strlen("rm")+2+strlen(sName)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "rm \"%s\"\n", sName);
-	mpd_executeCommand(connection,string);
-	free(string);
-	free(sName);
+#ifndef WIN32
+	if (connection->mirrorSearch)
+		mpd_addMirrorConstraint(connection, type, name);
+#endif
 }
 
-void mpd_sendRenameCommand(mpd_Connection *connection, const char *from,
-                           const char *to)
+void mpd_commitSearch(mpd_Connection *connection)
 {
-	char *sFrom = mpd_sanitizeArg(from);
-	char *sTo = mpd_sanitizeArg(to);
-	int len = strlen("rename")+2+strlen(sFrom)+3+strlen(sTo)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "rename \"%s\" \"%s\"\n", sFrom, sTo);
-	mpd_executeCommand(connection, string);
-	free(string);
-	free(sFrom);
-	free(sTo);
-}
+	if (!connection->request) {
+		strcpy(connection->errorStr, "no search in progress");
+		connection->error = 1;
+		return;
+	}
 
-void mpd_sendShuffleCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"shuffle\n");
-}
+#ifndef WIN32
+	if (connection->mirrorSearch) {
+		int local = mpd_searchMirror(connection);
 
-void mpd_sendClearCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"clear\n");
-}
+		mpd_dropMirrorSearch(connection);
+		if (local) {
+			free(connection->request);
+			connection->request = NULL;
+			return;
+		}
+	}
+#endif
 
-void mpd_sendPlayCommand(mpd_Connection * connection, int songPos) {
-	int len = strlen("play")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "play \"%i\"\n", songPos);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
+	mpd_beginCommand(connection, connection->request);
+	mpd_endCommand(connection);
 
-void mpd_sendPlayIdCommand(mpd_Connection * connection, int id) {
-	int len = strlen("playid")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playid \"%i\"\n", id);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+	free(connection->request);
+	connection->request = NULL;
 }
 
-void mpd_sendStopCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"stop\n");
+/**
+ * @param connection a MpdConnection
+ * @param path	the path to the playlist.
+ *
+ * List the content, with full metadata, of a stored playlist.
+ *
+ */
+void mpd_sendListPlaylistInfoCommand(mpd_Connection *connection,const char *path)
+{
+	mpd_beginCommand(connection, "listplaylistinfo");
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendPauseCommand(mpd_Connection * connection, int pauseMode) {
-	int len = strlen("pause")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "pause \"%i\"\n", pauseMode);
-	mpd_executeCommand(connection,string);
-	free(string);
+/**
+ * @param connection a MpdConnection
+ * @param path	the path to the playlist.
+ *
+ * List the content of a stored playlist.
+ *
+ */
+void mpd_sendListPlaylistCommand(mpd_Connection *connection,const char *path)
+{
+	mpd_beginCommand(connection, "listplaylist");
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendNextCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"next\n");
+void mpd_sendPlaylistClearCommand(mpd_Connection *connection,const char *path)
+{
+	mpd_beginCommand(connection, "playlistclear");
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendMoveCommand(mpd_Connection * connection, int from, int to) {
-	int len = strlen("move")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "move \"%i\" \"%i\"\n", from, to);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendPlaylistAddCommand(mpd_Connection *connection,
+                                const char *playlist,const char *path)
+{
+	mpd_beginCommand(connection, "playlistadd");
+	mpd_addArg(connection, playlist);
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendMoveIdCommand(mpd_Connection * connection, int id, int to) {
-	int len = strlen("moveid")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "moveid \"%i\" \"%i\"\n", id, to);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendPlaylistMoveCommand(mpd_Connection *connection,
+                                 const char *playlist, int from, int to)
+{
+	mpd_beginCommand(connection, "playlistmove");
+	mpd_addArg(connection, playlist);
+	mpd_addIntArg(connection, from);
+	mpd_addIntArg(connection, to);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendSwapCommand(mpd_Connection * connection, int song1, int song2) {
-	int len = strlen("swap")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "swap \"%i\" \"%i\"\n", song1, song2);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendPlaylistDeleteCommand(mpd_Connection *connection,
+                                   const char *playlist, int pos)
+{
+	mpd_beginCommand(connection, "playlistdelete");
+	mpd_addArg(connection, playlist);
+	mpd_addIntArg(connection, pos);
+	mpd_endCommand(connection);
 }
-
-void mpd_sendSwapIdCommand(mpd_Connection * connection, int id1, int id2) {
-	int len = strlen("swapid")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "swapid \"%i\" \"%i\"\n", id1, id2);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
+void mpd_sendClearErrorCommand(mpd_Connection * connection) {
+	mpd_executeCommand(connection,"clearerror\n");
 }
 
-void mpd_sendSeekCommand(mpd_Connection * connection, int song, int seek_time) {
-	int len = strlen("seek")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "seek \"%i\" \"%i\"\n", song, seek_time);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
 
-void mpd_sendSeekIdCommand(mpd_Connection * connection, int id, int seek_time) {
-	int len = strlen("seekid")+2+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "seekid \"%i\" \"%i\"\n", id, seek_time);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-}
+void mpd_sendIdleCommand(mpd_Connection *connection, const char *subsystems)
+{
+	mpd_beginCommand(connection, "idle");
+	if (subsystems) {
+		mpd_appendPending(connection, " ", 1);
+		mpd_appendPending(connection, subsystems, strlen(subsystems));
+	}
+	mpd_endCommand(connection);
 
-void mpd_sendUpdateCommand(mpd_Connection * connection,const char * path) {
-	char * sPath = mpd_sanitizeArg(path);
-	int len = strlen("update")+2+strlen(sPath)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "update \"%s\"\n", sPath);
-	mpd_sendInfoCommand(connection,string);
-	free(string);
-	free(sPath);
+	if (!connection->error) connection->idle = 1;
 }
 
-int mpd_getUpdateId(mpd_Connection * connection) {
-	char * jobid;
-	int ret = 0;
-
-	jobid = mpd_getNextReturnElementNamed(connection,"updating_db");
-	if(jobid) {
-		ret = atoi(jobid);
-		free(jobid);
+void mpd_sendNoIdleCommand(mpd_Connection *connection)
+{
+#ifndef WIN32
+	if (connection->async) {
+		mpd_asyncNoIdle(connection);
+		return;
 	}
+#endif
+	/* nothing to cancel if mpd has already answered the idle */
+	if (!connection->idle ||
+	    (connection->doneProcessing && !connection->pipelined)) return;
 
-	return ret;
-}
-
-void mpd_sendPrevCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"previous\n");
+	/* noidle gets no reply of its own, it makes mpd finish the idle
+	 * one, so don't trip over that still being outstanding, nor count
+	 * it when it is pipelined behind other responses */
+	if (connection->pipelined) connection->pipelined--;
+	else connection->doneProcessing = 1;
+	mpd_executeCommand(connection, "noidle\n");
 }
 
-void mpd_sendSingleCommand(mpd_Connection * connection, int singleMode) {
-	int len = strlen("repeat")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "single \"%i\"\n", singleMode);
-	mpd_executeCommand(connection,string);
-	free(string);
+void mpd_sendGetEventsCommand(mpd_Connection *connection) {
+	mpd_sendIdleCommand(connection, NULL);
 }
 
-void mpd_sendConsumeCommand(mpd_Connection * connection, int consumeMode) {
-	int len = strlen("repeat")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "consume \"%i\"\n", consumeMode);
-	mpd_executeCommand(connection,string);
-	free(string);
+char * mpd_getNextEvent(mpd_Connection *connection)
+{
+    return mpd_getNextReturnElementNamed(connection, "changed");
 }
 
-void mpd_sendRepeatCommand(mpd_Connection * connection, int repeatMode) {
-	int len = strlen("repeat")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "repeat \"%i\"\n", repeatMode);
-	mpd_executeCommand(connection,string);
-	free(string);
+void mpd_sendListPlaylistsCommand(mpd_Connection * connection) {
+    mpd_sendInfoCommand(connection, "listplaylists\n");
 }
 
-void mpd_sendRandomCommand(mpd_Connection * connection, int randomMode) {
-	int len = strlen("random")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "random \"%i\"\n", randomMode);
-	mpd_executeCommand(connection,string);
-	free(string);
+char * mpd_getNextSticker (mpd_Connection * connection)
+{
+	return mpd_getNextReturnElementNamed(connection, "sticker");
 }
-
-void mpd_sendSetvolCommand(mpd_Connection * connection, int volumeChange) {
-	int len = strlen("setvol")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "setvol \"%i\"\n", volumeChange);
-	mpd_executeCommand(connection,string);
-	free(string);
+void  mpd_sendGetSongSticker(mpd_Connection *connection, const char *song_path, const char *sticker)
+{
+    mpd_beginCommand(connection, "sticker get song");
+    mpd_addArg(connection, song_path);
+    mpd_addArg(connection, sticker);
+    mpd_endCommand(connection);
 }
 
-void mpd_sendCrossfadeCommand(mpd_Connection * connection, int seconds) {
-	int len = strlen("crossfade")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "crossfade \"%i\"\n", seconds);
-	mpd_executeCommand(connection,string);
-	free(string);
+void mpd_sendSetSongSticker(mpd_Connection *connection, const char *song_path, const char *sticker, const char *value)
+{
+    mpd_beginCommand(connection, "sticker set song");
+    mpd_addArg(connection, song_path);
+    mpd_addArg(connection, sticker);
+    mpd_addArg(connection, value);
+    mpd_endCommand(connection);
 }
 
-void mpd_sendPasswordCommand(mpd_Connection * connection, const char * pass) {
-	char * sPass = mpd_sanitizeArg(pass);
-	int len = strlen("password")+2+strlen(sPass)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "password \"%s\"\n", sPass);
-	mpd_executeCommand(connection,string);
-	free(string);
-	free(sPass);
+void mpd_sendSetReplayGainMode(mpd_Connection *connection, const char *mode)
+{
+    mpd_beginCommand(connection, "replay_gain_mode");
+    mpd_addArg(connection, mode);
+    mpd_endCommand(connection);
 }
-
-void mpd_sendCommandListBegin(mpd_Connection * connection) {
-	if(connection->commandList) {
-		strcpy(connection->errorStr,"already in command list mode");
-		connection->error = 1;
-		return;
-	}
-	connection->commandList = COMMAND_LIST;
-	mpd_executeCommand(connection,"command_list_begin\n");
+void mpd_sendReplayGainModeCommand(mpd_Connection *connection)
+{
+	mpd_executeCommand(connection, "replay_gain_status\n");
 }
-
-void mpd_sendCommandListOkBegin(mpd_Connection * connection) {
-	if(connection->commandList) {
-		strcpy(connection->errorStr,"already in command list mode");
-		connection->error = 1;
-		return;
-	}
-	connection->commandList = COMMAND_LIST_OK;
-	mpd_executeCommand(connection,"command_list_ok_begin\n");
-	connection->listOks = 0;
+char *mpd_getReplayGainMode(mpd_Connection *connection)
+{
+    return mpd_getNextReturnElementNamed(connection, "replay_gain_mode");
 }
 
-void mpd_sendCommandListEnd(mpd_Connection * connection) {
-	if(!connection->commandList) {
-		strcpy(connection->errorStr,"not in command list mode");
-		connection->error = 1;
-		return;
-	}
-	connection->commandList = 0;
-	mpd_executeCommand(connection,"command_list_end\n");
+void mpd_sendMountCommand(mpd_Connection *connection, const char *path,
+                          const char *uri)
+{
+	mpd_beginCommand(connection, "mount");
+	mpd_addArg(connection, path);
+	mpd_addArg(connection, uri);
+	mpd_endCommand(connection);
 }
 
-void mpd_sendOutputsCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"outputs\n");
+void mpd_sendUnmountCommand(mpd_Connection *connection, const char *path)
+{
+	mpd_beginCommand(connection, "unmount");
+	mpd_addArg(connection, path);
+	mpd_endCommand(connection);
 }
 
-mpd_OutputEntity * mpd_getNextOutput(mpd_Connection * connection) {
-	if(connection->doneProcessing || (connection->listOks &&
-				connection->doneListOk))
-	{
-		return NULL;
-	}
-
-	if(connection->error) return NULL;
-
-	mpd_OutputEntity* output = g_slice_new0(mpd_OutputEntity);
-	output->id = -10;
+#ifndef WIN32
+/* MIRROR */
 
-	if(!connection->returnElement) mpd_getNextReturnElement(connection);
+/* the file is a header and then arrays the header has the offsets of:
+ * the entities in listallinfo order, the values of tags that can have
+ * several, the entities of each directory, all entities sorted by path
+ * for looking them up, the search index and the strings, each stored
+ * once.  numbers are in the byte order of the machine that wrote it.
+ *
+ * the search index has a key for each value of each tag (the path
+ * being the filename tag), with the songs that have it.  the keys are
+ * sorted by tag and value, for find, and hold the value casefolded,
+ * for search.  a search for at least three characters only looks at
+ * the keys listed for the rarest trigram, three byte run, of it */
+
+#define MPD_MIRROR_VERSION	2
+/* parent of the entities at the top */
+#define MPD_MIRROR_ROOT		0xffffffffu
+
+static const char mpd_mirrorMagic[8] = "MPDMIRR";
+
+typedef struct _mpd_MirrorHeader {
+	char magic[8];
+	guint32 version;
+	/* catches a layout from another compiler or enum */
+	guint32 entitySize;
+	guint64 dbUpdate;
+	guint32 entityCount;
+	guint32 valueCount;
+	/* the top directory's part of children */
+	guint32 rootFirst;
+	guint32 rootCount;
+	/* byte offsets */
+	guint32 entities;
+	guint32 values;
+	guint32 children;
+	guint32 byPath;
+	guint32 keys;
+	guint32 postings;
+	guint32 trigrams;
+	guint32 trigramKeys;
+	guint32 strings;
+	guint32 stringsSize;
+	guint32 keyCount;
+	guint32 postingCount;
+	guint32 trigramCount;
+	guint32 trigramKeyCount;
+	/* the keys of tag t are keys[tagKeys[t] .. tagKeys[t+1]) */
+	guint32 tagKeys[MPD_TAG_ITEM_ANY+1];
+} mpd_MirrorHeader;
+
+/* strings are offsets into the strings, 0 being none */
+typedef struct _mpd_MirrorEntity {
+	guint32 type;
+	guint32 path;
+	guint32 parent;
+	/* a directory's entities are children[first .. first+count) */
+	guint32 first;
+	guint32 count;
+	gint32 time;
+	/* what the song's fields have, by MPD_TAG_ITEM_* */
+	guint32 tags[MPD_TAG_ITEM_ANY];
+	/* each value of the tags with a list is values[value ..
+	 * value+valueCount) */
+	guint32 value;
+	guint32 valueCount;
+} mpd_MirrorEntity;
+
+typedef struct _mpd_MirrorValue {
+	guint32 tag;
+	guint32 string;
+} mpd_MirrorValue;
+
+/* the songs with the value are postings[first .. first+count) */
+typedef struct _mpd_MirrorKey {
+	guint32 tag;
+	guint32 string;
+	guint32 fold;
+	guint32 first;
+	guint32 count;
+} mpd_MirrorKey;
+
+/* the keys with the trigram are trigramKeys[first .. first+count) */
+typedef struct _mpd_MirrorTrigram {
+	guint32 trigram;
+	guint32 first;
+	guint32 count;
+} mpd_MirrorTrigram;
+
+/* a constraint of a search being built */
+typedef struct _mpd_MirrorConstraint {
+	int type;
+	char * value;
+} mpd_MirrorConstraint;
+
+struct _mpd_Mirror {
+	void * map;
+	size_t size;
+	const mpd_MirrorHeader * header;
+	const mpd_MirrorEntity * entities;
+	const mpd_MirrorValue * values;
+	const guint32 * children;
+	const guint32 * byPath;
+	const mpd_MirrorKey * keys;
+	const guint32 * postings;
+	const mpd_MirrorTrigram * trigrams;
+	const guint32 * trigramKeys;
+	const char * strings;
+};
 
-	while(connection->returnElement) {
-		mpd_ReturnElement * re = connection->returnElement;
-		if(strcmp(re->name,"outputid")==0) {
-			if(output!=NULL && output->id>=0) return output;
-			output->id = atoi(re->value);
-		}
-		else if(strcmp(re->name,"outputname")==0) {
-			output->name = strdup(re->value);
-		}
-		else if(strcmp(re->name,"outputenabled")==0) {
-			output->enabled = atoi(re->value);
-		}
+/* the song field of each tag */
+static const unsigned short mpd_tagFields[MPD_TAG_ITEM_ANY] = {
+	[MPD_TAG_ITEM_ARTIST] = offsetof(mpd_Song, artist),
+	[MPD_TAG_ITEM_ALBUM] = offsetof(mpd_Song, album),
+	[MPD_TAG_ITEM_TITLE] = offsetof(mpd_Song, title),
+	[MPD_TAG_ITEM_TRACK] = offsetof(mpd_Song, track),
+	[MPD_TAG_ITEM_NAME] = offsetof(mpd_Song, name),
+	[MPD_TAG_ITEM_GENRE] = offsetof(mpd_Song, genre),
+	[MPD_TAG_ITEM_DATE] = offsetof(mpd_Song, date),
+	[MPD_TAG_ITEM_COMPOSER] = offsetof(mpd_Song, composer),
+	[MPD_TAG_ITEM_PERFORMER] = offsetof(mpd_Song, performer),
+	[MPD_TAG_ITEM_COMMENT] = offsetof(mpd_Song, comment),
+	[MPD_TAG_ITEM_DISC] = offsetof(mpd_Song, disc),
+	[MPD_TAG_ITEM_FILENAME] = offsetof(mpd_Song, file),
+	[MPD_TAG_ITEM_ALBUM_ARTIST] = offsetof(mpd_Song, albumartist),
+};
 
-		mpd_getNextReturnElement(connection);
-		if(connection->error) {
-			mpd_freeOutputElement(output);
-			return NULL;
+/* the mirror being written */
+typedef struct _mpd_MirrorBuilder {
+	GString * strings;
+	/* string to offset */
+	GHashTable * offsets;
+	/* string offset of a directory's path to its entity */
+	GHashTable * dirs;
+	GArray * entities;
+	GArray * values;
+	/* the search index */
+	GArray * keys;
+	GArray * postings;
+	GArray * trigrams;
+	GArray * trigramKeys;
+} mpd_MirrorBuilder;
+
+/* a song with a value, before the keys are made */
+typedef struct _mpd_MirrorPosting {
+	guint32 tag;
+	guint32 string;
+	guint32 entity;
+} mpd_MirrorPosting;
+
+static guint32 mpd_mirrorString(mpd_MirrorBuilder * builder, const char * string) {
+	gpointer offset;
+
+	if(!string || !*string) return 0;
+	if(g_hash_table_lookup_extended(builder->offsets, string, NULL, &offset))
+		return GPOINTER_TO_UINT(offset);
+	offset = GUINT_TO_POINTER(builder->strings->len);
+	g_string_append_len(builder->strings, string, strlen(string)+1);
+	g_hash_table_insert(builder->offsets, g_strdup(string), offset);
+	return GPOINTER_TO_UINT(offset);
+}
+
+static void mpd_mirrorAdd(mpd_MirrorBuilder * builder, mpd_InfoEntity * entity) {
+	mpd_MirrorEntity e;
+	mpd_Song * song = entity->info.song;
+	int tag;
+
+	memset(&e, 0, sizeof(e));
+	e.type = entity->type;
+	e.time = MPD_SONG_NO_TIME;
+	e.value = builder->values->len;
+	switch(entity->type) {
+	case MPD_INFO_ENTITY_TYPE_DIRECTORY:
+		e.path = mpd_mirrorString(builder, entity->info.directory->path);
+		g_hash_table_insert(builder->dirs, GUINT_TO_POINTER(e.path),
+		                    GUINT_TO_POINTER(builder->entities->len));
+		break;
+	case MPD_INFO_ENTITY_TYPE_PLAYLISTFILE:
+		e.path = mpd_mirrorString(builder, entity->info.playlistFile->path);
+		break;
+	case MPD_INFO_ENTITY_TYPE_SONG:
+		e.path = mpd_mirrorString(builder, song->file);
+		e.time = song->time;
+		for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+			int field = mpd_tagFields[tag];
+			int l = mpd_songList(field);
+			mpd_MirrorValue value;
+			char ** list;
+
+			if(tag == MPD_TAG_ITEM_FILENAME) continue;
+			e.tags[tag] = mpd_mirrorString(builder, MPD_SONG_STRING(song, field));
+			if(l < 0 || !e.tags[tag]) continue;
+			value.tag = tag;
+			list = MPD_SONG_LIST(song, mpd_songLists[l].list);
+			if(!list) {
+				value.string = e.tags[tag];
+				g_array_append_val(builder->values, value);
+				continue;
+			}
+			for(; *list; list++) {
+				value.string = mpd_mirrorString(builder, *list);
+				g_array_append_val(builder->values, value);
+			}
 		}
+		break;
 	}
-
-	return output;
+	e.valueCount = builder->values->len-e.value;
+	g_array_append_val(builder->entities, e);
 }
 
-void mpd_sendEnableOutputCommand(mpd_Connection * connection, int outputId) {
-	int len = strlen("enableoutput")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "enableoutput \"%i\"\n", outputId);
-	mpd_executeCommand(connection,string);
-	free(string);
-}
-
-void mpd_sendDisableOutputCommand(mpd_Connection * connection, int outputId) {
-	int len = strlen("disableoutput")+2+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "disableoutput \"%i\"\n", outputId);
-	mpd_executeCommand(connection,string);
-	free(string);
-}
+static gint mpd_comparePaths(gconstpointer a, gconstpointer b, gpointer data) {
+	const mpd_MirrorBuilder * builder = data;
+	const mpd_MirrorEntity * entities = (mpd_MirrorEntity *)builder->entities->data;
 
-void mpd_freeOutputElement(mpd_OutputEntity * output) {
-	if(output->name)
-		free(output->name);
-	g_slice_free(mpd_OutputEntity, output);
+	return strcmp(builder->strings->str+entities[*(const guint32 *)a].path,
+	              builder->strings->str+entities[*(const guint32 *)b].path);
 }
 
-/**
- * mpd_sendNotCommandsCommand
- * odd naming, but it gets the not allowed commands
- */
+/* fill in the parents, then group the entities by them and sort them
+ * by path, leaving the header to be written */
+static void mpd_mirrorIndex(mpd_MirrorBuilder * builder, mpd_MirrorHeader * header,
+                            guint32 * children, guint32 * byPath)
+{
+	mpd_MirrorEntity * entities = (mpd_MirrorEntity *)builder->entities->data;
+	guint32 count = builder->entities->len;
+	guint32 i, first = 0;
+
+	header->rootCount = 0;
+	for(i = 0; i < count; i++) {
+		const char * path = builder->strings->str+entities[i].path;
+		const char * slash = strrchr(path, '/');
+		gpointer offset, index;
+		char * dir;
+
+		entities[i].parent = MPD_MIRROR_ROOT;
+		entities[i].first = entities[i].count = 0;
+		if(!slash) {
+			header->rootCount++;
+			continue;
+		}
+		dir = g_strndup(path, slash-path);
+		if(g_hash_table_lookup_extended(builder->offsets, dir, NULL, &offset) &&
+		   g_hash_table_lookup_extended(builder->dirs, offset, NULL, &index))
+		{
+			entities[i].parent = GPOINTER_TO_UINT(index);
+		}
+		g_free(dir);
+		if(entities[i].parent == MPD_MIRROR_ROOT) header->rootCount++;
+		else entities[entities[i].parent].count++;
+	}
 
-void mpd_sendNotCommandsCommand(mpd_Connection * connection)
-{
-	mpd_executeCommand(connection, "notcommands\n");
+	header->rootFirst = first;
+	first += header->rootCount;
+	header->rootCount = 0;
+	for(i = 0; i < count; i++) {
+		if(entities[i].type != MPD_INFO_ENTITY_TYPE_DIRECTORY) continue;
+		entities[i].first = first;
+		first += entities[i].count;
+		entities[i].count = 0;
+	}
+	for(i = 0; i < count; i++) {
+		guint32 parent = entities[i].parent;
+
+		if(parent == MPD_MIRROR_ROOT)
+			children[header->rootFirst+header->rootCount++] = i;
+		else
+			children[entities[parent].first+entities[parent].count++] = i;
+		byPath[i] = i;
+	}
+	g_qsort_with_data(byPath, count, sizeof(guint32), mpd_comparePaths, builder);
 }
 
-/**
- * mpd_sendCommandsCommand
- * odd naming, but it gets the allowed commands
- */
-void mpd_sendCommandsCommand(mpd_Connection * connection)
-{
-	mpd_executeCommand(connection, "commands\n");
+/* casefolded like mpd does for search */
+static char * mpd_fold(const char * string) {
+	if(g_utf8_validate(string, -1, NULL)) return g_utf8_casefold(string, -1);
+	return g_ascii_strdown(string, -1);
 }
 
-/**
- * Get the next returned command
- */
-char * mpd_getNextCommand(mpd_Connection * connection)
-{
-	return mpd_getNextReturnElementNamed(connection, "command");
+static guint32 mpd_trigram(const char * p) {
+	return (guint32)(unsigned char)p[0] << 16 |
+	       (guint32)(unsigned char)p[1] << 8 | (unsigned char)p[2];
 }
 
-void mpd_sendUrlHandlersCommand(mpd_Connection * connection)
-{
-	mpd_executeCommand(connection, "urlhandlers\n");
+static gint mpd_comparePostings(gconstpointer a, gconstpointer b) {
+	const mpd_MirrorPosting * x = a;
+	const mpd_MirrorPosting * y = b;
+
+	if(x->tag != y->tag) return x->tag < y->tag ? -1 : 1;
+	if(x->string != y->string) return x->string < y->string ? -1 : 1;
+	if(x->entity != y->entity) return x->entity < y->entity ? -1 : 1;
+	return 0;
 }
 
-char * mpd_getNextHandler(mpd_Connection * connection)
-{
-	return mpd_getNextReturnElementNamed(connection, "handler");
+static gint mpd_compareKeys(gconstpointer a, gconstpointer b, gpointer data) {
+	const mpd_MirrorKey * x = a;
+	const mpd_MirrorKey * y = b;
+	const char * strings = ((mpd_MirrorBuilder *)data)->strings->str;
+
+	if(x->tag != y->tag) return x->tag < y->tag ? -1 : 1;
+	return strcmp(strings+x->string, strings+y->string);
 }
 
-void mpd_sendTagTypesCommand(mpd_Connection * connection)
-{
-	mpd_executeCommand(connection, "tagtypes\n");
+static gint mpd_compareTrigrams(gconstpointer a, gconstpointer b) {
+	guint64 x = *(const guint64 *)a;
+	guint64 y = *(const guint64 *)b;
+
+	return x < y ? -1 : x > y;
 }
 
-char * mpd_getNextTagType(mpd_Connection * connection)
+static void mpd_addPosting(GArray * postings, guint32 tag, guint32 string,
+                           guint32 entity)
 {
-	return mpd_getNextReturnElementNamed(connection, "tagtype");
+	mpd_MirrorPosting posting;
+
+	posting.tag = tag;
+	posting.string = string;
+	posting.entity = entity;
+	g_array_append_val(postings, posting);
 }
 
-void mpd_startSearch(mpd_Connection *connection, int exact)
+/* make the keys from every song's values, then the trigrams from the
+ * keys */
+static void mpd_mirrorSearchIndex(mpd_MirrorBuilder * builder,
+                                  mpd_MirrorHeader * header)
 {
-	if (connection->request) {
-		strcpy(connection->errorStr, "search already in progress");
-		connection->error = 1;
-		return;
+	const mpd_MirrorEntity * entities = (mpd_MirrorEntity *)builder->entities->data;
+	const mpd_MirrorValue * values = (mpd_MirrorValue *)builder->values->data;
+	GArray * postings = g_array_new(FALSE, FALSE, sizeof(mpd_MirrorPosting));
+	GArray * pairs = g_array_new(FALSE, FALSE, sizeof(guint64));
+	mpd_MirrorPosting * p;
+	guint32 i, j;
+	int tag;
+
+	for(i = 0; i < builder->entities->len; i++) {
+		const mpd_MirrorEntity * e = entities+i;
+
+		if(e->type != MPD_INFO_ENTITY_TYPE_SONG) continue;
+		for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+			if(tag == MPD_TAG_ITEM_FILENAME) {
+				if(e->path) mpd_addPosting(postings, tag, e->path, i);
+			}
+			else if(mpd_songList(mpd_tagFields[tag]) < 0 && e->tags[tag]) {
+				mpd_addPosting(postings, tag, e->tags[tag], i);
+			}
+		}
+		/* each value of those with a list counts on its own */
+		for(j = e->value; j < e->value+e->valueCount; j++)
+			mpd_addPosting(postings, values[j].tag, values[j].string, i);
 	}
 
-	if (exact) connection->request = strdup("find");
-	else connection->request = strdup("search");
-}
+	g_array_sort(postings, mpd_comparePostings);
+	p = (mpd_MirrorPosting *)postings->data;
+	for(i = 0; i < postings->len; i++) {
+		mpd_MirrorKey key;
 
-void mpd_startStatsSearch(mpd_Connection *connection)
-{
-	if (connection->request) {
-		strcpy(connection->errorStr, "search already in progress");
-		connection->error = 1;
-		return;
+		if(i > 0 && p[i].tag == p[i-1].tag && p[i].string == p[i-1].string) {
+			if(p[i].entity != p[i-1].entity) {
+				g_array_append_val(builder->postings, p[i].entity);
+				g_array_index(builder->keys, mpd_MirrorKey,
+				              builder->keys->len-1).count++;
+			}
+			continue;
+		}
+		key.tag = p[i].tag;
+		key.string = p[i].string;
+		key.fold = 0;
+		key.first = builder->postings->len;
+		key.count = 1;
+		g_array_append_val(builder->keys, key);
+		g_array_append_val(builder->postings, p[i].entity);
+	}
+	g_array_free(postings, TRUE);
+
+	g_array_sort_with_data(builder->keys, mpd_compareKeys, builder);
+	memset(header->tagKeys, 0, sizeof(header->tagKeys));
+	for(i = 0; i < builder->keys->len; i++) {
+		mpd_MirrorKey * key = &g_array_index(builder->keys, mpd_MirrorKey, i);
+		char * fold = mpd_fold(builder->strings->str+key->string);
+		const char * f;
+		guint32 length;
+
+		header->tagKeys[key->tag+1] = i+1;
+		key->fold = mpd_mirrorString(builder, fold);
+		g_free(fold);
+		f = builder->strings->str+key->fold;
+		length = strlen(f);
+		for(j = 0; j+3 <= length; j++) {
+			guint64 pair = (guint64)mpd_trigram(f+j) << 32 | i;
+			g_array_append_val(pairs, pair);
+		}
+	}
+	/* tags without keys start where the one before ends */
+	for(tag = 1; tag <= MPD_TAG_ITEM_ANY; tag++) {
+		if(header->tagKeys[tag] < header->tagKeys[tag-1])
+			header->tagKeys[tag] = header->tagKeys[tag-1];
 	}
 
-	connection->request = strdup("count");
+	g_array_sort(pairs, mpd_compareTrigrams);
+	for(i = 0; i < pairs->len; i++) {
+		guint64 pair = g_array_index(pairs, guint64, i);
+		guint32 key = (guint32)pair;
+		mpd_MirrorTrigram trigram;
+
+		/* a trigram can be in a value more than once */
+		if(i > 0 && pair == g_array_index(pairs, guint64, i-1)) continue;
+		if(i > 0 && pair >> 32 == g_array_index(pairs, guint64, i-1) >> 32) {
+			g_array_index(builder->trigrams, mpd_MirrorTrigram,
+			              builder->trigrams->len-1).count++;
+		}
+		else {
+			trigram.trigram = pair >> 32;
+			trigram.first = builder->trigramKeys->len;
+			trigram.count = 1;
+			g_array_append_val(builder->trigrams, trigram);
+		}
+		g_array_append_val(builder->trigramKeys, key);
+	}
+	g_array_free(pairs, TRUE);
 }
 
-void mpd_startPlaylistSearch(mpd_Connection *connection, int exact)
+/* returns 0, or the errno of what went wrong */
+static int mpd_writeMirror(mpd_MirrorBuilder * builder, const char * path,
+                           unsigned long dbUpdate)
 {
-	if (connection->request) {
-		strcpy(connection->errorStr, "search already in progress");
-		connection->error = 1;
-		return;
+	guint32 count = builder->entities->len;
+	guint32 * children = g_new(guint32, count ? count : 1);
+	guint32 * byPath = g_new(guint32, count ? count : 1);
+	char * tmp = g_strconcat(path, ".tmp", NULL);
+	mpd_MirrorHeader header;
+	FILE * file;
+	int ok = 0;
+	int error;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, mpd_mirrorMagic, sizeof(header.magic));
+	header.version = MPD_MIRROR_VERSION;
+	header.entitySize = sizeof(mpd_MirrorEntity);
+	header.dbUpdate = dbUpdate;
+	header.entityCount = count;
+	header.valueCount = builder->values->len;
+	mpd_mirrorIndex(builder, &header, children, byPath);
+	mpd_mirrorSearchIndex(builder, &header);
+	header.keyCount = builder->keys->len;
+	header.postingCount = builder->postings->len;
+	header.trigramCount = builder->trigrams->len;
+	header.trigramKeyCount = builder->trigramKeys->len;
+	header.entities = sizeof(header);
+	header.values = header.entities+count*sizeof(mpd_MirrorEntity);
+	header.children = header.values+header.valueCount*sizeof(mpd_MirrorValue);
+	header.byPath = header.children+count*sizeof(guint32);
+	header.keys = header.byPath+count*sizeof(guint32);
+	header.postings = header.keys+header.keyCount*sizeof(mpd_MirrorKey);
+	header.trigrams = header.postings+header.postingCount*sizeof(guint32);
+	header.trigramKeys = header.trigrams+
+	                     header.trigramCount*sizeof(mpd_MirrorTrigram);
+	header.strings = header.trigramKeys+header.trigramKeyCount*sizeof(guint32);
+	header.stringsSize = builder->strings->len;
+
+	errno = 0;
+	if((file = fopen(tmp, "wb"))) {
+		ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+		     fwrite(builder->entities->data, sizeof(mpd_MirrorEntity),
+		            count, file) == count &&
+		     fwrite(builder->values->data, sizeof(mpd_MirrorValue),
+		            header.valueCount, file) == header.valueCount &&
+		     fwrite(children, sizeof(guint32), count, file) == count &&
+		     fwrite(byPath, sizeof(guint32), count, file) == count &&
+		     fwrite(builder->keys->data, sizeof(mpd_MirrorKey),
+		            header.keyCount, file) == header.keyCount &&
+		     fwrite(builder->postings->data, sizeof(guint32),
+		            header.postingCount, file) == header.postingCount &&
+		     fwrite(builder->trigrams->data, sizeof(mpd_MirrorTrigram),
+		            header.trigramCount, file) == header.trigramCount &&
+		     fwrite(builder->trigramKeys->data, sizeof(guint32),
+		            header.trigramKeyCount, file) == header.trigramKeyCount &&
+		     fwrite(builder->strings->str, 1, header.stringsSize, file) ==
+		            header.stringsSize;
+		if(fclose(file) != 0) ok = 0;
+		/* replace the old one only once the new one is complete */
+		if(ok) ok = rename(tmp, path) == 0;
 	}
+	/* a short write needn't have set errno */
+	error = ok ? 0 : errno ? errno : EIO;
+	if(file && !ok) unlink(tmp);
 
-	if (exact) connection->request = strdup("playlistfind");
-	else connection->request = strdup("playlistsearch");
+	g_free(tmp);
+	g_free(children);
+	g_free(byPath);
+	return error;
 }
 
-void mpd_startFieldSearch(mpd_Connection *connection, int type)
+/* db_update from stats, returns -1 on error */
+static int mpd_getDbUpdate(mpd_Connection * connection,
+                           unsigned long * dbUpdate)
 {
-	char *strtype;
-	int len;
+	mpd_Stats * stats;
+
+	mpd_sendStatsCommand(connection);
+	stats = mpd_getStats(connection);
+	mpd_finishCommand(connection);
+	if(!stats) return -1;
+	*dbUpdate = stats->dbUpdateTime;
+	mpd_freeStats(stats);
+	return 0;
+}
 
-	if (connection->request) {
-		strcpy(connection->errorStr, "search already in progress");
-		connection->error = 1;
-		return;
-	}
+int mpd_isMirrorCurrent(mpd_Connection * connection, mpd_Mirror * mirror) {
+	unsigned long dbUpdate;
 
-	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES) {
-		strcpy(connection->errorStr, "invalid type specified");
-		connection->error = 1;
-		return;
+	if(mpd_getDbUpdate(connection, &dbUpdate) < 0) return -1;
+	return mirror->header->dbUpdate == dbUpdate;
+}
+
+int mpd_updateMirror(mpd_Connection * connection, const char * path) {
+	mpd_MirrorBuilder builder;
+	mpd_InfoEntity * entity;
+	mpd_Mirror * mirror;
+	mpd_Arena * arena;
+	mpd_InternTable * intern;
+	unsigned long dbUpdate;
+	int error;
+	int ret = 1;
+
+	if(mpd_getDbUpdate(connection, &dbUpdate) < 0) return -1;
+
+	if((mirror = mpd_openMirror(path))) {
+		int current = mirror->header->dbUpdate == dbUpdate;
+		mpd_closeMirror(mirror);
+		if(current) return 0;
 	}
 
-	strtype = mpdTagItemKeys[type];
+	builder.strings = g_string_new("");
+	/* offset 0 is none, so nothing else may be there */
+	g_string_append_c(builder.strings, '\0');
+	builder.offsets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	builder.dirs = g_hash_table_new(g_direct_hash, g_direct_equal);
+	builder.entities = g_array_new(FALSE, FALSE, sizeof(mpd_MirrorEntity));
+	builder.values = g_array_new(FALSE, FALSE, sizeof(mpd_MirrorValue));
+	builder.keys = g_array_new(FALSE, FALSE, sizeof(mpd_MirrorKey));
+	builder.postings = g_array_new(FALSE, FALSE, sizeof(guint32));
+	builder.trigrams = g_array_new(FALSE, FALSE, sizeof(mpd_MirrorTrigram));
+	builder.trigramKeys = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+	/* each entity is copied into the builder and freed straight away,
+	 * which an arena wouldn't do until it was reset, and interning
+	 * the whole database would only fill the caller's table */
+	arena = connection->arena;
+	intern = connection->intern;
+	connection->arena = NULL;
+	connection->intern = NULL;
+	mpd_sendListallInfoCommand(connection, "");
+	while((entity = mpd_getNextInfoEntity(connection))) {
+		mpd_mirrorAdd(&builder, entity);
+		mpd_freeInfoEntity(entity);
+	}
+	mpd_finishCommand(connection);
+	connection->arena = arena;
+	connection->intern = intern;
 
-	len = 5+strlen(strtype)+1;
-	connection->request = malloc(len);
+	if(connection->error) ret = -1;
+	else if((error = mpd_writeMirror(&builder, path, dbUpdate))) {
+		snprintf(connection->errorStr, MPD_ERRORSTR_MAX_LENGTH,
+		         "problems writing mirror \"%s\": %s", path, strerror(error));
+		connection->error = MPD_ERROR_SYSTEM;
+		ret = -1;
+	}
 
-	snprintf(connection->request, len, "list %c%s",
-	         tolower(strtype[0]), strtype+1);
+	g_string_free(builder.strings, TRUE);
+	g_hash_table_destroy(builder.offsets);
+	g_hash_table_destroy(builder.dirs);
+	g_array_free(builder.entities, TRUE);
+	g_array_free(builder.values, TRUE);
+	g_array_free(builder.keys, TRUE);
+	g_array_free(builder.postings, TRUE);
+	g_array_free(builder.trigrams, TRUE);
+	g_array_free(builder.trigramKeys, TRUE);
+	return ret;
 }
 
-void mpd_addConstraintSearch(mpd_Connection *connection, int type, const char *name)
+/* whether count items of size at offset are in the file, aligned */
+static int mpd_mirrorHas(const mpd_Mirror * mirror, guint32 offset,
+                         guint32 count, size_t size)
 {
-	char *strtype;
-	char *arg;
-	int len;
-	char *string;
-
-	if (!connection->request) {
-		strcpy(connection->errorStr, "no search in progress");
-		connection->error = 1;
-		return;
+	return offset <= mirror->size && offset%(size < 4 ? size : 4) == 0 &&
+	       (guint64)count*size <= mirror->size-offset;
+}
+
+/* whether [first, first+count) is within [0, limit) */
+static int mpd_mirrorRange(guint32 first, guint32 count, guint32 limit) {
+	return (guint64)first+count <= limit;
+}
+
+/* check every index and string offset in the arrays once, so that a
+ * damaged or hostile file can't make lookups read outside the map, and
+ * that the directories form a tree, so visiting them ends.  the
+ * builder writes each directory before what is in it, so a child
+ * always comes after its parent */
+static int mpd_checkMirror(const mpd_Mirror * mirror) {
+	const mpd_MirrorHeader * header = mirror->header;
+	guint32 entities = header->entityCount;
+	guint32 strings = header->stringsSize;
+	guint32 i;
+	int tag;
+
+	if(!mpd_mirrorRange(header->rootFirst, header->rootCount, entities))
+		return 0;
+	for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+		if(header->tagKeys[tag] > header->tagKeys[tag+1]) return 0;
 	}
-
-	if (type < 0 || type >= MPD_TAG_NUM_OF_ITEM_TYPES) {
-		strcpy(connection->errorStr, "invalid type specified");
-		connection->error = 1;
-		return;
+	for(i = 0; i < entities; i++) {
+		const mpd_MirrorEntity * e = mirror->entities+i;
+
+		if(e->type > MPD_INFO_ENTITY_TYPE_PLAYLISTFILE ||
+		   e->path >= strings ||
+		   (e->parent != MPD_MIRROR_ROOT && e->parent >= entities) ||
+		   !mpd_mirrorRange(e->first, e->count, entities) ||
+		   !mpd_mirrorRange(e->value, e->valueCount, header->valueCount))
+			return 0;
+		for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+			if(e->tags[tag] >= strings) return 0;
+		}
+		if(mirror->children[i] >= entities || mirror->byPath[i] >= entities)
+			return 0;
 	}
+	for(i = 0; i < header->rootCount; i++) {
+		guint32 child = mirror->children[header->rootFirst+i];
 
-	if (name == NULL) {
-		strcpy(connection->errorStr, "no name specified");
-		connection->error = 1;
-		return;
+		if(mirror->entities[child].parent != MPD_MIRROR_ROOT) return 0;
 	}
+	for(i = 0; i < entities; i++) {
+		const mpd_MirrorEntity * e = mirror->entities+i;
+		guint32 c;
 
-	string = strdup(connection->request);
-	strtype = mpdTagItemKeys[type];
-	arg = mpd_sanitizeArg(name);
+		if(e->type != MPD_INFO_ENTITY_TYPE_DIRECTORY) continue;
+		for(c = e->first; c < e->first+e->count; c++) {
+			guint32 child = mirror->children[c];
 
-	len = strlen(string)+1+strlen(strtype)+2+strlen(arg)+2;
-	connection->request = realloc(connection->request, len);
-	snprintf(connection->request, len, "%s %c%s \"%s\"",
-	         string, tolower(strtype[0]), strtype+1, arg);
+			if(child <= i || mirror->entities[child].parent != i)
+				return 0;
+		}
+	}
+	for(i = 0; i < header->valueCount; i++) {
+		if(mirror->values[i].tag >= MPD_TAG_ITEM_ANY ||
+		   mirror->values[i].string >= strings)
+			return 0;
+	}
+	for(i = 0; i < header->keyCount; i++) {
+		const mpd_MirrorKey * key = mirror->keys+i;
 
-	free(string);
-	free(arg);
+		if(key->tag >= MPD_TAG_ITEM_ANY || key->string >= strings ||
+		   key->fold >= strings ||
+		   !mpd_mirrorRange(key->first, key->count, header->postingCount))
+			return 0;
+	}
+	for(i = 0; i < header->postingCount; i++) {
+		if(mirror->postings[i] >= entities) return 0;
+	}
+	for(i = 0; i < header->trigramCount; i++) {
+		if(!mpd_mirrorRange(mirror->trigrams[i].first,
+		                    mirror->trigrams[i].count,
+		                    header->trigramKeyCount))
+			return 0;
+	}
+	for(i = 0; i < header->trigramKeyCount; i++) {
+		if(mirror->trigramKeys[i] >= header->keyCount) return 0;
+	}
+	return 1;
 }
 
-void mpd_commitSearch(mpd_Connection *connection)
-{
-	int len;
+mpd_Mirror * mpd_openMirror(const char * path) {
+	const mpd_MirrorHeader * header;
+	mpd_Mirror * mirror;
+	struct stat st;
+	void * map;
+	int fd;
 
-	if (!connection->request) {
-		strcpy(connection->errorStr, "no search in progress");
-		connection->error = 1;
-		return;
+	if((fd = open(path, O_RDONLY)) < 0) return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(mpd_MirrorHeader)) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return NULL;
+
+	mirror = g_slice_new(mpd_Mirror);
+	mirror->map = map;
+	mirror->size = st.st_size;
+	mirror->header = header = map;
+	if(memcmp(header->magic, mpd_mirrorMagic, sizeof(header->magic)) ||
+	   header->version != MPD_MIRROR_VERSION ||
+	   header->entitySize != sizeof(mpd_MirrorEntity) ||
+	   !mpd_mirrorHas(mirror, header->entities, header->entityCount,
+	                  sizeof(mpd_MirrorEntity)) ||
+	   !mpd_mirrorHas(mirror, header->values, header->valueCount,
+	                  sizeof(mpd_MirrorValue)) ||
+	   !mpd_mirrorHas(mirror, header->children, header->entityCount,
+	                  sizeof(guint32)) ||
+	   !mpd_mirrorHas(mirror, header->byPath, header->entityCount,
+	                  sizeof(guint32)) ||
+	   !mpd_mirrorHas(mirror, header->keys, header->keyCount,
+	                  sizeof(mpd_MirrorKey)) ||
+	   !mpd_mirrorHas(mirror, header->postings, header->postingCount,
+	                  sizeof(guint32)) ||
+	   !mpd_mirrorHas(mirror, header->trigrams, header->trigramCount,
+	                  sizeof(mpd_MirrorTrigram)) ||
+	   !mpd_mirrorHas(mirror, header->trigramKeys, header->trigramKeyCount,
+	                  sizeof(guint32)) ||
+	   header->tagKeys[MPD_TAG_ITEM_ANY] != header->keyCount ||
+	   !mpd_mirrorHas(mirror, header->strings, header->stringsSize, 1) ||
+	   header->stringsSize == 0 ||
+	   ((const char *)map)[header->strings+header->stringsSize-1] != '\0')
+	{
+		mpd_closeMirror(mirror);
+		return NULL;
 	}
 
-	len = strlen(connection->request)+2;
-	connection->request = realloc(connection->request, len);
-	connection->request[len-2] = '\n';
-	connection->request[len-1] = '\0';
-	mpd_sendInfoCommand(connection, connection->request);
+	mirror->entities = (const mpd_MirrorEntity *)((const char *)map+header->entities);
+	mirror->values = (const mpd_MirrorValue *)((const char *)map+header->values);
+	mirror->children = (const guint32 *)((const char *)map+header->children);
+	mirror->byPath = (const guint32 *)((const char *)map+header->byPath);
+	mirror->keys = (const mpd_MirrorKey *)((const char *)map+header->keys);
+	mirror->postings = (const guint32 *)((const char *)map+header->postings);
+	mirror->trigrams = (const mpd_MirrorTrigram *)((const char *)map+
+	                                               header->trigrams);
+	mirror->trigramKeys = (const guint32 *)((const char *)map+
+	                                        header->trigramKeys);
+	mirror->strings = (const char *)map+header->strings;
+	if(!mpd_checkMirror(mirror)) {
+		mpd_closeMirror(mirror);
+		return NULL;
+	}
+	return mirror;
+}
 
-	free(connection->request);
-	connection->request = NULL;
+unsigned long mpd_getMirrorDbUpdate(mpd_Mirror * mirror) {
+	return mirror->header->dbUpdate;
 }
 
-/**
- * @param connection a MpdConnection
- * @param path	the path to the playlist.
- *
- * List the content, with full metadata, of a stored playlist.
- *
- */
-void mpd_sendListPlaylistInfoCommand(mpd_Connection *connection,const char *path)
+/* the entity at path, or NULL */
+static const mpd_MirrorEntity * mpd_findMirrorEntity(const mpd_Mirror * mirror,
+                                                     const char * path)
 {
-	char *arg = mpd_sanitizeArg(path);
-	int len = strlen("listplaylistinfo")+2+strlen(arg)+3;
-	char *query = malloc(len);
-	snprintf(query, len, "listplaylistinfo \"%s\"\n", arg);
-	mpd_sendInfoCommand(connection, query);
-	free(arg);
-	free(query);
+	guint32 low = 0, high = mirror->header->entityCount;
+
+	while(low < high) {
+		guint32 middle = low+(high-low)/2;
+		const mpd_MirrorEntity * e = mirror->entities+mirror->byPath[middle];
+		int cmp = strcmp(mirror->strings+e->path, path);
+
+		if(cmp == 0) return e;
+		if(cmp < 0) low = middle+1;
+		else high = middle;
+	}
+	return NULL;
 }
 
-/**
- * @param connection a MpdConnection
- * @param path	the path to the playlist.
- *
- * List the content of a stored playlist.
- *
- */
-void mpd_sendListPlaylistCommand(mpd_Connection *connection,const char *path)
+static void mpd_mirrorView(const mpd_Mirror * mirror, const mpd_MirrorEntity * e,
+                           mpd_EntityView * view)
 {
-	char *arg = mpd_sanitizeArg(path);
-	int len = strlen("listplaylist")+2+strlen(arg)+3;
-	char *query = malloc(len);
-	snprintf(query, len, "listplaylist \"%s\"\n", arg);
-	mpd_sendInfoCommand(connection, query);
-	free(arg);
-	free(query);
+	int tag;
+
+	view->type = e->type;
+	view->path = mirror->strings+e->path;
+	for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++)
+		view->tags[tag] = e->tags[tag] ? mirror->strings+e->tags[tag] : NULL;
+	view->tags[MPD_TAG_ITEM_FILENAME] =
+		e->type == MPD_INFO_ENTITY_TYPE_SONG ? view->path : NULL;
+	view->tags[MPD_TAG_ITEM_ANY] = NULL;
+	view->time = e->time;
+	view->pos = view->id = -1;
+}
+
+/* visit count entities from children[first], returns nonzero once the
+ * visitor wants no more */
+static int mpd_visitMirrorEntities(const mpd_Mirror * mirror, guint32 first,
+                                   guint32 count, int recursive,
+                                   mpd_EntityVisitor visitor, void * userdata,
+                                   int * visited)
+{
+	mpd_EntityView view;
+	guint32 i;
+
+	for(i = first; i < first+count; i++) {
+		const mpd_MirrorEntity * e = mirror->entities+mirror->children[i];
+
+		mpd_mirrorView(mirror, e, &view);
+		(*visited)++;
+		if(visitor(&view, userdata)) return 1;
+		if(recursive && e->type == MPD_INFO_ENTITY_TYPE_DIRECTORY &&
+		   mpd_visitMirrorEntities(mirror, e->first, e->count, recursive,
+		                           visitor, userdata, visited))
+		{
+			return 1;
+		}
+	}
+	return 0;
 }
 
-void mpd_sendPlaylistClearCommand(mpd_Connection *connection,const char *path)
+int mpd_visitMirror(mpd_Mirror * mirror, const char * dir, int recursive,
+                    mpd_EntityVisitor visitor, void * userdata)
 {
-	char *sPath = mpd_sanitizeArg(path);
-	int len = strlen("playlistclear")+2+strlen(sPath)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistclear \"%s\"\n", sPath);
-	mpd_executeCommand(connection, string);
-	free(sPath);
-	free(string);
+	guint32 first = mirror->header->rootFirst;
+	guint32 count = mirror->header->rootCount;
+	int visited = 0;
+
+	if(dir && *dir && strcmp(dir, "/") != 0) {
+		const mpd_MirrorEntity * e = mpd_findMirrorEntity(mirror, dir);
+
+		if(!e || e->type != MPD_INFO_ENTITY_TYPE_DIRECTORY) return -1;
+		first = e->first;
+		count = e->count;
+	}
+
+	mpd_visitMirrorEntities(mirror, first, count, recursive, visitor,
+	                        userdata, &visited);
+	return visited;
 }
 
-void mpd_sendPlaylistAddCommand(mpd_Connection *connection,
-                                const char *playlist,const char *path)
+/* build the song e is like mpd_packSong does */
+static mpd_Song * mpd_mirrorSong(const mpd_Mirror * mirror,
+                                 const mpd_MirrorEntity * e,
+                                 mpd_Arena * arena, mpd_InternTable * intern)
 {
-	char *sPlaylist = mpd_sanitizeArg(playlist);
-	char *sPath = mpd_sanitizeArg(path);
-	int len = strlen("playlistadd")+2+strlen(sPlaylist)+3+strlen(sPath)+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistadd \"%s\" \"%s\"\n", sPlaylist, sPath);
-	mpd_executeCommand(connection, string);
-	free(sPlaylist);
-	free(sPath);
-	free(string);
+	mpd_SongValue values[MPD_TAG_ITEM_ANY];
+	mpd_SongValue * all = values;
+	mpd_Song head;
+	mpd_Song * song;
+	guint32 i;
+	int n = 0;
+	int tag;
+
+	head.time = e->time;
+	head.pos = MPD_SONG_NO_NUM;
+	head.id = MPD_SONG_NO_ID;
+	if(e->valueCount) all = g_new(mpd_SongValue, MPD_TAG_ITEM_ANY+e->valueCount);
+
+	for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+		guint32 string = tag == MPD_TAG_ITEM_FILENAME ? e->path : e->tags[tag];
+
+		/* those with a list come from the values */
+		if(!string || mpd_songList(mpd_tagFields[tag]) >= 0) continue;
+		all[n].field = mpd_tagFields[tag];
+		all[n].value = mirror->strings+string;
+		all[n].length = strlen(all[n].value);
+		n++;
+	}
+	for(i = e->value; i < e->value+e->valueCount; i++) {
+		all[n].field = mpd_tagFields[mirror->values[i].tag];
+		all[n].value = mirror->strings+mirror->values[i].string;
+		all[n].length = strlen(all[n].value);
+		n++;
+	}
+
+	song = mpd_packSong(arena, intern, &head, all, n);
+	if(all != values) g_free(all);
+	return song;
 }
 
-void mpd_sendPlaylistMoveCommand(mpd_Connection *connection,
-                                 const char *playlist, int from, int to)
-{
-	char *sPlaylist = mpd_sanitizeArg(playlist);
-	int len = strlen("playlistmove")+
-	          2+strlen(sPlaylist)+3+INTLEN+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistmove \"%s\" \"%i\" \"%i\"\n",
-	         sPlaylist, from, to);
-	mpd_executeCommand(connection, string);
-	free(sPlaylist);
-	free(string);
+mpd_Song * mpd_getMirrorSong(mpd_Mirror * mirror, const char * file) {
+	const mpd_MirrorEntity * e = mpd_findMirrorEntity(mirror, file);
+
+	if(!e || e->type != MPD_INFO_ENTITY_TYPE_SONG) return NULL;
+	return mpd_mirrorSong(mirror, e, NULL, NULL);
 }
 
-void mpd_sendPlaylistDeleteCommand(mpd_Connection *connection,
-                                   const char *playlist, int pos)
+/* the key of value for tag, or NULL */
+static const mpd_MirrorKey * mpd_findMirrorKey(const mpd_Mirror * mirror,
+                                               int tag, const char * value)
 {
-	char *sPlaylist = mpd_sanitizeArg(playlist);
-	int len = strlen("playlistdelete")+2+strlen(sPlaylist)+3+INTLEN+3;
-	char *string = malloc(len);
-	snprintf(string, len, "playlistdelete \"%s\" \"%i\"\n", sPlaylist, pos);
-	mpd_executeCommand(connection, string);
-	free(sPlaylist);
-	free(string);
-}
-void mpd_sendClearErrorCommand(mpd_Connection * connection) {
-	mpd_executeCommand(connection,"clearerror\n");
-}
+	guint32 low = mirror->header->tagKeys[tag];
+	guint32 high = mirror->header->tagKeys[tag+1];
 
+	while(low < high) {
+		guint32 middle = low+(high-low)/2;
+		int cmp = strcmp(mirror->strings+mirror->keys[middle].string, value);
 
-void mpd_sendGetEventsCommand(mpd_Connection *connection) {
-    mpd_executeCommand(connection, "idle\nnoidle\n");
-//    mpd_executeCommand(connection, "noidle\n");
+		if(cmp == 0) return mirror->keys+middle;
+		if(cmp < 0) low = middle+1;
+		else high = middle;
+	}
+	return NULL;
 }
 
-char * mpd_getNextEvent(mpd_Connection *connection)
+static const mpd_MirrorTrigram * mpd_findMirrorTrigram(const mpd_Mirror * mirror,
+                                                       guint32 trigram)
 {
-    return mpd_getNextReturnElementNamed(connection, "changed");
-}
+	guint32 low = 0, high = mirror->header->trigramCount;
 
-void mpd_sendListPlaylistsCommand(mpd_Connection * connection) {
-    mpd_sendInfoCommand(connection, "listplaylists\n");
+	while(low < high) {
+		guint32 middle = low+(high-low)/2;
+
+		if(mirror->trigrams[middle].trigram == trigram)
+			return mirror->trigrams+middle;
+		if(mirror->trigrams[middle].trigram < trigram) low = middle+1;
+		else high = middle;
+	}
+	return NULL;
 }
 
-char * mpd_getNextSticker (mpd_Connection * connection)
+/* marks holds how many constraints each entity has met so far; those
+ * that met the ones before c and have key meet c too */
+static void mpd_markMirrorKey(const mpd_Mirror * mirror,
+                              const mpd_MirrorKey * key, guint8 * marks,
+                              guint8 c)
 {
-	return mpd_getNextReturnElementNamed(connection, "sticker");
+	const guint32 * p = mirror->postings+key->first;
+	const guint32 * end = p+key->count;
+
+	for(; p < end; p++) {
+		if(marks[*p] == c) marks[*p] = c+1;
+	}
 }
-void  mpd_sendGetSongSticker(mpd_Connection *connection, const char *song_path, const char *sticker)
+
+/* whether key has songs left to mark, which is cheaper to find out
+ * than whether its value matches */
+static int mpd_mirrorKeyWanted(const mpd_Mirror * mirror,
+                               const mpd_MirrorKey * key,
+                               const guint8 * marks, guint8 c)
 {
-    char *sSong = mpd_sanitizeArg(song_path); 
-    char *sSticker = mpd_sanitizeArg(sticker); 
-    int len = strlen("sticker get song ")+strlen(sSong)+3+strlen(sSticker)+4;
-    char *string = malloc(len);
-    snprintf(string, len, "sticker get song \"%s\" \"%s\"\n", sSong, sSticker);
-    mpd_executeCommand(connection, string);
-    free(string);
-    free(sSong);
-    free(sSticker);
+	const guint32 * p = mirror->postings+key->first;
+	const guint32 * end = p+key->count;
+
+	for(; p < end; p++) {
+		if(marks[*p] == c) return 1;
+	}
+	return 0;
 }
 
-void mpd_sendSetSongSticker(mpd_Connection *connection, const char *song_path, const char *sticker, const char *value)
+static void mpd_matchMirror(const mpd_Mirror * mirror,
+                            const mpd_MirrorConstraint * constraint,
+                            int exact, guint8 * marks, guint8 c)
 {
+	int any = constraint->type == MPD_TAG_ITEM_ANY;
+	const mpd_MirrorKey * key;
+	const mpd_MirrorTrigram * rarest = NULL;
+	guint32 i, first, last, length;
+	char * fold;
+	int tag;
+
+	if(exact) {
+		for(tag = any ? 0 : constraint->type;
+		    tag <= (any ? MPD_TAG_ITEM_ANY-1 : constraint->type); tag++)
+		{
+			key = mpd_findMirrorKey(mirror, tag, constraint->value);
+			if(key) mpd_markMirrorKey(mirror, key, marks, c);
+		}
+		return;
+	}
+
+	fold = mpd_fold(constraint->value);
+	length = strlen(fold);
+	if(length < 3) {
+		/* too short for a trigram, try every value of the tag */
+		first = any ? 0 : mirror->header->tagKeys[constraint->type];
+		last = any ? mirror->header->keyCount :
+		       mirror->header->tagKeys[constraint->type+1];
+		for(i = first; i < last; i++) {
+			key = mirror->keys+i;
+			if(mpd_mirrorKeyWanted(mirror, key, marks, c) &&
+			   strstr(mirror->strings+key->fold, fold))
+			{
+				mpd_markMirrorKey(mirror, key, marks, c);
+			}
+		}
+		g_free(fold);
+		return;
+	}
+
+	for(i = 0; i+3 <= length; i++) {
+		const mpd_MirrorTrigram * trigram =
+			mpd_findMirrorTrigram(mirror, mpd_trigram(fold+i));
+
+		/* no value has all of them */
+		if(!trigram) {
+			g_free(fold);
+			return;
+		}
+		if(!rarest || trigram->count < rarest->count) rarest = trigram;
+	}
+	for(i = rarest->first; i < rarest->first+rarest->count; i++) {
+		key = mirror->keys+mirror->trigramKeys[i];
+		if((any || (int)key->tag == constraint->type) &&
+		   mpd_mirrorKeyWanted(mirror, key, marks, c) &&
+		   strstr(mirror->strings+key->fold, fold))
+		{
+			mpd_markMirrorKey(mirror, key, marks, c);
+		}
+	}
+	g_free(fold);
+}
 
-    char *sSong = mpd_sanitizeArg(song_path); 
-    char *sSticker = mpd_sanitizeArg(sticker); 
-    char *sValue = mpd_sanitizeArg(value);
-    int len = strlen("sticker set song ")+strlen(sSong)+3+strlen(sSticker)+3+strlen(sValue)+4;
-    char *string = malloc(len);
-    snprintf(string, len, "sticker set song \"%s\" \"%s\" \"%s\"\n", sSong, sSticker,sValue);
-    mpd_sendInfoCommand(connection, string);
-    free(string);
-    free(sSong);
-    free(sSticker);
-    free(sValue);
+static void mpd_startMirrorSearch(mpd_Connection * connection) {
+	connection->mirrorSearch = g_array_new(FALSE, FALSE,
+	                                       sizeof(mpd_MirrorConstraint));
 }
 
-void mpd_sendSetReplayGainMode(mpd_Connection *connection, const char *mode)
+static void mpd_addMirrorConstraint(mpd_Connection * connection, int type,
+                                    const char * value)
 {
-    char *smode= mpd_sanitizeArg(mode); 
-    int len = strlen("replay_gain_mode ")+strlen(smode)+4;
-    char *string = malloc(len);
-    snprintf(string, len, "replay_gain_mode \"%s\"\n", smode);
-    mpd_sendInfoCommand(connection, string);
-    free(smode);
-    free(string);
+	mpd_MirrorConstraint constraint;
+
+	constraint.type = type;
+	constraint.value = strdup(value);
+	g_array_append_val(connection->mirrorSearch, constraint);
+}
+
+static void mpd_dropMirrorSearch(mpd_Connection * connection) {
+	guint i;
+
+	if(!connection->mirrorSearch) return;
+	for(i = 0; i < connection->mirrorSearch->len; i++)
+		free(g_array_index(connection->mirrorSearch,
+		                   mpd_MirrorConstraint, i).value);
+	g_array_free(connection->mirrorSearch, TRUE);
+	connection->mirrorSearch = NULL;
+}
+
+static void mpd_dropMirrorResults(mpd_Connection * connection) {
+	if(!connection->mirrorResults) return;
+	g_array_free(connection->mirrorResults, TRUE);
+	connection->mirrorResults = NULL;
+	connection->mirrorNext = 0;
+}
+
+/* answer the search being committed from the mirror if nothing else
+ * is to be read first; returns whether it was */
+static int mpd_searchMirror(mpd_Connection * connection) {
+	const mpd_Mirror * mirror = connection->mirror;
+	const mpd_MirrorConstraint * constraints =
+		(mpd_MirrorConstraint *)connection->mirrorSearch->data;
+	int n = connection->mirrorSearch->len;
+	int exact = strncmp(connection->request, "find ", 5) == 0;
+	guint32 count = mirror->header->entityCount;
+	GArray * results;
+	guint8 * marks;
+	guint32 i;
+	int c;
+
+	/* mpd has the error for a search without constraints */
+	if(!connection->doneProcessing || connection->pipelined ||
+	   connection->commandList || connection->async || n == 0 || n > 255)
+	{
+		return 0;
+	}
+
+	mpd_clearError(connection);
+	mpd_dropMirrorResults(connection);
+	marks = g_new0(guint8, count ? count : 1);
+	for(c = 0; c < n; c++)
+		mpd_matchMirror(mirror, constraints+c, exact, marks, c);
+
+	results = g_array_new(FALSE, FALSE, sizeof(guint32));
+	for(i = 0; i < count; i++) {
+		if(marks[i] == n) g_array_append_val(results, i);
+	}
+	g_free(marks);
+
+	connection->mirrorResults = results;
+	connection->mirrorNext = 0;
+	return 1;
 }
-void mpd_sendReplayGainModeCommand(mpd_Connection *connection)
-{
-	mpd_executeCommand(connection, "replay_gain_status\n");
+
+static mpd_InfoEntity * mpd_getNextMirrorEntity(mpd_Connection * connection) {
+	const mpd_Mirror * mirror = connection->mirror;
+	const mpd_MirrorEntity * e;
+	mpd_InfoEntity * entity;
+
+	if(connection->mirrorNext >= (int)connection->mirrorResults->len) {
+		mpd_dropMirrorResults(connection);
+		return NULL;
+	}
+
+	e = mirror->entities+g_array_index(connection->mirrorResults, guint32,
+	                                   connection->mirrorNext++);
+	entity = mpd_allocInfoEntity(connection, MPD_INFO_ENTITY_TYPE_SONG);
+	entity->info.song = mpd_mirrorSong(mirror, e, connection->arena,
+	                                   connection->intern);
+	return entity;
 }
-char *mpd_getReplayGainMode(mpd_Connection *connection)
+
+static int mpd_visitMirrorResults(mpd_Connection * connection,
+                                  unsigned int tags,
+                                  mpd_EntityVisitor visitor, void * userdata)
 {
-    return mpd_getNextReturnElementNamed(connection, "replay_gain_mode");
+	const mpd_Mirror * mirror = connection->mirror;
+	GArray * results = connection->mirrorResults;
+	mpd_EntityView view;
+	int visited = 0;
+	int tag;
+
+	while(connection->mirrorNext < (int)results->len) {
+		guint32 i = g_array_index(results, guint32, connection->mirrorNext++);
+
+		mpd_mirrorView(mirror, mirror->entities+i, &view);
+		for(tag = 0; tag < MPD_TAG_NUM_OF_ITEM_TYPES; tag++) {
+			if(!(tags & MPD_TAG_MASK(tag))) view.tags[tag] = NULL;
+		}
+		visited++;
+		if(visitor(&view, userdata)) break;
+	}
+
+	mpd_dropMirrorResults(connection);
+	return visited;
+}
+
+void mpd_setMirror(mpd_Connection * connection, mpd_Mirror * mirror) {
+	mpd_dropMirrorSearch(connection);
+	mpd_dropMirrorResults(connection);
+	connection->mirror = mirror;
+}
+
+void mpd_closeMirror(mpd_Mirror * mirror) {
+	munmap(mirror->map, mirror->size);
+	g_slice_free(mpd_Mirror, mirror);
 }
+#endif /* !WIN32 */
@@ -39,7 +39,14 @@
 
 #include <sys/time.h>
 #include <stdarg.h>
-#define MPD_BUFFER_MAX_LENGTH	50000
+#include <glib.h>
+/* the input buffer starts at MPD_BUFFER_INITIAL_LENGTH and grows to fit
+ * the longest line, up to MPD_BUFFER_MAX_LENGTH unless changed with
+ * mpd_setMaxBufferLength */
+#define MPD_BUFFER_INITIAL_LENGTH	4096
+#define MPD_BUFFER_MAX_LENGTH	1048576
+/* how many lines of input are split out at once */
+#define MPD_LINE_INDEX_LENGTH	64
 #define MPD_ERRORSTR_MAX_LENGTH	1000
 #define MPD_WELCOME_MESSAGE	"OK MPD "
 
@@ -52,7 +59,7 @@
 #define MPD_ERROR_SENDING	16 /* error sending command */
 #define MPD_ERROR_CONNCLOSED	17 /* connection closed by mpd */
 #define MPD_ERROR_ACK		18 /* ACK returned! */
-#define MPD_ERROR_BUFFEROVERRUN	19 /* Buffer was overrun! */
+#define MPD_ERROR_BUFFEROVERRUN	19 /* Line longer than the buffer may grow */
 
 #define MPD_ACK_ERROR_UNK	-1
 #define MPD_ERROR_AT_UNK	-1
@@ -96,12 +103,32 @@ typedef enum mpd_TagItems
 
 extern char * mpdTagItemKeys[MPD_TAG_NUM_OF_ITEM_TYPES];
 
-/* internal stuff don't touch this struct */
+typedef struct _mpd_Arena mpd_Arena;
+typedef struct _mpd_InternTable mpd_InternTable;
+typedef struct _mpd_AsyncSource mpd_AsyncSource;
+typedef struct _mpd_Mirror mpd_Mirror;
+
+/* internal stuff don't touch this struct
+ * name and value point into the connection's buffer and are valid
+ * until the next line is read, key identifies name if it is one the
+ * decoders know */
 typedef struct _mpd_ReturnElement {
 	char * name;
 	char * value;
+	int nameLen;
+	int valueLen;
+	int key;
 } mpd_ReturnElement;
 
+/* internal stuff don't touch this struct either
+ * a complete line in the connection's buffer, as offsets: the first
+ * ':' is at colon, or colon is -1 if there is none */
+typedef struct _mpd_LineSpan {
+	int start;
+	int colon;
+	int end;
+} mpd_LineSpan;
+
 /* mpd_Connection
  * holds info about connection to mpd
  * use error, and errorStr to detect errors
@@ -117,16 +144,60 @@ typedef struct _mpd_Connection {
 	int error;
 	/* DON'T TOUCH any of the rest of this stuff */
 	int sock;
-	char buffer[MPD_BUFFER_MAX_LENGTH+1];
+	/* allocated on the first read; unread input is bufstart..buflen */
+	char *buffer;
+	int bufsize;
 	int buflen;
 	int bufstart;
+	int maxBuffer;
+	/* lines found in the buffer by one scan, returned lineNext to
+	 * lineCount; the line after them has been scanned for lineScanned
+	 * bytes, with its ':' at lineColon or lineColon -1 */
+	mpd_LineSpan lines[MPD_LINE_INDEX_LENGTH];
+	int lineNext;
+	int lineCount;
+	int lineScanned;
+	int lineColon;
 	int doneProcessing;
 	int listOks;
 	int doneListOk;
 	int commandList;
+	int idle;
+	/* set by mpd_setPipelining; pipelined counts the responses still
+	 * to come after the one being read */
+	int pipelining;
+	int pipelined;
+	/* commands encoded but not yet sent: a command list being built,
+	 * or pipelined commands waiting for the next read */
+	char *pending;
+	int pendingLen;
+	int pendingSize;
+	/* start of the command being encoded */
+	int commandStart;
+	/* length of the complete commands at the front of pending */
+	int pendingReady;
+	/* entities are decoded into this if not NULL */
+	mpd_Arena * arena;
+	/* tag values of decoded songs are shared through this if not NULL */
+	mpd_InternTable * intern;
+	/* values of the song being decoded, until it is packed */
+	GString * songText;
+	GArray * songValues;
+	/* points at element when there is a current line, else NULL */
 	mpd_ReturnElement * returnElement;
+	mpd_ReturnElement element;
 	struct timeval timeout;
 	char *request;
+	/* set while the connection is driven by mpd_newAsyncSource */
+	mpd_AsyncSource * async;
+	/* searches are answered from this if not NULL */
+	mpd_Mirror * mirror;
+	/* the constraints of the search being built, while it may still
+	 * be answered from mirror */
+	GArray * mirrorSearch;
+	/* the songs such a search found, returned from mirrorNext on */
+	GArray * mirrorResults;
+	int mirrorNext;
 } mpd_Connection;
 
 /* mpd_newConnection
@@ -139,6 +210,12 @@ mpd_Connection * mpd_newConnection(const char * host, int port, float timeout);
 
 void mpd_setConnectionTimeout(mpd_Connection * connection, float timeout);
 
+/* mpd_setMaxBufferLength
+ * sets how far the input buffer may grow; a response line longer than
+ * this fails with MPD_ERROR_BUFFEROVERRUN
+ */
+void mpd_setMaxBufferLength(mpd_Connection * connection, int length);
+
 /* mpd_closeConnection
  * use this to close a connection and free'ing subsequent memory
  */
@@ -149,6 +226,75 @@ void mpd_closeConnection(mpd_Connection * connection);
  */
 void mpd_clearError(mpd_Connection * connection);
 
+#ifndef WIN32
+/* REACTOR STUFF */
+
+/* mpd_Reactor
+ * lets one thread wait on many connections; it uses epoll where the
+ * system has it and poll otherwise, so there is no FD_SETSIZE limit
+ */
+typedef struct _mpd_Reactor mpd_Reactor;
+
+/* called by mpd_reactorWait when _connection_ has a response waiting,
+ * which is then read with the usual mpd_get* functions
+ */
+typedef void (*mpd_ReactorCallback)(mpd_Connection * connection,
+                                    void * userdata);
+
+mpd_Reactor * mpd_newReactor(void);
+
+/* mpd_reactorAdd
+ * watches _connection_ until it is removed again, which has to happen
+ * before it is closed.  returns 0, or -1 if it can't be watched
+ */
+int mpd_reactorAdd(mpd_Reactor * reactor, mpd_Connection * connection,
+                   mpd_ReactorCallback callback, void * userdata);
+
+/* mpd_reactorRemove
+ * may be called from a callback, for any connection
+ */
+void mpd_reactorRemove(mpd_Reactor * reactor, mpd_Connection * connection);
+
+/* mpd_reactorWait
+ * waits up to _timeout_ milliseconds, or for ever if it is -1, and calls
+ * back every connection with a response waiting.  returns how many were
+ * called back, or -1 on error
+ */
+int mpd_reactorWait(mpd_Reactor * reactor, int timeout);
+
+void mpd_freeReactor(mpd_Reactor * reactor);
+
+/* ASYNC STUFF */
+
+/* mpd_newAsyncSource
+ * puts _connection_ in asynchronous mode and returns the GSource that
+ * drives it; attach it to the GMainContext the callbacks should run in.
+ * from then on the mpd_send* functions only queue their command and
+ * return; the commands are written straight away and their responses
+ * handed back in order, except that nothing is sent behind an idle
+ * until it has been answered.  returns NULL if the connection is busy
+ * or already asynchronous
+ */
+GSource * mpd_newAsyncSource(mpd_Connection * connection);
+
+/* called from the main loop once the whole response to a command has
+ * arrived; read it with the usual mpd_get* functions, which won't block,
+ * and look at connection->error for an ACK or a lost connection.
+ * anything left unread is thrown away afterwards
+ */
+typedef void (*mpd_AsyncCallback)(mpd_Connection * connection,
+                                  void * userdata);
+
+/* mpd_asyncRequest
+ * sets the callback for the next command sent, eg
+ *	mpd_asyncRequest(connection, statusDone, ui);
+ *	mpd_sendStatusCommand(connection);
+ * the response to a command sent without one is thrown away
+ */
+void mpd_asyncRequest(mpd_Connection * connection,
+                      mpd_AsyncCallback callback, void * userdata);
+#endif
+
 /* STATUS STUFF */
 
 /* use these with status.state to determine what state the player is in */
@@ -302,6 +448,17 @@ typedef struct _mpd_Song {
 	int pos;
 	/* song id for a song in the playlist */
 	int id;
+	/* every value of the tags that can have several, NULL terminated;
+	 * artist, composer and performer hold them joined with ", " and
+	 * genre the first.  NULL if there is no tag, and for a song from
+	 * mpd_newSong */
+	char ** artists;
+	char ** genres;
+	char ** composers;
+	char ** performers;
+	/* for a decoded or duplicated song, the size of the one allocation
+	 * holding it and its strings, else 0 */
+	int packed;
 } mpd_Song;
 
 /* mpd_newSong
@@ -317,11 +474,15 @@ mpd_Song * mpd_newSong(void);
 /* mpd_freeSong
  * use to free memory allocated by mpd_newSong
  * also it will free memory pointed to by file, artist, etc, so be careful
+ * songs from mpd_getNextInfoEntity and mpd_songDup are packed into a
+ * single allocation with their strings, which must not be freed or
+ * replaced on their own
  */
 void mpd_freeSong(mpd_Song * song);
 
 /* mpd_songDup
- * works like strDup, but for a mpd_Song
+ * works like strDup, but for a mpd_Song; the copy is packed, so
+ * copying a packed song is a single memcpy
  */
 mpd_Song * mpd_songDup(const mpd_Song * song);
 
@@ -401,17 +562,106 @@ typedef struct mpd_InfoEntity {
 		mpd_Song * song;
 		mpd_PlaylistFile * playlistFile;
 	} info;
+	/* the arena the entity was decoded into, or NULL */
+	mpd_Arena * arena;
 } mpd_InfoEntity;
 
 mpd_InfoEntity * mpd_newInfoEntity(void);
 
+/* does nothing for an entity in an arena */
 void mpd_freeInfoEntity(mpd_InfoEntity * entity);
 
+/* ARENAS */
+
+/* mpd_newArena
+ * an arena holds decoded entities (and their songs, strings, etc) so
+ * that they are all freed at once.  attach it with mpd_setArena; a big
+ * listallinfo then takes a few large allocations instead of one per
+ * tag.  entities from an arena must not be freed (mpd_freeInfoEntity
+ * ignores them) or their parts modified; copy what you want to keep
+ * with mpd_songDup etc
+ */
+mpd_Arena * mpd_newArena(void);
+
+/* mpd_setArena
+ * decode entities into _arena_ from now on, or into separately
+ * allocated memory if it is NULL
+ */
+void mpd_setArena(mpd_Connection * connection, mpd_Arena * arena);
+
+/* mpd_resetArena
+ * frees everything in the arena, keeping some memory for reuse
+ */
+void mpd_resetArena(mpd_Arena * arena);
+
+void mpd_freeArena(mpd_Arena * arena);
+
+/* INTERNING */
+
+/* mpd_newInternTable
+ * an intern table keeps a single copy of each tag value; songs decoded
+ * while it is attached with mpd_setInternTable share their artist,
+ * album, genre, date etc strings through it instead of each having its
+ * own, and equal values can be compared by pointer.  the connections
+ * of one thread may share a table.  the strings belong to the table and
+ * go when it is freed, also from songs copied with mpd_songDup
+ */
+mpd_InternTable * mpd_newInternTable(void);
+
+/* mpd_setInternTable
+ * share tag values through _table_ from now on, or not if it is NULL
+ */
+void mpd_setInternTable(mpd_Connection * connection, mpd_InternTable * table);
+
+/* mpd_intern
+ * returns the table's copy of _string_, adding one if there is none
+ */
+const char * mpd_intern(mpd_InternTable * table, const char * string);
+
+void mpd_freeInternTable(mpd_InternTable * table);
+
 /* INFO COMMANDS AND STUFF */
 
 /* use this function to loop over after calling Info/Listall functions */
 mpd_InfoEntity * mpd_getNextInfoEntity(mpd_Connection * connection);
 
+/* VISITOR STUFF */
+
+/* mpd_EntityView
+ * an entity as it is read, for mpd_visitInfoEntities.  the strings are
+ * borrowed and only valid during the callback; copy what you want to
+ * keep.  path is the song's file or the directory or playlist path
+ * (NULL for a plchangesposid entry), tags is indexed by MPD_TAG_ITEM_*
+ * and holds NULL for tags not asked for or not there
+ */
+typedef struct _mpd_EntityView {
+	/* MPD_INFO_ENTITY_TYPE_* */
+	int type;
+	const char * path;
+	const char * tags[MPD_TAG_NUM_OF_ITEM_TYPES];
+	/* -1 if not there */
+	int time;
+	int pos;
+	int id;
+} mpd_EntityView;
+
+/* return nonzero to skip the rest of the response */
+typedef int (*mpd_EntityVisitor)(const mpd_EntityView * view, void * userdata);
+
+#define MPD_TAG_MASK(tag)	(1u << (tag))
+
+/* mpd_visitInfoEntities
+ * reads the response to an Info/Listall/search command, calling
+ * _visitor_ with each entity in it instead of building mpd_InfoEntity
+ * structs.  only the tags in the _tags_ mask are kept, eg
+ * MPD_TAG_MASK(MPD_TAG_ITEM_ARTIST)|MPD_TAG_MASK(MPD_TAG_ITEM_TITLE),
+ * and memory use is bounded by the input buffer and the largest
+ * entity however long the response is.  returns how many entities were
+ * visited
+ */
+int mpd_visitInfoEntities(mpd_Connection * connection, unsigned int tags,
+                          mpd_EntityVisitor visitor, void * userdata);
+
 /* fetches the currently seeletect song (the song referenced by status->song
  * and status->songid*/
 void mpd_sendCurrentSongCommand(mpd_Connection * connection);
@@ -465,6 +715,10 @@ char * mpd_getNextAlbum(mpd_Connection * connection);
 
 char * mpd_getNextTag(mpd_Connection *connection, int type);
 
+/* like mpd_getNextTag, but returns the copy in the connection's intern
+ * table, which must not be freed; NULL if no table is attached */
+const char * mpd_getNextInternedTag(mpd_Connection *connection, int type);
+
 /* list artist or albums by artist, arg1 should be set to the artist if
  * listing albums by a artist, otherwise NULL for listing all artists or albums
  */
@@ -481,6 +735,9 @@ void mpd_sendDeleteCommand(mpd_Connection * connection, int songNum);
 
 void mpd_sendDeleteIdCommand(mpd_Connection * connection, int songNum);
 
+/* deletes the songs from position _start_ up to but not including _end_ */
+void mpd_sendDeleteRangeCommand(mpd_Connection * connection, int start, int end);
+
 void mpd_sendSaveCommand(mpd_Connection * connection, const char * name);
 
 void mpd_sendLoadCommand(mpd_Connection * connection, const char * name);
@@ -545,7 +802,9 @@ void mpd_sendPasswordCommand(mpd_Connection * connection, const char * pass);
  */
 void mpd_finishCommand(mpd_Connection * connection);
 
-/* command list stuff, use this to do things like add files very quickly */
+/* command list stuff, use this to do things like add files very quickly
+ * the commands of a list are buffered and go to mpd in a single write
+ * when mpd_sendCommandListEnd is called */
 void mpd_sendCommandListBegin(mpd_Connection * connection);
 
 void mpd_sendCommandListOkBegin(mpd_Connection * connection);
@@ -554,9 +813,35 @@ void mpd_sendCommandListEnd(mpd_Connection * connection);
 
 /* advance to the next listOk
  * returns 0 if advanced to the next list_OK,
- * returns -1 if it advanced to an OK or ACK */
+ * returns -1 if it advanced to an OK or ACK
+ * mpd stops at the first command that fails; errorAt is then the
+ * index of that command in the list */
 int mpd_nextListOkCommand(mpd_Connection * connection);
 
+/* mpd_setPipelining
+ * with pipelining on, commands may be sent before the responses to
+ * earlier ones have been read, so that several queries take a single
+ * round trip, eg
+ *	mpd_sendStatusCommand(connection);
+ *	mpd_sendCurrentSongCommand(connection);
+ *	status = mpd_getStatus(connection);
+ *	mpd_nextResponse(connection);
+ *	entity = mpd_getNextInfoEntity(connection);
+ * responses are read in the order the commands were sent.  commands
+ * sent behind one still being answered are held back and written
+ * together when the next response is read.  an idle can only be
+ * followed by noidle, and command_list_ok can't be pipelined
+ */
+void mpd_setPipelining(mpd_Connection * connection, int pipelining);
+
+/* mpd_nextResponse
+ * finishes the response being read and moves on to the next pipelined
+ * one.  an ACK only fails the response it ends, so connection->error is
+ * cleared for the next one.  returns 0 if advanced, -1 if there is none
+ * or the connection failed
+ */
+int mpd_nextResponse(mpd_Connection * connection);
+
 typedef struct _mpd_OutputEntity {
 	int id;
 	char * name;
@@ -683,6 +968,22 @@ void mpd_sendPlaylistDeleteCommand(mpd_Connection *connection,
 
 void mpd_sendClearErrorCommand(mpd_Connection * connection);
 
+/* mpd_sendIdleCommand
+ * waits for a change in one of _subsystems_ (space separated, eg
+ * "database update"), or in anything if it is NULL.  fetch the names of
+ * the changed subsystems with mpd_getNextEvent, which blocks until mpd
+ * answers: set the connection timeout to as long as you are prepared to
+ * wait, or end the wait early with mpd_sendNoIdleCommand
+ */
+void mpd_sendIdleCommand(mpd_Connection *connection, const char *subsystems);
+
+/* mpd_sendNoIdleCommand
+ * cancels an idle; the idle's reply (possibly with no events) is still
+ * read with mpd_getNextEvent
+ */
+void mpd_sendNoIdleCommand(mpd_Connection *connection);
+
+/* same as mpd_sendIdleCommand(connection, NULL) */
 void mpd_sendGetEventsCommand(mpd_Connection *connection);
 char * mpd_getNextEvent(mpd_Connection *connection);
 void mpd_sendListPlaylistsCommand(mpd_Connection * connection);
@@ -696,6 +997,93 @@ void mpd_sendSetReplayGainMode(mpd_Connection *connection, const char *mode);
 
 void mpd_sendReplayGainModeCommand(mpd_Connection *connection);
 char *mpd_getReplayGainMode(mpd_Connection *connection);
+
+/* mpd_sendMountCommand
+ * attaches the storage at _uri_ (eg "nfs://host/export" or
+ * "file:///media/sda1") to the database as directory _path_.  needs
+ * mpd >= 0.19 with the simple database plugin and a cache_directory;
+ * mpd loads the storage's cached database or starts an update of it
+ */
+void mpd_sendMountCommand(mpd_Connection *connection, const char *path,
+                          const char *uri);
+
+/* mpd_sendUnmountCommand
+ * detaches the storage mounted at _path_
+ */
+void mpd_sendUnmountCommand(mpd_Connection *connection, const char *path);
+
+#ifndef WIN32
+/* MIRROR STUFF */
+
+/* mpd_Mirror
+ * a copy of the whole database kept in a file, which is mapped into
+ * memory as it is; browsing, looking up and searching songs in it
+ * needs no parsing and doesn't talk to mpd.  the file has indexes of
+ * the tag values and of the three character runs in them, so a search
+ * only looks at the values that can match
+ */
+
+/* mpd_updateMirror
+ * compares the database update time from stats with the one of the
+ * mirror at _path_ and, if it differs or there is no mirror yet,
+ * writes a new one from listallinfo.  the connection must have no
+ * command outstanding and not be asynchronous.  returns 1 if the file
+ * was written, after which it should be opened again, 0 if it was up
+ * to date and -1 on error
+ */
+int mpd_updateMirror(mpd_Connection * connection, const char * path);
+
+/* mpd_openMirror
+ * maps the mirror at _path_, returns NULL if there is none or it was
+ * written by another version
+ */
+mpd_Mirror * mpd_openMirror(const char * path);
+
+/* the db_update time from stats of the database it is a copy of */
+unsigned long mpd_getMirrorDbUpdate(mpd_Mirror * mirror);
+
+/* mpd_isMirrorCurrent
+ * asks mpd for stats and compares its db_update with the mirror's,
+ * which costs one round trip and no listallinfo.  returns 1 if the
+ * mirror is a copy of the database mpd has now, 0 if mpd's database
+ * has been updated since and -1 on error
+ */
+int mpd_isMirrorCurrent(mpd_Connection * connection, mpd_Mirror * mirror);
+
+/* mpd_visitMirror
+ * calls _visitor_ with each entity in directory _dir_ ("" for the
+ * top), like lsinfo, or with everything under it if _recursive_, like
+ * listallinfo.  the strings point into the mirror and are valid until
+ * it is closed; pos and id are always -1.  returns how many entities
+ * were visited, or -1 if there is no such directory
+ */
+int mpd_visitMirror(mpd_Mirror * mirror, const char * dir, int recursive,
+                    mpd_EntityVisitor visitor, void * userdata);
+
+/* mpd_getMirrorSong
+ * returns the song _file_ as listallinfo would, or NULL if it isn't
+ * in the mirror; free it with mpd_freeSong
+ */
+mpd_Song * mpd_getMirrorSong(mpd_Mirror * mirror, const char * file);
+
+/* mpd_setMirror
+ * answers the searches started with mpd_startSearch from _mirror_
+ * instead of sending them, as long as nothing else is outstanding on
+ * the connection and it isn't in a command list or asynchronous; the
+ * songs are read with mpd_getNextInfoEntity or mpd_visitInfoEntities
+ * as usual.  like mpd, find matches whole values and search any part
+ * of them, ignoring case.  the mirror has to stay open while it is set,
+ * NULL goes back to asking mpd.
+ * the mirror isn't checked against mpd's database when searching, so
+ * once mpd has updated its database the results are those of the old
+ * one, songs added since are missing and removed ones still found.
+ * check with mpd_isMirrorCurrent, eg after an idle "database" event,
+ * and on 0 call mpd_updateMirror and set the reopened mirror
+ */
+void mpd_setMirror(mpd_Connection * connection, mpd_Mirror * mirror);
+
+void mpd_closeMirror(mpd_Mirror * mirror);
+#endif
 #ifdef __cplusplus
 }
 #endif
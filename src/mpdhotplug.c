@@ -8,6 +8,20 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <linux/netlink.h>
+#include <linux/magic.h>
+#include <glib.h>
 #include "libmpdclient.h"
 
 /*----------------------------------------------------------------------
@@ -24,7 +38,8 @@ typedef enum {
 typedef enum {
   MODE_NONE,
   MODE_ADD,
-  MODE_REMOVE
+  MODE_REMOVE,
+  MODE_DAEMON
 } mode_t;
 
 
@@ -33,11 +48,28 @@ typedef struct mpdhotplug_state
   char *config_dir;
   char *config_file;
   char *pid_file;
+  char *socket_file;
+  char *db_file;
+  char *playlist_dir;
+  char *cache_dir;
+  char *music_root;
+  int device_db;   // keep a copy of the database on the device
+  int resident;    // keep one daemon running and mount devices into it
+  char *library_uri; // what we update and play, "" for everything
+  char *active_mount;  // the device we are playing, NULL if unknown
   char *mpd_host; 
   char *mpd_bin;
   unsigned mpd_port;
   unsigned mpd_timeout;
+  unsigned stop_timeline[4]; // ms until SIGINT, SIGTERM, SIGKILL, giving up
   mpd_Connection *mpd_connection;
+  int update_id;   // job id of the update we started, 0 if unknown
+  char *mountinfo_file;
+  struct mount_watch *mounts;
+  struct event_queue *events;  // NULL unless we read uevents ourselves
+  struct registry *instances;  // one daemon per device, or NULL
+  GAsyncQueue *inbox;  // events for a device's instance, or NULL
+  int wake_fd;         // readable when something is put in inbox
 } mpdhotplug_state;
 
 /*----------------------------------------------------------------------
@@ -46,11 +78,13 @@ typedef struct mpdhotplug_state
 result_t logprint(const char *fmt, ...)
 {
     va_list argp;
+    flockfile(stderr);  // one line at a time from each device's thread
     fprintf(stderr, "log: ");
     va_start(argp, fmt);
     vfprintf(stderr, fmt, argp);
     va_end(argp);
     fprintf(stderr, "\n");
+    funlockfile(stderr);
     return RESULT_SUCCESS;
 }
 
@@ -81,7 +115,7 @@ void error(const char *fmt, ...)
 
 void usage(const char *argv0)
 {
-  error("Usage: %s [add|remove] <udevpath>", argv0);
+  error("Usage: %s [add|remove] <udevpath> | daemon | resident | multi", argv0);
 }
 
 char *path_join_alloc(const char *a, const char *b)
@@ -96,6 +130,541 @@ char *path_join_alloc(const char *a, const char *b)
     return c;
 }
 
+long long now_ms()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// The mount watcher keeps an in-memory copy of the mount table, keyed
+// by mount point, and only rereads it when the kernel says it changed:
+// /proc/self/mountinfo signals POLLPRI|POLLERR on every mount/umount.
+// A mountinfo line looks like this:
+//   36 25 8:1 / /media/sda1 rw,relatime shared:1 - vfat /dev/sda1 rw,fmask=0022
+// Any other file in the same format can stand in for testing; it has
+// no change notification so it is simply reread every poll interval.
+#define MOUNT_POLL_INTERVAL 100 // ms, for files that can't notify
+
+typedef struct mount_entry
+{
+  char *mount_point;
+  char *source;
+  char *fstype;
+  unsigned generation;
+} mount_entry;
+
+typedef struct mount_watch
+{
+  char *path;
+  int fd;
+  int notifies;       // fd signals changes with POLLPRI
+  unsigned generation;
+  GHashTable *mounts; // mount point -> mount_entry
+} mount_watch;
+
+void mount_entry_free(gpointer data)
+{
+  mount_entry *entry = (mount_entry *)data;
+  free(entry->mount_point);
+  free(entry->source);
+  free(entry->fstype);
+  g_slice_free(mount_entry, entry);
+}
+
+// copy a mountinfo field, undoing the \\ooo octal escapes the kernel
+// uses for spaces, tabs, newlines and backslashes
+char *mount_unescape(const char *p, int len)
+{
+  char *out = (char *)malloc(len + 1);
+  char *q = out;
+  int i = 0;
+  while (i < len) {
+    if (p[i] == '\\' && i + 3 < len &&
+	p[i+1] >= '0' && p[i+1] <= '7' &&
+	p[i+2] >= '0' && p[i+2] <= '7' &&
+	p[i+3] >= '0' && p[i+3] <= '7') {
+      *q++ = (char)(((p[i+1]-'0') << 6) | ((p[i+2]-'0') << 3) | (p[i+3]-'0'));
+      i += 4;
+    } else {
+      *q++ = p[i++];
+    }
+  }
+  *q = 0;
+  return out;
+}
+
+// merge one mountinfo line into the table
+void mount_watch_line(mount_watch *watch, const char *line, int len)
+{
+  const char *field[32];
+  int flen[32];
+  int n = 0;
+  int sep = 0;
+  const char *p = line;
+  const char *end = line + len;
+
+  while (p < end && n < 32) {
+    while (p < end && *p == ' ') p++;
+    const char *f = p;
+    while (p < end && *p != ' ') p++;
+    if (p == f) break;
+    // the optional fields after the 6th are ended by a lone "-",
+    // then come fstype and source
+    if (n >= 6 && !sep && p - f == 1 && *f == '-') {
+      sep = n;
+    }
+    field[n] = f;
+    flen[n] = p - f;
+    n++;
+  }
+  if (!sep || sep + 2 >= n) {
+    return;
+  }
+
+  char *mount_point = mount_unescape(field[4], flen[4]);
+  mount_entry *entry = (mount_entry *)g_hash_table_lookup(watch->mounts, mount_point);
+  if (entry) {
+    // something else may have been mounted there since we last looked
+    free(mount_point);
+    free(entry->fstype);
+    free(entry->source);
+  } else {
+    entry = g_slice_new0(mount_entry);
+    entry->mount_point = mount_point;
+    g_hash_table_insert(watch->mounts, entry->mount_point, entry);
+  }
+  entry->fstype = mount_unescape(field[sep+1], flen[sep+1]);
+  entry->source = mount_unescape(field[sep+2], flen[sep+2]);
+  entry->generation = watch->generation;
+}
+
+gboolean mount_entry_stale(gpointer key, gpointer value, gpointer data)
+{
+  return ((mount_entry *)value)->generation != *(unsigned *)data;
+}
+
+// Reread the mount table, adding new mounts, updating ones that are
+// still present and dropping ones that have gone.
+result_t mount_watch_refresh(mount_watch *watch)
+{
+  char buf[8192];
+  char line[8192];
+  int linelen = 0;
+  int len;
+
+  if (lseek(watch->fd, 0, SEEK_SET) < 0) {
+    logprint("Could not rewind %s: error %d", watch->path, errno);
+    return RESULT_FAILURE;
+  }
+  watch->generation++;
+  while ((len = read(watch->fd, buf, sizeof(buf))) != 0) {
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      logprint("Could not read %s: error %d", watch->path, errno);
+      return RESULT_FAILURE;
+    }
+    int i;
+    for (i = 0; i < len; i++) {
+      if (buf[i] == '\n') {
+	mount_watch_line(watch, line, linelen);
+	linelen = 0;
+      } else if (linelen < (int)sizeof(line)) {
+	line[linelen++] = buf[i];
+      }
+    }
+  }
+  if (linelen > 0) {
+    mount_watch_line(watch, line, linelen);
+  }
+  g_hash_table_foreach_remove(watch->mounts, mount_entry_stale,
+			      &watch->generation);
+  return RESULT_SUCCESS;
+}
+
+mount_watch *mount_watch_open(const char *path)
+{
+  struct statfs fs;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    logprint("Could not open %s: error %d", path, errno);
+    return NULL;
+  }
+  mount_watch *watch = g_slice_new0(mount_watch);
+  watch->path = strdup(path);
+  watch->fd = fd;
+  watch->notifies = fstatfs(fd, &fs) == 0 && fs.f_type == PROC_SUPER_MAGIC;
+  watch->mounts = g_hash_table_new_full(g_str_hash, g_str_equal,
+					NULL, mount_entry_free);
+  // the initial read also arms the change notification
+  mount_watch_refresh(watch);
+  return watch;
+}
+
+void mount_watch_close(mount_watch *watch)
+{
+  if (watch) {
+    close(watch->fd);
+    g_hash_table_destroy(watch->mounts);
+    free(watch->path);
+    g_slice_free(mount_watch, watch);
+  }
+}
+
+const mount_entry *mount_lookup(mount_watch *watch, const char *mount)
+{
+  return (const mount_entry *)g_hash_table_lookup(watch->mounts, mount);
+}
+
+// Block until the mount table changes, cancel_fd (if not -1) becomes
+// readable or timeout_ms passes, then bring the table up to date.
+// Returns RESULT_FAILURE only on error.
+result_t mount_watch_wait(mount_watch *watch, int cancel_fd, int timeout_ms)
+{
+  struct pollfd pfd[2];
+  pfd[0].fd = watch->fd;
+  pfd[0].events = POLLPRI;
+  pfd[0].revents = 0;
+  pfd[1].fd = cancel_fd;
+  pfd[1].events = POLLIN;
+  pfd[1].revents = 0;
+  if (!watch->notifies && timeout_ms > MOUNT_POLL_INTERVAL) {
+    timeout_ms = MOUNT_POLL_INTERVAL;
+  }
+  if (poll(pfd, 2, timeout_ms) < 0 && errno != EINTR) {
+    logprint("Error %d waiting for mount changes", errno);
+    return RESULT_FAILURE;
+  }
+  if (!watch->notifies || (pfd[0].revents & (POLLPRI | POLLERR))) {
+    return mount_watch_refresh(watch);
+  }
+  return RESULT_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// In daemon mode we listen for the kernel's block device uevents
+// ourselves instead of being exec'd by udev for each one.  A uevent
+// datagram is a header followed by NUL separated key=value pairs:
+//   add@/devices/.../block/sda/sda1
+//   ACTION=add
+//   DEVPATH=/devices/.../block/sda/sda1
+//   SUBSYSTEM=block
+//   DEVTYPE=partition
+#define UEVENT_BUFFER_SIZE 8192
+
+typedef struct uevent
+{
+  mode_t mode;
+  const char *devpath;   // point into the receive buffer
+  const char *subsystem;
+  const char *devtype;
+} uevent;
+
+int uevent_open()
+{
+  struct sockaddr_nl addr;
+  int rcvbuf = 1024 * 1024;
+  int fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+  if (fd < 0) {
+    logprint("Could not open uevent socket: error %d", errno);
+    return -1;
+  }
+  // plug events arrive in bursts, don't let the kernel drop them
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.nl_family = AF_NETLINK;
+  addr.nl_pid = getpid();
+  addr.nl_groups = 1;  // kernel uevents, not the udev rebroadcast
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+    logprint("Could not bind uevent socket: error %d", errno);
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+result_t uevent_parse(char *buf, int len, uevent *event)
+{
+  char *p = buf;
+  char *end = buf + len;
+
+  memset(event, 0, sizeof(*event));
+  event->mode = MODE_NONE;
+
+  // the header must look like action@devpath
+  if (len <= 0 || !memchr(buf, '@', strnlen(buf, len))) {
+    return RESULT_FAILURE;
+  }
+  buf[len-1] = 0;
+
+  p += strlen(p) + 1;
+  while (p < end) {
+    if (!strncmp(p, "ACTION=", 7)) {
+      if (!strcmp(p+7, "add")) {
+	event->mode = MODE_ADD;
+      } else if (!strcmp(p+7, "remove")) {
+	event->mode = MODE_REMOVE;
+      }
+    } else if (!strncmp(p, "DEVPATH=", 8)) {
+      event->devpath = p+8;
+    } else if (!strncmp(p, "SUBSYSTEM=", 10)) {
+      event->subsystem = p+10;
+    } else if (!strncmp(p, "DEVTYPE=", 8)) {
+      event->devtype = p+8;
+    }
+    p += strlen(p) + 1;
+  }
+
+  if (event->mode == MODE_NONE || !event->devpath) {
+    return RESULT_FAILURE;
+  }
+  return RESULT_SUCCESS;
+}
+
+// Returns the datagram length, 0 when the peer has gone away (only a
+// SOCK_SEQPACKET socketpair standing in for the kernel does that; a
+// datagram peer closing is never reported) or -1 on error, with errno EAGAIN if flags has
+// MSG_DONTWAIT and nothing is waiting.  Datagrams not sent by the
+// kernel are dropped here.
+int uevent_read(int fd, char *buf, size_t bufsize, int flags)
+{
+  while (1) {
+    struct sockaddr_nl addr;
+    struct iovec iov = { buf, bufsize };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = &addr;
+    msg.msg_namelen = sizeof(addr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    int len = recvmsg(fd, &msg, flags);
+    if (len < 0) {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN) return -1;
+      if (errno == ENOBUFS) {
+	logprint("uevent queue overflowed, events were lost");
+	continue;
+      }
+      logprint("Error %d reading uevent socket", errno);
+      return -1;
+    }
+    if (msg.msg_namelen == sizeof(addr) && addr.nl_family == AF_NETLINK &&
+	addr.nl_pid != 0) {
+      continue;  // not from the kernel
+    }
+    return len;
+  }
+}
+
+// argv will contain a string like this:
+//   add /devices/platform/stmp3xxx-usb/fsl-ehci/usb1/1-1/1-1.3/1-1.3:1.0/host4/target4:0:0/4:0:0:0/block/sda/sda1
+// and we return the last component formatted like this:
+//   /media/sda1
+char *mount_name(const char *devname)
+{
+  const char *p = devname + strlen(devname);
+  while (p > devname && p[-1]!='/') p--;
+  int plen = strlen(p);
+  char *mount = (char*)malloc(plen + 8);  // '/media/+<p>+\0
+  sprintf(mount, "/media/%s", p);
+  return mount;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// Plugging in a stick with several partitions, or a loose connector,
+// gives a burst of events.  Rather than stopping and starting mpd for
+// each one, events are held per device (keyed by mount_name()) until
+// the device has been quiet for COALESCE_WINDOW, and only its final
+// state is acted on: add/remove/add is one add, add/remove of a device
+// we never played is nothing.  Events that arrive while we are busy
+// are queued the same way, and work they make pointless is abandoned;
+// see hotplug_superseded().
+#define COALESCE_WINDOW 300 // ms
+
+typedef struct pending_event
+{
+  char *mount;    // also the key
+  mode_t mode;
+  char *devpath;
+  long long due;  // when the device has been quiet long enough
+} pending_event;
+
+typedef struct event_queue
+{
+  int fd;
+  int closed;           // the socket's peer has gone, flush and stop
+  GHashTable *pending;  // mount name -> pending_event
+  unsigned received;
+  unsigned dispatched;
+} event_queue;
+
+void pending_event_free(gpointer data)
+{
+  pending_event *event = (pending_event *)data;
+  free(event->mount);
+  free(event->devpath);
+  g_slice_free(pending_event, event);
+}
+
+event_queue *event_queue_new(int fd)
+{
+  event_queue *queue = g_slice_new0(event_queue);
+  queue->fd = fd;
+  queue->pending = g_hash_table_new_full(g_str_hash, g_str_equal,
+					 NULL, pending_event_free);
+  return queue;
+}
+
+void event_queue_free(event_queue *queue)
+{
+  if (queue) {
+    g_hash_table_destroy(queue->pending);
+    g_slice_free(event_queue, queue);
+  }
+}
+
+void event_queue_add(event_queue *queue, mode_t mode, const char *devpath)
+{
+  char *mount = mount_name(devpath);
+  pending_event *event = (pending_event *)g_hash_table_lookup(queue->pending, mount);
+  if (event) {
+    logprint("%s: %s replaces %s", mount,
+	     mode == MODE_ADD ? "add" : "remove",
+	     event->mode == MODE_ADD ? "add" : "remove");
+    free(event->devpath);
+    free(mount);
+  } else {
+    event = g_slice_new0(pending_event);
+    event->mount = mount;
+    g_hash_table_insert(queue->pending, mount, event);
+  }
+  event->mode = mode;
+  event->devpath = strdup(devpath);
+  event->due = now_ms() + COALESCE_WINDOW;
+  queue->received++;
+}
+
+// Wait up to timeout_ms (-1 for ever) for uevents and queue all the
+// block device ones that are waiting.
+result_t event_queue_read(event_queue *queue, int timeout_ms)
+{
+  char buf[UEVENT_BUFFER_SIZE];
+  uevent event;
+  struct pollfd pfd;
+
+  if (queue->closed) {
+    return RESULT_SUCCESS;
+  }
+  pfd.fd = queue->fd;
+  pfd.events = POLLIN;
+  if (poll(&pfd, 1, timeout_ms) < 0 && errno != EINTR) {
+    logprint("Error %d waiting for uevents", errno);
+    return RESULT_FAILURE;
+  }
+  while (1) {
+    int len = uevent_read(queue->fd, buf, sizeof(buf), MSG_DONTWAIT);
+    if (len < 0) {
+      return errno == EAGAIN ? RESULT_SUCCESS : RESULT_FAILURE;
+    }
+    if (len == 0) {
+      queue->closed = 1;
+      return RESULT_SUCCESS;
+    }
+    if (RESULT_SUCCESS != uevent_parse(buf, len, &event)) {
+      continue;
+    }
+    if (!event.subsystem || strcmp(event.subsystem, "block") ||
+	!event.devtype || strcmp(event.devtype, "partition")) {
+      continue;
+    }
+    logprint("uevent %s %s",
+	     event.mode == MODE_ADD ? "add" : "remove", event.devpath);
+    event_queue_add(queue, event.mode, event.devpath);
+  }
+}
+
+gboolean pending_event_earliest(gpointer key, gpointer value, gpointer data)
+{
+  pending_event **earliest = (pending_event **)data;
+  pending_event *event = (pending_event *)value;
+  if (!*earliest || event->due < (*earliest)->due) {
+    *earliest = event;
+  }
+  return FALSE;
+}
+
+// Take the next event that is due, or set *timeout_ms to how long until
+// one will be (-1 if none are pending).  Once the socket has closed
+// everything is due.  Free the event with pending_event_free().
+pending_event *event_queue_next(event_queue *queue, int *timeout_ms)
+{
+  pending_event *event = NULL;
+  g_hash_table_find(queue->pending, pending_event_earliest, &event);
+  if (!event) {
+    *timeout_ms = -1;
+    return NULL;
+  }
+  long long wait = event->due - now_ms();
+  if (wait > 0 && !queue->closed) {
+    *timeout_ms = wait;
+    return NULL;
+  }
+  // hand the event over without the table freeing it
+  g_hash_table_steal(queue->pending, event->mount);
+  queue->dispatched++;
+  return event;
+}
+
+// the fd to watch for new events, or -1
+int event_queue_fd(event_queue *queue)
+{
+  return queue && !queue->closed ? queue->fd : -1;
+}
+
+// the fd that wakes us when work may have been superseded, or -1
+int hotplug_cancel_fd(mpdhotplug_state *state)
+{
+  return state->inbox ? state->wake_fd : event_queue_fd(state->events);
+}
+
+gboolean pending_event_supersedes(gpointer key, gpointer value, gpointer data)
+{
+  mpdhotplug_state *state = (mpdhotplug_state *)data;
+  pending_event *event = (pending_event *)value;
+  if (state->active_mount && !strcmp(event->mount, state->active_mount)) {
+    return TRUE;
+  }
+  // a new device replaces ours unless each has its own mount
+  return !state->resident && event->mode == MODE_ADD;
+}
+
+// Check for events that make the work in hand for state->active_mount
+// pointless, so that it can be abandoned.
+int hotplug_superseded(mpdhotplug_state *state)
+{
+  if (state->inbox) {
+    // a device's own instance: anything more for the device will do
+    char buf[64];
+    while (read(state->wake_fd, buf, sizeof(buf)) > 0);
+    return g_async_queue_length(state->inbox) > 0;
+  }
+  if (!state->events) {
+    return 0;
+  }
+  event_queue_read(state->events, 0);
+  return g_hash_table_find(state->events->pending,
+			   pending_event_supersedes, state) != NULL;
+}
+
 /*----------------------------------------------------------------------
   
   ----------------------------------------------------------------------*/
@@ -137,23 +706,67 @@ void mpd_disconnect(mpdhotplug_state *state)
   ----------------------------------------------------------------------*/
 #define ALLOC(t) (t*)malloc(sizeof(t))
 
+void state_paths_free(mpdhotplug_state *state)
+{
+    free(state->config_dir);
+    free(state->pid_file);
+    free(state->config_file);
+    free(state->socket_file);
+    free(state->db_file);
+    free(state->playlist_dir);
+    free(state->cache_dir);
+    free(state->music_root);
+}
+
+// Put everything the daemon keeps in config_dir.
+void state_config_dir(mpdhotplug_state *state, const char *config_dir)
+{
+    state_paths_free(state);
+    state->config_dir = strdup(config_dir);
+    state->pid_file = path_join_alloc(state->config_dir, "mpd.pid");
+    state->config_file = path_join_alloc(state->config_dir, "mpd.conf");
+    state->socket_file = path_join_alloc(state->config_dir, "mpd.socket");
+    state->db_file = path_join_alloc(state->config_dir, "mpd.db");
+    state->playlist_dir = path_join_alloc(state->config_dir, "playlists");
+    state->cache_dir = path_join_alloc(state->config_dir, "cache");
+    state->music_root = path_join_alloc(state->config_dir, "music");
+    state->mpd_host = state->socket_file;  // talk to our own daemon locally
+}
+
 mpdhotplug_state *state_alloc()
 {
     mpdhotplug_state *state = ALLOC(mpdhotplug_state);
-    state->config_dir = "/media/ram/mpd";
-    state->pid_file = path_join_alloc(state->config_dir, "mpd.pid");  // LEAKED
-    state->config_file = path_join_alloc(state->config_dir, "mpd.conf"); // LEAKED
-    state->mpd_host = "localhost"; 
+    memset(state, 0, sizeof(*state));
+    state_config_dir(state, "/media/ram/mpd");
+    state->device_db = 1;
+    state->resident = 0;
+    state->library_uri = strdup("");
     state->mpd_bin = "/usr/bin/mpd";
     state->mpd_port = 6600;
     state->mpd_timeout = 2;  // default timeout in seconds
+    state->stop_timeline[0] = 0;
+    state->stop_timeline[1] = 5000;  // mpd saves its state on SIGINT
+    state->stop_timeline[2] = 8000;
+    state->stop_timeline[3] = 10000;
     state->mpd_connection = NULL;
+    state->update_id = 0;
+    state->mountinfo_file = "/proc/self/mountinfo";
+    state->mounts = NULL;
+    state->active_mount = NULL;
+    state->events = NULL;
+    state->instances = NULL;
+    state->inbox = NULL;
+    state->wake_fd = -1;
     return state;
 }
 
 void state_free(mpdhotplug_state *state)
 {
     mpd_disconnect(state);
+    mount_watch_close(state->mounts);
+    state_paths_free(state);
+    free(state->library_uri);
+    free(state->active_mount);
     free(state);
 }
 
@@ -161,7 +774,7 @@ void state_free(mpdhotplug_state *state)
   
   ----------------------------------------------------------------------*/
 
-void make_dir(const char *path, mode_t mode)
+result_t make_dir(const char *path, mode_t mode)
 {
     struct stat statbuf;
     int i = stat (path, &statbuf);
@@ -172,15 +785,18 @@ void make_dir(const char *path, mode_t mode)
             logprint("dir %s already exists", path);
         } else {
             // not a directory - fail
-            error("dir %s exists and is not a directory", path);
+            logprint("dir %s exists and is not a directory", path);
+            return RESULT_FAILURE;
         }
     } else {
         // not found - create
         logprint("dir %s does not exist", path);
         if (mkdir(path, mode)) {
-            error("could not create dir %s", path);
+            logprint("could not create dir %s: error %d", path, errno);
+            return RESULT_FAILURE;
         }
     }
+    return RESULT_SUCCESS;
 }
 
 void ms_sleep(int time_ms)
@@ -195,20 +811,39 @@ void ms_sleep(int time_ms)
  * Create or update the .mpd directory on the target device.
  * 
  */
-void mpd_write_conf(mpdhotplug_state *state, const char *music_directory)
+result_t mpd_write_conf(mpdhotplug_state *state, const char *music_directory)
 {
     logprint("configure_mpd");
 
     // create config dir (if necessary)
-    make_dir(state->config_dir, 0777);
+    if (make_dir(state->config_dir, 0777) ||
+        make_dir(state->playlist_dir, 0777) ||
+        (state->resident && (make_dir(state->cache_dir, 0777) ||
+                             make_dir(state->music_root, 0777)))) {
+      return RESULT_FAILURE;
+    }
+
+    // the simple database can have devices mounted into it, each with
+    // its own database kept in the cache directory
+    char *database = state->resident ?
+      g_strdup_printf("database {\n"
+		      "        plugin           \"simple\"\n"
+		      "        path             \"%s\"\n"
+		      "        cache_directory  \"%s\"\n"
+		      "}\n", state->db_file, state->cache_dir) :
+      g_strdup_printf("db_file                 \"%s\"\n", state->db_file);
 
     // 
+    result_t result = RESULT_SUCCESS;
     FILE *config_file = fopen(state->config_file, "w");
     if (config_file) {
       fprintf(config_file, 
-	      "port                    \"6600\"\n"
+	      "port                    \"%u\"\n"
+	      "bind_to_address         \"any\"\n"
+	      "bind_to_address         \"%s\"\n"
 	      "music_directory         \"%s\"\n"
-	      "db_file                 \"%s/mpd.db\"\n"
+	      "%s"
+	      "playlist_directory      \"%s\"\n"
 	      "log_file                \"%s/mpd.log\"\n"
 	      "pid_file                \"%s/mpd.pid\"\n"
 	      "state_file              \"%s/mpd.state\"\n"
@@ -218,157 +853,837 @@ void mpd_write_conf(mpdhotplug_state *state, const char *music_directory)
 	      "        name        \"Default Audio\"\n"
 	      "        mixer_type  \"software\"\n"
 	      "}\n",
+	      state->mpd_port,
+	      state->socket_file,
 	      music_directory,
-	      state->config_dir,
+	      database,
+	      state->playlist_dir,
 	      state->config_dir,
 	      state->config_dir,
 	      state->config_dir);
       fclose(config_file);
     } else {
-      error("Could not create %s", state->config_file);
+      logprint("Could not create %s: error %d", state->config_file, errno);
+      result = RESULT_FAILURE;
     }
+    g_free(database);
+    return result;
 }
 
 /*----------------------------------------------------------------------
   
   ----------------------------------------------------------------------*/
-result_t mpd_start(mpdhotplug_state *state)
+// The database mpd builds for a device is kept on the device in
+// .mpd/mpd.db (where templates/mpd.config puts it), next to a stamp
+// recording the mtime of every entry in the device's top directory.
+// When the stamp still matches, the copy is handed to mpd and the full
+// rescan is skipped.  mpd itself always works on the copy in RAM, so a
+// read-only or yanked device can't leave it half written.
+#define DB_HEADER "info_begin\n"
+
+gint db_stamp_compare(gconstpointer a, gconstpointer b)
 {
-  int attempts = 5;
-  int delay = 200;  // ms
+  return strcmp(*(char * const *)a, *(char * const *)b);
+}
 
-  logprint("start_mpd");
-  while (attempts-->0) {
-    pid_t pid = fork();
-    if (pid == 0) {
-      // child process
-      char * const argv[] = {state->mpd_bin, state->config_file, NULL};
-      logprint("launch %s %s",state->mpd_bin, state->config_file);
-      execv(state->mpd_bin, argv);
-      error("Failed to start daemon: error %d", errno);
-    } else {
-      // parent process - waits for daemon to detach
-      int status;
-      if (wait(&status) != pid) {
-	logprint("Error checking new daemon process");
-      } else if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) { 
-	logprint("Error starting new daemon process");
-      } else {
-	return RESULT_SUCCESS;  // succeeded
-      }
+// Build the stamp for a music directory: one "mtime size name" line per
+// top level entry, sorted so that it compares equal between runs.
+char *db_stamp(const char *music_directory)
+{
+  DIR *dir = opendir(music_directory);
+  if (!dir) {
+    return NULL;
+  }
+  GPtrArray *lines = g_ptr_array_new();
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    struct stat statbuf;
+    if (entry->d_name[0] == '.' &&
+	(!entry->d_name[1] || !strcmp(entry->d_name, "..") ||
+	 !strcmp(entry->d_name, ".mpd"))) {
+      continue;
     }
-    ms_sleep(delay);  // units are microseconds
+    char *path = path_join_alloc(music_directory, entry->d_name);
+    if (stat(path, &statbuf) == 0) {
+      g_ptr_array_add(lines, g_strdup_printf("%ld %lld %s\n",
+					     (long)statbuf.st_mtime,
+					     S_ISDIR(statbuf.st_mode) ? 0LL :
+					     (long long)statbuf.st_size,
+					     entry->d_name));
+    }
+    free(path);
   }
-  return RESULT_FAILURE;
+  closedir(dir);
+
+  g_ptr_array_sort(lines, (GCompareFunc)db_stamp_compare);
+  GString *stamp = g_string_new("");
+  guint i;
+  for (i = 0; i < lines->len; i++) {
+    g_string_append(stamp, (char *)g_ptr_array_index(lines, i));
+    g_free(g_ptr_array_index(lines, i));
+  }
+  g_ptr_array_free(lines, TRUE);
+  return g_string_free(stamp, FALSE);
 }
 
-/*----------------------------------------------------------------------
-  
-  ----------------------------------------------------------------------*/
-result_t mpd_start_update(mpdhotplug_state *state)
+// Copy src to dst via a temporary file, so dst is either the old or the
+// complete new file.
+result_t file_copy(const char *src, const char *dst)
 {
-  int attempts = 10;
-  int delay = 250;
-
-  while (attempts-- > 0) {
+  char buf[65536];
+  int len;
+  int in = open(src, O_RDONLY | O_CLOEXEC);
+  if (in < 0) {
+    return RESULT_FAILURE;
+  }
+  char *tmp = g_strconcat(dst, ".tmp", NULL);
+  int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  result_t result = out < 0 ? RESULT_FAILURE : RESULT_SUCCESS;
+  while (result == RESULT_SUCCESS && (len = read(in, buf, sizeof(buf))) != 0) {
+    if (len < 0) {
+      if (errno != EINTR) result = RESULT_FAILURE;
+    } else if (write(out, buf, len) != len) {
+      result = RESULT_FAILURE;
+    }
+  }
+  close(in);
+  if (out >= 0) {
+    if (fsync(out) || close(out)) result = RESULT_FAILURE;
+  }
+  if (result == RESULT_SUCCESS && rename(tmp, dst)) {
+    result = RESULT_FAILURE;
+  }
+  if (result == RESULT_FAILURE) {
+    unlink(tmp);
+  }
+  g_free(tmp);
+  return result;
+}
 
-    ms_sleep(delay);
-    if (mpd_connect(state) == RESULT_SUCCESS) {
-      logprint("Connected");
-      result_t result = RESULT_SUCCESS;
+int db_valid(const char *db_file)
+{
+  char buf[sizeof(DB_HEADER) - 1];
+  int valid = 0;
+  int fd = open(db_file, O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    valid = read(fd, buf, sizeof(buf)) == sizeof(buf) &&
+      !memcmp(buf, DB_HEADER, sizeof(buf));
+    close(fd);
+  }
+  return valid;
+}
 
-      logprint("send update");
-      mpd_sendUpdateCommand(state->mpd_connection, "");
-      mpd_finishCommand(state->mpd_connection);
-      result |= mpd_log_error(state);
+// Put the device's database in place for mpd if it is still good.
+// Otherwise make sure mpd starts from an empty one rather than the last
+// device's.  Returns RESULT_SUCCESS when the rescan can be skipped.
+result_t db_restore(mpdhotplug_state *state, const char *music_directory)
+{
+  result_t result = RESULT_FAILURE;
+  unlink(state->db_file);
+  if (!state->device_db) {
+    return result;
+  }
 
-      logprint("send clear");
-      mpd_sendClearCommand(state->mpd_connection);
-      mpd_finishCommand(state->mpd_connection);
-      result |= mpd_log_error(state);
+  char *dir = path_join_alloc(music_directory, ".mpd");
+  char *db = path_join_alloc(dir, "mpd.db");
+  char *stamp_file = path_join_alloc(dir, "mpd.stamp");
+  char *saved = NULL;
+  char *stamp = db_stamp(music_directory);
 
-      if (result == RESULT_SUCCESS) {
-	return result;
-      }
+  if (stamp && db_valid(db) &&
+      g_file_get_contents(stamp_file, &saved, NULL, NULL) &&
+      !strcmp(saved, stamp)) {
+    if (file_copy(db, state->db_file) == RESULT_SUCCESS) {
+      logprint("Using database from %s", db);
+      result = RESULT_SUCCESS;
+    } else {
+      logprint("Could not copy %s: error %d", db, errno);
     }
+  } else {
+    logprint("No current database on %s", music_directory);
   }
-  return RESULT_FAILURE;
+
+  g_free(saved);
+  g_free(stamp);
+  free(stamp_file);
+  free(db);
+  free(dir);
+  return result;
 }
 
-result_t mpd_play(mpdhotplug_state *state)
+// After a scan, write mpd's database back to the device with a stamp
+// of what it was built from.
+result_t db_save(mpdhotplug_state *state, const char *music_directory)
 {
-  int attempts = 10;
-  int delay = 250;
-  while (attempts-- > 0) {
+  result_t result = RESULT_FAILURE;
+  if (!state->device_db) {
+    return RESULT_SUCCESS;
+  }
 
-    ms_sleep(delay);
-    if (mpd_connect(state) == RESULT_SUCCESS) {
-      logprint("Connected");
-
-      logprint("send add");
-      mpd_sendAddCommand(state->mpd_connection, "");
-      mpd_finishCommand(state->mpd_connection);
-      mpd_log_error(state);
-
-      mpd_sendRepeatCommand(state->mpd_connection, 1);
-      mpd_finishCommand(state->mpd_connection);
-      mpd_log_error(state);
-
-      mpd_sendRandomCommand(state->mpd_connection, 1);
-      mpd_finishCommand(state->mpd_connection);
-      mpd_log_error(state);
-
-      logprint("send play");
-      mpd_sendPlayCommand(state->mpd_connection, -1); // not sure why -1 is default
-      mpd_log_error(state);
-      mpd_finishCommand(state->mpd_connection);
-      if (RESULT_SUCCESS == mpd_log_error(state)) {
-	return RESULT_SUCCESS;
-      }
-    }
+  char *dir = path_join_alloc(music_directory, ".mpd");
+  char *db = path_join_alloc(dir, "mpd.db");
+  char *stamp_file = path_join_alloc(dir, "mpd.stamp");
+  char *stamp = NULL;
+
+  if (!db_valid(state->db_file)) {
+    logprint("No database to save");
+  } else if (mkdir(dir, 0777) && errno != EEXIST) {
+    logprint("Could not create %s: error %d", dir, errno);
+  } else if (!(stamp = db_stamp(music_directory)) ||
+	     // a stale stamp must never pair up with the new database
+	     (unlink(stamp_file) && errno != ENOENT) ||
+	     file_copy(state->db_file, db) == RESULT_FAILURE ||
+	     !g_file_set_contents(stamp_file, stamp, -1, NULL)) {
+    logprint("Could not save database to %s: error %d", dir, errno);
+  } else {
+    logprint("Saved database to %s", db);
+    result = RESULT_SUCCESS;
   }
-  return RESULT_FAILURE;
+
+  g_free(stamp);
+  free(stamp_file);
+  free(db);
+  free(dir);
+  return result;
 }
 
 /*----------------------------------------------------------------------
   
   ----------------------------------------------------------------------*/
-result_t mpd_wait_for_update(mpdhotplug_state *state)
+// So there is something to play long before mpd's own single threaded
+// scan is done, we walk the device with a pool of threads and put the
+// first audio files we find into a playlist.  Each directory is a
+// task.  A worker pushes the subdirectories it finds onto the back of
+// its own queue and takes its next task from there; when it runs dry
+// it steals from the front of the other queues, where the biggest
+// unexplored subtrees are.
+#define SCAN_THREADS 4
+#define STARTER_SIZE 50  // files in the starter playlist
+#define STARTER_PLAYLIST "mpdhotplug-starter"
+
+typedef struct scan_queue
 {
-  int attempts = 200;
-  int delay = 1000;
-  while (attempts-- > 0) {
+  pthread_mutex_t lock;
+  char **dirs;
+  int head;  // thieves take from here
+  int tail;  // the owner pushes and pops here
+  int size;
+} scan_queue;
 
-    ms_sleep(delay);
-    if (mpd_connect(state) == RESULT_SUCCESS) {
-      logprint("Connected");
+struct scanner;
 
-      mpd_Status *status = NULL;
-      
-      while (status == NULL) {
-	logprint("getting status");
-	mpd_sendStatusCommand(state->mpd_connection);
-	mpd_log_error(state);
-	ms_sleep(100);
+typedef struct scan_worker
+{
+  struct scanner *scanner;
+  int id;
+  pthread_t thread;
+} scan_worker;
 
-	status = mpd_getStatus(state->mpd_connection);
-	mpd_log_error(state);
-	ms_sleep(100);
+typedef struct scanner
+{
+  scan_worker workers[SCAN_THREADS];
+  scan_queue queues[SCAN_THREADS];
+  pthread_mutex_t lock;  // protects the rest
+  pthread_cond_t work;
+  unsigned pushes;       // lets idle workers notice new work
+  int pending;           // directories queued or being read
+  int limit;
+  int done;              // enough files found, or no directories left
+  int started;           // workers running
+  GPtrArray *files;
+} scanner;
 
-	mpd_finishCommand(state->mpd_connection);
-	mpd_log_error(state);
-	ms_sleep(100);
+void scan_push(scan_queue *queue, char *dir)
+{
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail == queue->size) {
+    if (queue->head > 0) {
+      memmove(queue->dirs, queue->dirs + queue->head,
+	      (queue->tail - queue->head) * sizeof(char *));
+      queue->tail -= queue->head;
+      queue->head = 0;
+    } else {
+      queue->size = queue->size ? queue->size * 2 : 64;
+      queue->dirs = (char **)realloc(queue->dirs, queue->size * sizeof(char *));
+    }
+  }
+  queue->dirs[queue->tail++] = dir;
+  pthread_mutex_unlock(&queue->lock);
+}
+
+char *scan_pop(scan_queue *queue, int steal)
+{
+  char *dir = NULL;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->tail > queue->head) {
+    dir = steal ? queue->dirs[queue->head++] : queue->dirs[--queue->tail];
+  }
+  if (queue->head == queue->tail) {
+    queue->head = queue->tail = 0;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return dir;
+}
+
+void scan_add_dir(scanner *scan, int id, char *dir)
+{
+  // count it before it is visible, so a thief finishing it can't
+  // take pending to zero early
+  pthread_mutex_lock(&scan->lock);
+  scan->pending++;
+  pthread_mutex_unlock(&scan->lock);
+  scan_push(&scan->queues[id], dir);
+  pthread_mutex_lock(&scan->lock);
+  scan->pushes++;
+  pthread_cond_signal(&scan->work);
+  pthread_mutex_unlock(&scan->lock);
+}
+
+const char *audio_extensions[] = {
+  "mp3", "mp2", "ogg", "oga", "flac", "m4a", "mp4", "aac",
+  "wav", "wma", "opus", "mpc", "ape", "wv", NULL
+};
+
+int audio_extension(const char *name)
+{
+  const char *dot = strrchr(name, '.');
+  int i;
+  if (!dot) {
+    return 0;
+  }
+  for (i = 0; audio_extensions[i]; i++) {
+    if (!strcasecmp(dot + 1, audio_extensions[i])) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// check the file really starts like audio, which weeds out things like
+// truncated copies and the ._ files macOS leaves on FAT sticks
+int audio_magic(const char *path)
+{
+  unsigned char b[12];
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  int len = read(fd, b, sizeof(b));
+  close(fd);
+  if (len < (int)sizeof(b)) {
+    return 0;
+  }
+  return !memcmp(b, "ID3", 3) ||                      // tagged mp3
+    (b[0] == 0xff && (b[1] & 0xe0) == 0xe0) ||        // mpeg/adts frame
+    !memcmp(b, "OggS", 4) || !memcmp(b, "fLaC", 4) ||
+    (!memcmp(b, "RIFF", 4) && !memcmp(b + 8, "WAVE", 4)) ||
+    !memcmp(b + 4, "ftyp", 4) ||                      // mp4/m4a
+    !memcmp(b, "\x30\x26\xb2\x75", 4) ||              // asf/wma
+    !memcmp(b, "MPCK", 4) || !memcmp(b, "MP+", 3) ||
+    !memcmp(b, "MAC ", 4) || !memcmp(b, "wvpk", 4);
+}
+
+void scan_dir(scanner *scan, int id, const char *path)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  if (!dir) {
+    return;
+  }
+  while ((entry = readdir(dir))) {
+    // skips . and .. as well as hidden entries like .mpd
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char *child = path_join_alloc(path, entry->d_name);
+    int type = entry->d_type;
+    if (type == DT_UNKNOWN || type == DT_LNK) {
+      struct stat statbuf;
+      type = stat(child, &statbuf) ? DT_UNKNOWN :
+	S_ISDIR(statbuf.st_mode) ? DT_DIR :
+	S_ISREG(statbuf.st_mode) ? DT_REG : DT_UNKNOWN;
+    }
+    if (type == DT_DIR) {
+      scan_add_dir(scan, id, child);
+      continue;
+    }
+    if (type == DT_REG && audio_extension(entry->d_name) && audio_magic(child)) {
+      pthread_mutex_lock(&scan->lock);
+      if (!scan->done) {
+	g_ptr_array_add(scan->files, child);
+	child = NULL;
+	if ((int)scan->files->len >= scan->limit) {
+	  scan->done = 1;
+	  pthread_cond_broadcast(&scan->work);
+	}
+      }
+      int done = scan->done;
+      pthread_mutex_unlock(&scan->lock);
+      if (done) {
+	free(child);
+	break;
+      }
+    }
+    free(child);
+  }
+  closedir(dir);
+}
+
+void *scan_worker_run(void *arg)
+{
+  scan_worker *worker = (scan_worker *)arg;
+  scanner *scan = worker->scanner;
+  unsigned seen = 0;
+  int i;
+
+  while (1) {
+    char *dir = scan_pop(&scan->queues[worker->id], 0);
+    for (i = 1; !dir && i < SCAN_THREADS; i++) {
+      dir = scan_pop(&scan->queues[(worker->id + i) % SCAN_THREADS], 1);
+    }
+
+    pthread_mutex_lock(&scan->lock);
+    if (dir && !scan->done) {
+      pthread_mutex_unlock(&scan->lock);
+      scan_dir(scan, worker->id, dir);
+      pthread_mutex_lock(&scan->lock);
+    }
+    if (dir) {
+      free(dir);
+      if (--scan->pending == 0) {
+	scan->done = 1;
+	pthread_cond_broadcast(&scan->work);
+      }
+    } else if (!scan->done && scan->pushes == seen) {
+      // nothing anywhere and nothing new since we last looked
+      pthread_cond_wait(&scan->work, &scan->lock);
+    }
+    seen = scan->pushes;
+    if (scan->done) {
+      pthread_mutex_unlock(&scan->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&scan->lock);
+  }
+}
+
+// If no worker can be started the scan finds nothing.
+scanner *scanner_start(const char *root, int limit)
+{
+  scanner *scan = g_slice_new0(scanner);
+  int i;
+  pthread_mutex_init(&scan->lock, NULL);
+  pthread_cond_init(&scan->work, NULL);
+  scan->limit = limit;
+  scan->files = g_ptr_array_new();
+  for (i = 0; i < SCAN_THREADS; i++) {
+    pthread_mutex_init(&scan->queues[i].lock, NULL);
+  }
+  scan_add_dir(scan, 0, strdup(root));
+  for (i = 0; i < SCAN_THREADS; i++) {
+    scan->workers[i].scanner = scan;
+    scan->workers[i].id = i;
+    int err = pthread_create(&scan->workers[i].thread, NULL,
+			     scan_worker_run, &scan->workers[i]);
+    if (err) {
+      // the workers we have will steal everything between them
+      logprint("Could not start scanner thread: error %d", err);
+      break;
+    }
+    scan->started++;
+  }
+  return scan;
+}
+
+// Wait for the scan to stop and return the files it found, to be freed
+// with g_ptr_array_free() after free()ing each one.
+GPtrArray *scanner_finish(scanner *scan)
+{
+  GPtrArray *files = scan->files;
+  int i;
+  for (i = 0; i < scan->started; i++) {
+    pthread_join(scan->workers[i].thread, NULL);
+  }
+  for (i = 0; i < SCAN_THREADS; i++) {
+    char *dir;
+    while ((dir = scan_pop(&scan->queues[i], 0))) {
+      free(dir);  // left over when we stopped early
+    }
+    free(scan->queues[i].dirs);
+    pthread_mutex_destroy(&scan->queues[i].lock);
+  }
+  pthread_cond_destroy(&scan->work);
+  pthread_mutex_destroy(&scan->lock);
+  g_slice_free(scanner, scan);
+  return files;
+}
+
+void scan_file_free(gpointer data, gpointer user_data)
+{
+  free(data);
+}
+
+void scan_files_free(GPtrArray *files)
+{
+  g_ptr_array_foreach(files, scan_file_free, NULL);
+  g_ptr_array_free(files, TRUE);
+}
+
+// Write the files as an m3u of absolute paths.  mpd only accepts paths
+// outside its database from local clients, which we are since we talk
+// to it over its unix socket.
+result_t starter_write(mpdhotplug_state *state, GPtrArray *files)
+{
+  GString *m3u = g_string_new("");
+  guint i;
+  for (i = 0; i < files->len; i++) {
+    g_string_append(m3u, (char *)g_ptr_array_index(files, i));
+    g_string_append(m3u, "\n");
+  }
+  char *path = g_strconcat(state->playlist_dir, "/", STARTER_PLAYLIST ".m3u", NULL);
+  result_t result = g_file_set_contents(path, m3u->str, m3u->len, NULL) ?
+    RESULT_SUCCESS : RESULT_FAILURE;
+  if (result == RESULT_FAILURE) {
+    logprint("Could not write %s", path);
+  }
+  g_free(path);
+  g_string_free(m3u, TRUE);
+  return result;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+result_t mpd_start(mpdhotplug_state *state)
+{
+  int attempts = 5;
+  int delay = 200;  // ms
+
+  logprint("start_mpd");
+  // the old daemon is gone; a socket left behind by a crash must not be
+  // mistaken for the new one by mpd_wait_ready()
+  unlink(state->socket_file);
+  while (attempts-->0) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      logprint("Could not fork: error %d", errno);
+    } else if (pid == 0) {
+      // child process
+      char * const argv[] = {state->mpd_bin, state->config_file, NULL};
+      logprint("launch %s %s",state->mpd_bin, state->config_file);
+      execv(state->mpd_bin, argv);
+      error("Failed to start daemon: error %d", errno);
+    } else {
+      // parent process - waits for daemon to detach.  Only our own
+      // child: with an instance per device others are starting theirs
+      int status;
+      pid_t waited;
+      while ((waited = waitpid(pid, &status, 0)) < 0 && errno == EINTR);
+      if (waited != pid) {
+	logprint("Error checking new daemon process");
+      } else if (!WIFEXITED(status) || WEXITSTATUS(status)!=0) { 
+	logprint("Error starting new daemon process");
+      } else {
+	return RESULT_SUCCESS;  // succeeded
       }
+    }
+    ms_sleep(delay);  // units are microseconds
+  }
+  return RESULT_FAILURE;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// How long to wait before reprobing when MPD has created its socket
+// but isn't accepting on it yet (between bind() and listen()), or if
+// inotify is unavailable.
+#define READY_RETRY_INTERVAL 10 // ms
+
+// Try once to connect to the daemon.  The unix socket connect doesn't
+// block, so this fails straight away if nobody is listening; on
+// success the welcome banner has been read and parsed.
+result_t mpd_probe(mpdhotplug_state *state)
+{
+  mpd_Connection *connection = mpd_newConnection(state->mpd_host,
+						 state->mpd_port,
+						 state->mpd_timeout);
+  if (connection->error) {
+    mpd_closeConnection(connection);
+    return RESULT_FAILURE;
+  }
+  state->mpd_connection = connection;
+  return RESULT_SUCCESS;
+}
+
+// Wait for a freshly started daemon to accept connections, returning
+// as soon as it does with state->mpd_connection open.  Rather than
+// sleeping for a guessed startup time we watch the config dir with
+// inotify and probe whenever the pid file or socket appears.
+result_t mpd_wait_ready(mpdhotplug_state *state, int timeout_ms)
+{
+  long long deadline = now_ms() + timeout_ms;
+  char events[4096];
+  int fd;
+
+  if (state->mpd_connection) {
+    return RESULT_SUCCESS;
+  }
+
+  fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd >= 0 && inotify_add_watch(fd, state->config_dir,
+				   IN_CREATE | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+    logprint("Could not watch %s: error %d", state->config_dir, errno);
+    close(fd);
+    fd = -1;
+  }
+
+  // probe after the watch is in place so nothing can slip between
+  while (RESULT_FAILURE == mpd_probe(state)) {
+    struct stat statbuf;
+    struct pollfd pfd;
+    long long remaining = deadline - now_ms();
+    if (remaining <= 0) {
+      if (fd >= 0) close(fd);
+      return RESULT_FAILURE;
+    }
+    if (fd < 0 || stat(state->socket_file, &statbuf) == 0) {
+      if (remaining > READY_RETRY_INTERVAL) remaining = READY_RETRY_INTERVAL;
+    }
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, remaining) > 0) {
+      // we only care that something changed, not what
+      while (read(fd, events, sizeof(events)) > 0);
+    }
+  }
+  logprint("Daemon ready after %lld ms", now_ms() - (deadline - timeout_ms));
+  if (fd >= 0) close(fd);
+  return RESULT_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// The commands that set up a session.  A batch of them goes to mpd as
+// one command_list_ok_begin list in a single write.  mpd stops at the
+// first command that fails and reports its index, so a retry only
+// resends that command and the ones it never reached.
+typedef enum {
+  SETUP_UPDATE,
+  SETUP_CLEAR,
+  SETUP_REPEAT,
+  SETUP_RANDOM,
+  SETUP_ADD_ALL,
+  SETUP_LOAD_STARTER,
+  SETUP_PLAY
+} setup_t;
 
-      result_t result = status->updatingDb == 0 ? RESULT_SUCCESS : RESULT_FAILURE;
+const char *setup_names[] = {
+  "update", "clear", "repeat", "random", "add", "load", "play"
+};
 
-      mpd_freeStatus(status);
+#define SETUP_NOT_RUN -2  // result of a command mpd never reached
 
-      if (result == RESULT_SUCCESS) {
-	logprint("No update is running.");
-	return result;
+void mpd_send_setup(mpdhotplug_state *state, setup_t command)
+{
+  mpd_Connection *connection = state->mpd_connection;
+  switch (command) {
+  case SETUP_UPDATE:  mpd_sendUpdateCommand(connection, state->library_uri); break;
+  case SETUP_CLEAR:   mpd_sendClearCommand(connection); break;
+  case SETUP_REPEAT:  mpd_sendRepeatCommand(connection, 1); break;
+  case SETUP_RANDOM:  mpd_sendRandomCommand(connection, 1); break;
+  case SETUP_ADD_ALL: mpd_sendAddCommand(connection, state->library_uri); break;
+  case SETUP_LOAD_STARTER: mpd_sendLoadCommand(connection, STARTER_PLAYLIST); break;
+  case SETUP_PLAY:    mpd_sendPlayCommand(connection, MPD_PLAY_AT_BEGINNING); break;
+  }
+}
+
+// Send a batch and fill in results[i] for commands[i]: 0 if it
+// succeeded, the MPD_ACK_ERROR_* code if it was refused, SETUP_NOT_RUN
+// if mpd stopped before it.  Returns RESULT_FAILURE if the connection
+// itself failed.
+result_t mpd_send_setup_batch(mpdhotplug_state *state,
+			      const setup_t *commands, int count, int *results)
+{
+  mpd_Connection *connection = state->mpd_connection;
+  int i;
+
+  mpd_sendCommandListOkBegin(connection);
+  for (i = 0; i < count; i++) {
+    mpd_send_setup(state, commands[i]);
+  }
+  mpd_sendCommandListEnd(connection);
+
+  for (i = 0; i < count; i++) {
+    results[i] = SETUP_NOT_RUN;
+  }
+  for (i = 0; i < count && !connection->error; i++) {
+    if (commands[i] == SETUP_UPDATE) {
+      state->update_id = mpd_getUpdateId(connection);
+    }
+    mpd_nextListOkCommand(connection);
+    if (!connection->error) {
+      results[i] = 0;
+    }
+  }
+  mpd_finishCommand(connection);
+
+  if (connection->error == MPD_ERROR_ACK) {
+    int at = connection->errorAt;
+    if (at >= 0 && at < count) {
+      results[at] = connection->errorCode;
+    }
+    // a scan that is already running will do just as well
+    if (at >= 0 && at < count && commands[at] == SETUP_UPDATE &&
+	connection->errorCode == MPD_ACK_ERROR_UPDATE_ALREADY) {
+      results[at] = 0;
+    }
+    mpd_log_error(state);
+  } else if (connection->error) {
+    return RESULT_FAILURE;
+  }
+  return RESULT_SUCCESS;
+}
+
+result_t mpd_setup(mpdhotplug_state *state, const setup_t *commands, int count)
+{
+  int attempts = 10;
+  int delay = 250;
+  setup_t pending[count];
+  int results[count];
+  int npending = count;
+  int i;
+
+  memcpy(pending, commands, sizeof(pending));
+  while (attempts-- > 0) {
+
+    if (mpd_connect(state) == RESULT_SUCCESS) {
+      if (mpd_send_setup_batch(state, pending, npending, results) == RESULT_FAILURE) {
+	mpd_log_error(state);
+	mpd_disconnect(state);
+      } else {
+	int failed = 0;
+	for (i = 0; i < npending; i++) {
+	  if (results[i] == SETUP_NOT_RUN) {
+	    logprint("%s not run", setup_names[pending[i]]);
+	  } else if (results[i]) {
+	    logprint("%s failed with error %d", setup_names[pending[i]], results[i]);
+	  }
+	  if (results[i]) {
+	    pending[failed++] = pending[i];
+	  }
+	}
+	npending = failed;
+	if (npending == 0) {
+	  return RESULT_SUCCESS;
+	}
       }
     }
+    ms_sleep(delay);
+  }
+  return RESULT_FAILURE;
+}
+
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// Returns the id of the update job mpd is running, 0 if none, or -1 if
+// the status could not be read.
+int mpd_updating(mpdhotplug_state *state)
+{
+  int updating = -1;
+  mpd_sendStatusCommand(state->mpd_connection);
+  mpd_Status *status = mpd_getStatus(state->mpd_connection);
+  if (status) {
+    updating = status->updatingDb;
+    mpd_freeStatus(status);
+  }
+  mpd_finishCommand(state->mpd_connection);
+  if (mpd_log_error(state)) {
+    return -1;
+  }
+  return updating;
+}
+
+// Sit out an idle until mpd answers or the deadline passes, unless
+// events arrive that make waiting pointless.
+result_t mpd_idle_wait(mpdhotplug_state *state, long long deadline)
+{
+  struct pollfd pfd[2];
+  pfd[0].fd = state->mpd_connection->sock;
+  pfd[0].events = POLLIN;
+  pfd[1].events = POLLIN;
+  while (1) {
+    long long remaining = deadline - now_ms();
+    if (remaining <= 0) {
+      return RESULT_SUCCESS;  // the read will time out
+    }
+    pfd[1].fd = hotplug_cancel_fd(state);
+    pfd[0].revents = pfd[1].revents = 0;
+    if (poll(pfd, 2, remaining) < 0 && errno != EINTR) {
+      return RESULT_SUCCESS;
+    }
+    if (pfd[0].revents) {
+      return RESULT_SUCCESS;
+    }
+    if (pfd[1].revents && hotplug_superseded(state)) {
+      return RESULT_FAILURE;
+    }
+  }
+}
+
+// Wait for our update job to finish.  Between status checks we sit in
+// "idle database update", so we hear about the end of the scan the
+// moment mpd announces it.  mpd remembers changes made while we
+// weren't idling, so one that lands between the status and the idle
+// just makes the idle return straight away.
+result_t mpd_wait_for_update(mpdhotplug_state *state)
+{
+  long long deadline = now_ms() + 200 * 1000;
+
+  while (now_ms() < deadline) {
+    if (mpd_connect(state) == RESULT_FAILURE) {
+      return RESULT_FAILURE;
+    }
+
+    int updating = mpd_updating(state);
+    if (updating < 0) {
+      mpd_disconnect(state);
+      ms_sleep(250);
+      continue;
+    }
+    // ids are handed out in order, so anything later than ours means
+    // ours is done; without an id, wait for all of them
+    if (updating == 0 || (state->update_id > 0 && updating > state->update_id)) {
+      logprint("Update %d is finished", state->update_id);
+      return RESULT_SUCCESS;
+    }
+
+    logprint("Update %d is running, waiting", updating);
+    mpd_setConnectionTimeout(state->mpd_connection,
+			     (deadline - now_ms()) / 1000.0);
+    mpd_sendIdleCommand(state->mpd_connection, "database update");
+    int superseded = RESULT_FAILURE == mpd_idle_wait(state, deadline);
+    if (superseded) {
+      mpd_sendNoIdleCommand(state->mpd_connection);
+    }
+    char *event;
+    while ((event = mpd_getNextEvent(state->mpd_connection))) {
+      logprint("%s changed", event);
+      free(event);
+    }
+    if (mpd_log_error(state)) {
+      // a timed out idle leaves the connection out of step
+      mpd_disconnect(state);
+    } else {
+      mpd_setConnectionTimeout(state->mpd_connection, state->mpd_timeout);
+    }
+    if (superseded) {
+      logprint("No longer waiting for update");
+      return RESULT_FAILURE;
+    }
   } 
   return RESULT_FAILURE;
 }
@@ -393,129 +1708,784 @@ pid_t pid_read(char *filename)
   return pid;
 }
 
-result_t pid_kill(pid_t pid, int signal)
+// The old daemon is stopped with a pidfd, which polls readable the
+// moment the process exits, so we wait exactly as long as its shutdown
+// takes.  Each step of state->stop_timeline is when the next signal is
+// sent if the process is still there, the last is when we give up; a
+// first step above 0 gives a daemon that is already on its way out
+// that long before it is signalled.  Kernels before 5.3 have no pidfds; there
+// we check on the process every STOP_POLL_INTERVAL instead.
+#ifndef __NR_pidfd_open
+#define __NR_pidfd_open 434  // the same on every architecture
+#endif
+#define STOP_POLL_INTERVAL 10 // ms
+
+const int stop_signals[] = { SIGINT, SIGTERM, SIGKILL };
+
+// Wait until deadline for the process to exit.
+result_t pid_wait(pid_t pid, int pidfd, long long deadline)
 {
-  int attempts = 4;
-  int delay = 500; // ms
-  while (attempts-- > 0) {
-    logprint("Sending signal %d to process %d",signal,pid);
-    if (-1 == kill(pid, signal) && errno == ESRCH) {
-      logprint("Process %d has exited",signal,pid);
-      return RESULT_SUCCESS;  // gone
+  while (1) {
+    long long remaining = deadline - now_ms();
+    if (remaining < 0) remaining = 0;
+    if (pidfd >= 0) {
+      struct pollfd pfd;
+      pfd.fd = pidfd;
+      pfd.events = POLLIN;
+      int ready = poll(&pfd, 1, remaining);
+      if (ready > 0) {
+	return RESULT_SUCCESS;
+      }
+      if (ready < 0 && errno != EINTR) {
+	logprint("Error %d waiting for process %d", errno, pid);
+	return RESULT_FAILURE;
+      }
+    } else {
+      if (kill(pid, 0) == -1 && errno == ESRCH) {
+	return RESULT_SUCCESS;
+      }
+      ms_sleep(remaining < STOP_POLL_INTERVAL ? remaining : STOP_POLL_INTERVAL);
     }
-    if (errno != 0) {
-      logprint("Error %d killing daemon",errno);
+    if (remaining == 0) {
+      return RESULT_FAILURE;
     }
-    ms_sleep(delay);
   }
-  logprint("Process %d refused to die",signal,pid);
-  return RESULT_FAILURE;
 }
 
-
-// argv will contain a string like this:
-//   add /devices/platform/stmp3xxx-usb/fsl-ehci/usb1/1-1/1-1.3/1-1.3:1.0/host4/target4:0:0/4:0:0:0/block/sda/sda1
-// and we return the last component formatted like this:
-//   /media/sda1
-char *mount_name(const char *devname)
+// Set the timeline from a string like "0,5000,8000,10000", which must
+// not go backwards.  Left alone if the string is no good.
+result_t stop_timeline_parse(mpdhotplug_state *state, const char *spec)
 {
-  const char *p = devname + strlen(devname);
-  while (p > devname && p[-1]!='/') p--;
-  int plen = strlen(p);
-  char *mount = (char*)malloc(plen + 8);  // '/media/+<p>+\0
-  sprintf(mount, "/media/%s", p);
-  return mount;
+  unsigned timeline[G_N_ELEMENTS(state->stop_timeline)];
+  const char *p = spec;
+  int i;
+  for (i = 0; i < G_N_ELEMENTS(timeline); i++) {
+    char *end;
+    errno = 0;
+    unsigned long ms = strtoul(p, &end, 10);
+    if (end == p || errno || ms > 3600 * 1000 ||
+	(i > 0 && ms < timeline[i-1]) ||
+	*end != (i + 1 < G_N_ELEMENTS(timeline) ? ',' : 0)) {
+      logprint("Bad stop timeline \"%s\"", spec);
+      return RESULT_FAILURE;
+    }
+    timeline[i] = ms;
+    p = end + 1;
+  }
+  memcpy(state->stop_timeline, timeline, sizeof(timeline));
+  return RESULT_SUCCESS;
 }
 
-result_t mount_wait(const char *mount)
+result_t pid_stop(mpdhotplug_state *state, pid_t pid)
 {
-  int attempts = 200;
-  int timeout = 1000; // ms
-  int mountlen = strlen(mount);
+  long long start = now_ms();
+  result_t result = RESULT_FAILURE;
+  int step;
 
-  while (attempts-- > 0) {
-    // looking for this line: /dev/sda1 /media/sda1 vfat rw,relatime,fmask=0022,dmask=0022,codepage=cp437,iocharset=iso8859-1 0 0
-    FILE *file = fopen("/proc/mounts","r");
-    int bufsize = 8096;
-    char buf[bufsize];
-    if (file) {
-      while (fgets(buf, bufsize, file)) {
-	// find the 2nd word which is the mount point
-	char *p0 = buf;  // p0 is start of 2nd word
-	while (*p0 && *p0!=' ') p0++;
-	if (*p0) p0++;
-	char *p1 = p0+1; // p1 is char after 2nd word
-	while (*p1 && *p1!=' ') p1++;
-	// printf("%s:%d\n", p0,p1-p0);
-	if (p1-p0==mountlen && !strncmp(mount, p0, mountlen)) {
-	  return RESULT_SUCCESS;
-	}
+  int pidfd = syscall(__NR_pidfd_open, pid, 0);
+  if (pidfd < 0 && errno == ESRCH) {
+    logprint("Process %d has exited", pid);
+    return RESULT_SUCCESS;
+  }
+  for (step = 0; step < G_N_ELEMENTS(state->stop_timeline); step++) {
+    if (RESULT_SUCCESS == pid_wait(pid, pidfd, start + state->stop_timeline[step])) {
+      result = RESULT_SUCCESS;
+      break;
+    }
+    if (step == G_N_ELEMENTS(stop_signals)) {
+      break;  // out of signals
+    }
+    logprint("Sending signal %d to process %d", stop_signals[step], pid);
+    if (-1 == kill(pid, stop_signals[step])) {
+      if (errno == ESRCH) {
+	result = RESULT_SUCCESS;  // gone
+	break;
       }
-      fclose(file);
-    } else {
-      error("Could not open /proc/mounts");
+      logprint("Error %d killing daemon", errno);
+    }
+  }
+  if (pidfd >= 0) close(pidfd);
+  if (result == RESULT_SUCCESS) {
+    logprint("Process %d has exited after %lld ms", pid, now_ms() - start);
+  } else {
+    logprint("Process %d refused to die", pid);
+  }
+  return result;
+}
+
+
+result_t mount_wait(mpdhotplug_state *state, const char *mount)
+{
+  long long deadline = now_ms() + 200 * 1000;
+
+  if (!state->mounts) {
+    state->mounts = mount_watch_open(state->mountinfo_file);
+    if (!state->mounts) {
+      return RESULT_FAILURE;  // tried again with the next event
+    }
+  } else if (RESULT_FAILURE == mount_watch_wait(state->mounts, -1, 0)) {
+    // the watch stays open between events, so pick up any change
+    // that was signalled while we were busy with something else
+    return RESULT_FAILURE;
+  }
+
+  while (1) {
+    const mount_entry *entry = mount_lookup(state->mounts, mount);
+    if (entry) {
+      logprint("%s is mounted from %s (%s)", mount, entry->source, entry->fstype);
+      return RESULT_SUCCESS;
+    }
+    long long remaining = deadline - now_ms();
+    if (remaining <= 0 ||
+	RESULT_FAILURE == mount_watch_wait(state->mounts,
+					   hotplug_cancel_fd(state),
+					   remaining)) {
+      return RESULT_FAILURE;
+    }
+    if (hotplug_superseded(state)) {
+      logprint("%s is no longer wanted", mount);
+      return RESULT_FAILURE;
     }
-    ms_sleep(timeout);
   }
-  return RESULT_FAILURE;
 }
 /*----------------------------------------------------------------------
   
   ----------------------------------------------------------------------*/
-int main(int argc, char **argv) 
+// In resident mode a single daemon stays up for good and devices come
+// and go through its storage "mount" and "unmount" commands, so a plug
+// costs neither a daemon start nor reopening the audio device.  Each
+// device appears in mpd's database as a directory named after its
+// partition, eg "sda1", with the simple database plugin keeping a
+// database per device in its cache directory.
+
+// Start the resident daemon unless it is already answering.
+result_t resident_start(mpdhotplug_state *state)
 {
-  mode_t mode = MODE_NONE;
+  if (state->mpd_connection || RESULT_SUCCESS == mpd_probe(state)) {
+    return RESULT_SUCCESS;
+  }
+  logprint("Starting resident daemon");
+  if (RESULT_FAILURE == mpd_write_conf(state, state->music_root) ||
+      RESULT_FAILURE == mpd_start(state) ||
+      RESULT_FAILURE == mpd_wait_ready(state, 10000)) {
+    logprint("Failure starting daemon process");
+    return RESULT_FAILURE;
+  }
+  return RESULT_SUCCESS;
+}
 
-  if (argc != 3) {
-    usage(argv[0]);
+// the name a device is mounted under inside mpd
+const char *resident_name(const char *mount)
+{
+  const char *name = strrchr(mount, '/');
+  return name ? name + 1 : mount;
+}
+
+// Attach a mounted device to the resident daemon.  restored is set to
+// RESULT_SUCCESS if mpd had a database for it, otherwise mpd is now
+// scanning it.
+result_t resident_mount(mpdhotplug_state *state, const char *mount, result_t *restored)
+{
+  if (RESULT_FAILURE == resident_start(state) ||
+      RESULT_FAILURE == mpd_connect(state)) {
+    return RESULT_FAILURE;
   }
+  mpd_Connection *connection = state->mpd_connection;
+  const char *name = resident_name(mount);
+  char *uri = g_strconcat("file://", mount, NULL);
 
-  if (!strcmp(argv[1],"add")) {
-    mode = MODE_ADD;
-  } else if (!strcmp(argv[1],"remove")) {
-    mode = MODE_REMOVE;
-  } else {
-    usage(argv[0]);
+  // a device pulled while we weren't listening is still mounted; it is
+  // fine for this to fail
+  mpd_sendUnmountCommand(connection, name);
+  mpd_finishCommand(connection);
+  mpd_clearError(connection);
+
+  logprint("Mounting %s as %s", uri, name);
+  mpd_sendMountCommand(connection, name, uri);
+  mpd_finishCommand(connection);
+  g_free(uri);
+  if (mpd_log_error(state)) {
+    return RESULT_FAILURE;
   }
+  free(state->library_uri);
+  state->library_uri = strdup(name);
 
-  mpdhotplug_state *state;
-  state = state_alloc();
+  // mpd queues an update of the mount before it answers if there was
+  // nothing in its cache; we don't know the job's id, so wait for all
+  int updating = mpd_updating(state);
+  state->update_id = 0;
+  *restored = updating == 0 ? RESULT_SUCCESS : RESULT_FAILURE;
+  return RESULT_SUCCESS;
+}
+
+// Detach a removed device, emptying the queue if it was playing.
+result_t resident_unmount(mpdhotplug_state *state, const char *devpath)
+{
+  char *mount = mount_name(devpath);
+  const char *name = resident_name(mount);
+  if (RESULT_FAILURE == mpd_connect(state)) {
+    free(mount);
+    return RESULT_FAILURE;
+  }
+  mpd_Connection *connection = state->mpd_connection;
+  logprint("Unmounting %s", name);
+  mpd_sendCommandListBegin(connection);
+  if (!strcmp(state->library_uri, name)) {
+    mpd_sendClearCommand(connection);
+    free(state->library_uri);
+    state->library_uri = strdup("");
+  }
+  mpd_sendUnmountCommand(connection, name);
+  mpd_sendCommandListEnd(connection);
+  mpd_finishCommand(connection);
+  free(mount);
+  return mpd_log_error(state);
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// "add" needs the finished database, so a session is set up in two
+// round trips either side of the scan
+const setup_t session_start[] = {
+  SETUP_UPDATE, SETUP_CLEAR, SETUP_REPEAT, SETUP_RANDOM
+};
+const setup_t session_play[] = {
+  SETUP_ADD_ALL, SETUP_PLAY
+};
+// with a database from the device it's all one round trip
+const setup_t session_resume[] = {
+  SETUP_CLEAR, SETUP_REPEAT, SETUP_RANDOM, SETUP_ADD_ALL, SETUP_PLAY
+};
+// a mounted device is already being scanned
+const setup_t session_prepare[] = {
+  SETUP_CLEAR, SETUP_REPEAT, SETUP_RANDOM
+};
+// a mounted device with a cached database is played straight away
+// while mpd checks it for changes
+const setup_t session_refresh[] = {
+  SETUP_UPDATE, SETUP_CLEAR, SETUP_REPEAT, SETUP_RANDOM, SETUP_ADD_ALL, SETUP_PLAY
+};
+// play what the scanner found while mpd scans
+const setup_t session_starter[] = {
+  SETUP_LOAD_STARTER, SETUP_PLAY
+};
+
+// Swap the starter playlist for the whole library without interrupting
+// the song that is playing: drop the starter songs around it and
+// append everything.
+result_t mpd_play_library(mpdhotplug_state *state)
+{
+  if (mpd_connect(state) == RESULT_FAILURE) {
+    return RESULT_FAILURE;
+  }
+  mpd_Connection *connection = state->mpd_connection;
+  mpd_sendStatusCommand(connection);
+  mpd_Status *status = mpd_getStatus(connection);
+  mpd_finishCommand(connection);
+  mpd_log_error(state);
+  if (!status || status->state == MPD_STATUS_STATE_STOP) {
+    if (status) mpd_freeStatus(status);
+    return mpd_setup(state, session_resume, G_N_ELEMENTS(session_resume));
+  }
+
+  mpd_sendCommandListBegin(connection);
+  if (status->song + 1 < status->playlistLength) {
+    mpd_sendDeleteRangeCommand(connection, status->song + 1, status->playlistLength);
+  }
+  if (status->song > 0) {
+    mpd_sendDeleteRangeCommand(connection, 0, status->song);
+  }
+  mpd_sendAddCommand(connection, state->library_uri);
+  mpd_sendCommandListEnd(connection);
+  mpd_finishCommand(connection);
+  mpd_freeStatus(status);
+  return mpd_log_error(state);
+}
 
+result_t hotplug_add(mpdhotplug_state *state, const char *devpath)
+{
+  scanner *scan = NULL;
+  // determine which file system was added
+  char *mount = mount_name(devpath);
+  logprint("Waiting for %s to be mounted", mount);
+  if (RESULT_FAILURE == mount_wait(state, mount)) {
+    logprint("Gave up waiting for %s to be mounted", mount);
+    free(mount);
+    return RESULT_FAILURE;
+  }
+
+  result_t restored;
+  if (state->resident) {
+    if (RESULT_FAILURE == resident_mount(state, mount, &restored)) {
+      logprint("Failure mounting %s", mount);
+      free(mount);
+      return RESULT_FAILURE;
+    }
+    if (restored == RESULT_FAILURE) {
+      scan = scanner_start(mount, STARTER_SIZE);
+    }
+  } else {
+    logprint("Generating config file");
+    // generate mpd config file
+    if (RESULT_FAILURE == mpd_write_conf(state, mount)) {
+      free(mount);
+      return RESULT_FAILURE;
+    }
+    restored = db_restore(state, mount);
+    if (restored == RESULT_FAILURE) {
+      // look for something to play while mpd starts up
+      scan = scanner_start(mount, STARTER_SIZE);
+    }
+    // restart the daemon
+    if (RESULT_FAILURE == mpd_start(state) ||
+	RESULT_FAILURE == mpd_wait_ready(state, 10000)) {
+      logprint("Failure starting daemon process");
+      if (scan) scan_files_free(scanner_finish(scan));
+      free(mount);
+      return RESULT_FAILURE;
+    }
+  }
+  if (restored == RESULT_SUCCESS) {
+    // the device's database is current, play straight away
+    logprint("Starting music");
+    if (state->resident) {
+      mpd_setup(state, session_refresh, G_N_ELEMENTS(session_refresh)) && logprint("error playing");
+    } else {
+      mpd_setup(state, session_resume, G_N_ELEMENTS(session_resume)) && logprint("error playing");
+    }
+    free(mount);
+    return RESULT_SUCCESS;
+  }
+  // connect and rescan
+  logprint("Starting update");
+  if (state->resident) {
+    mpd_setup(state, session_prepare, G_N_ELEMENTS(session_prepare)) && logprint("error starting update");
+  } else {
+    mpd_setup(state, session_start, G_N_ELEMENTS(session_start)) && logprint("error starting update");
+  }
+  GPtrArray *files = scanner_finish(scan);
+  int starter = files->len > 0 && starter_write(state, files) == RESULT_SUCCESS;
+  if (starter) {
+    logprint("Playing %d files while the update runs", files->len);
+    mpd_setup(state, session_starter, G_N_ELEMENTS(session_starter)) && logprint("error playing");
+  }
+  scan_files_free(files);
+  logprint("Waiting for update to complete");
+  if (mpd_wait_for_update(state) == RESULT_SUCCESS) {
+    // a resident daemon keeps its own copy in the cache directory
+    if (!state->resident) db_save(state, mount);
+  } else if (hotplug_superseded(state)) {
+    // whatever comes next will replace this session anyway
+    free(mount);
+    return RESULT_SUCCESS;
+  } else {
+    logprint("error waiting for update");
+  }
+  logprint("Starting music");
+  if (starter) {
+    mpd_play_library(state) && logprint("error playing");
+  } else {
+    mpd_setup(state, session_play, G_N_ELEMENTS(session_play)) && logprint("error playing");
+  }
+  free(mount);
+  return RESULT_SUCCESS;
+}
+
+result_t hotplug_event(mpdhotplug_state *state, mode_t mode, const char *devpath)
+{
   // create working directory if necessary
-  make_dir(state->config_dir, 0777);
+  if (RESULT_FAILURE == make_dir(state->config_dir, 0777)) {
+    return RESULT_FAILURE;
+  }
+
+  // keep track of which device we are playing
+  char *mount = mount_name(devpath);
+  if (mode == MODE_ADD) {
+    free(state->active_mount);
+    state->active_mount = mount;
+  } else if (!state->active_mount || !strcmp(mount, state->active_mount)) {
+    free(state->active_mount);
+    state->active_mount = NULL;
+    free(mount);
+  } else if (!state->resident) {
+    logprint("%s is not playing, nothing to do", mount);
+    free(mount);
+    return RESULT_SUCCESS;
+  } else {
+    free(mount);
+  }
+
+  if (state->resident) {
+    if (mode == MODE_ADD) {
+      return hotplug_add(state, devpath);
+    }
+    return resident_unmount(state, devpath);
+  }
+
+  // any connection we are holding belongs to the daemon we are about to stop
+  mpd_disconnect(state);
 
   // if process is running, signal it and wait for it to exit
   logprint("Killing old daemon if there is one...");
   int pid = pid_read(state->pid_file);
   if (pid>0) {
-    pid_kill(pid, SIGINT);
+    pid_stop(state, pid);
   }
 
   if (mode == MODE_ADD) {
-    // determine which file system was added
-    // argv = binname action device
-    char *mount = mount_name(argv[2]);
-    //mount = "/dev/shm";  // HACK REMOVE ME
-    logprint("Waiting for %s to be mounted", mount);
-    if (RESULT_FAILURE == mount_wait(mount)) {
-      error("Timeout waiting for %s to be mounted", mount);
+    return hotplug_add(state, devpath);
+  }
+  return RESULT_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// With one daemon per device, each device gets its own instance: a
+// state whose config dir, pid file, socket, state file and port are its
+// own, and a thread that works through the device's events in order.
+// Different devices are handled side by side.  The registry maps mount
+// names to instances; an instance retires once its device is removed
+// and nothing more has arrived for it.
+typedef struct instance
+{
+  struct registry *registry;
+  char *mount;
+  mpdhotplug_state *state;
+  pthread_t thread;
+  int wake[2];    // pipe written to as events are queued
+} instance;
+
+typedef struct registry
+{
+  pthread_mutex_t lock;
+  GHashTable *instances;  // mount name -> instance
+  GSList *retired;        // instances whose threads are finishing
+  char *config_dir;       // each instance gets a dir in here
+} registry;
+
+void instance_free(instance *inst)
+{
+  pending_event *event;
+  while ((event = (pending_event *)g_async_queue_try_pop(inst->state->inbox))) {
+    pending_event_free(event);
+  }
+  g_async_queue_unref(inst->state->inbox);
+  state_free(inst->state);
+  if (inst->wake[0] >= 0) close(inst->wake[0]);
+  if (inst->wake[1] >= 0) close(inst->wake[1]);
+  free(inst->mount);
+  g_slice_free(instance, inst);
+}
+
+void *instance_run(void *arg)
+{
+  instance *inst = (instance *)arg;
+  registry *reg = inst->registry;
+
+  while (1) {
+    pending_event *event = (pending_event *)g_async_queue_pop(inst->state->inbox);
+    mode_t mode = event->mode;
+    if (mode != MODE_NONE) {
+      hotplug_event(inst->state, mode, event->devpath) &&
+	logprint("error handling event for %s", event->devpath);
+    }
+    pending_event_free(event);
+    if (mode == MODE_NONE) {
+      return NULL;  // shutting down, registry_free() joins us
+    }
+    if (mode == MODE_REMOVE) {
+      pthread_mutex_lock(&reg->lock);
+      if (g_async_queue_length(inst->state->inbox) == 0) {
+	g_hash_table_steal(reg->instances, inst->mount);
+	reg->retired = g_slist_prepend(reg->retired, inst);
+	pthread_mutex_unlock(&reg->lock);
+	logprint("Instance for %s retired", inst->mount);
+	return NULL;
+      }
+      pthread_mutex_unlock(&reg->lock);
     }
+  }
+}
 
-    logprint("Generating config file");
-    // generate mpd config file
-    mpd_write_conf(state, mount);
-    // restart the daemon
-    if (RESULT_FAILURE == mpd_start(state)) {
-      error("Failure starting daemon process");
-    }
-    ms_sleep(1500);  // give it some time to start
-    // connect, rescan and reload
-    logprint("Starting update");
-    mpd_start_update(state) && logprint("error starting update");
-    logprint("Waiting for update to complete");
-    mpd_wait_for_update(state) && logprint("error waiting for update");
-    logprint("Starting music");
-    mpd_play(state) && logprint("error playing");
+gboolean instance_uses_port(gpointer key, gpointer value, gpointer data)
+{
+  return ((instance *)value)->state->mpd_port == *(unsigned *)data;
+}
+
+// The first port from 6600 up that no instance has and nobody else is
+// listening on.  Called with the registry locked.
+unsigned registry_port(registry *reg)
+{
+  unsigned port;
+  for (port = 6600; port < 6700; port++) {
+    if (g_hash_table_find(reg->instances, instance_uses_port, &port)) {
+      continue;
+    }
+    struct sockaddr_in addr;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    int taken = fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (fd >= 0) close(fd);
+    if (!taken) {
+      return port;
+    }
+  }
+  return 0;
+}
+
+// Called with the registry locked.  Returns NULL if there is no free
+// port or the instance's thread could not be started.
+instance *instance_new(registry *reg, const mpdhotplug_state *base, const char *mount)
+{
+  instance *inst = g_slice_new0(instance);
+  const char *name = strrchr(mount, '/');
+  char *config_dir = path_join_alloc(reg->config_dir, name ? name + 1 : mount);
+
+  inst->registry = reg;
+  inst->mount = strdup(mount);
+  inst->wake[0] = inst->wake[1] = -1;
+  inst->state = state_alloc();
+  state_config_dir(inst->state, config_dir);
+  free(config_dir);
+  inst->state->device_db = base->device_db;
+  inst->state->mpd_bin = base->mpd_bin;
+  inst->state->mpd_timeout = base->mpd_timeout;
+  memcpy(inst->state->stop_timeline, base->stop_timeline,
+	 sizeof(base->stop_timeline));
+  inst->state->mountinfo_file = base->mountinfo_file;
+  inst->state->mpd_port = registry_port(reg);
+  inst->state->inbox = g_async_queue_new();
+  if (!inst->state->mpd_port) {
+    logprint("No free port for %s", mount);
+    instance_free(inst);
+    return NULL;
+  }
+  if (pipe(inst->wake)) {
+    logprint("Could not create pipe for %s: error %d", mount, errno);
+    instance_free(inst);
+    return NULL;
+  }
+  fcntl(inst->wake[0], F_SETFL, O_NONBLOCK);
+  fcntl(inst->wake[1], F_SETFL, O_NONBLOCK);
+  fcntl(inst->wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(inst->wake[1], F_SETFD, FD_CLOEXEC);
+  inst->state->wake_fd = inst->wake[0];
+
+  int err = pthread_create(&inst->thread, NULL, instance_run, inst);
+  if (err) {
+    logprint("Could not start thread for %s: error %d", mount, err);
+    instance_free(inst);
+    return NULL;
+  }
+  logprint("Instance for %s in %s on port %u",
+	   mount, inst->state->config_dir, inst->state->mpd_port);
+  g_hash_table_insert(reg->instances, inst->mount, inst);
+  return inst;
+}
+
+registry *registry_new(const char *config_dir)
+{
+  registry *reg = g_slice_new0(registry);
+  pthread_mutex_init(&reg->lock, NULL);
+  reg->instances = g_hash_table_new(g_str_hash, g_str_equal);
+  reg->config_dir = strdup(config_dir);
+  if (RESULT_FAILURE == make_dir(reg->config_dir, 0777)) {
+    error("Could not create %s", reg->config_dir);
+  }
+  return reg;
+}
+
+// join and free the instances that have retired
+void registry_reap(registry *reg)
+{
+  pthread_mutex_lock(&reg->lock);
+  GSList *retired = reg->retired;
+  reg->retired = NULL;
+  pthread_mutex_unlock(&reg->lock);
+
+  GSList *item;
+  for (item = retired; item; item = item->next) {
+    instance *inst = (instance *)item->data;
+    pthread_join(inst->thread, NULL);
+    instance_free(inst);
+  }
+  g_slist_free(retired);
+}
+
+// Hand an event to its device's instance, starting one if need be.
+void registry_dispatch(registry *reg, const mpdhotplug_state *base, pending_event *event)
+{
+  registry_reap(reg);
+  pthread_mutex_lock(&reg->lock);
+  instance *inst = (instance *)g_hash_table_lookup(reg->instances, event->mount);
+  if (!inst) {
+    inst = instance_new(reg, base, event->mount);
+  }
+  if (!inst) {
+    logprint("Dropping %s event for %s", event->mode == MODE_ADD ?
+	     "add" : "remove", event->mount);
+    pthread_mutex_unlock(&reg->lock);
+    pending_event_free(event);
+    return;
+  }
+  g_async_queue_push(inst->state->inbox, event);
+  write(inst->wake[1], "", 1);
+  pthread_mutex_unlock(&reg->lock);
+}
+
+void instance_stop(gpointer key, gpointer value, gpointer data)
+{
+  instance *inst = (instance *)value;
+  GSList **live = (GSList **)data;
+  *live = g_slist_prepend(*live, inst);
+  pending_event *event = g_slice_new0(pending_event);
+  event->mode = MODE_NONE;
+  g_async_queue_push(inst->state->inbox, event);
+  write(inst->wake[1], "", 1);
+}
+
+// Stop every instance's thread and free the registry.  The daemons
+// themselves are left playing.
+void registry_free(registry *reg)
+{
+  GSList *live = NULL;
+  pthread_mutex_lock(&reg->lock);
+  g_hash_table_foreach(reg->instances, instance_stop, &live);
+  g_hash_table_remove_all(reg->instances);
+  pthread_mutex_unlock(&reg->lock);
+
+  GSList *item;
+  for (item = live; item; item = item->next) {
+    instance *inst = (instance *)item->data;
+    pthread_join(inst->thread, NULL);
+    instance_free(inst);
+  }
+  g_slist_free(live);
+  registry_reap(reg);
+  g_hash_table_destroy(reg->instances);
+  pthread_mutex_destroy(&reg->lock);
+  free(reg->config_dir);
+  g_slice_free(registry, reg);
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+// Dispatch block device uevents read from fd until it is closed.  fd is
+// normally from uevent_open(), but one end of a SOCK_SEQPACKET
+// socketpair carrying the same packets will do, and ends the loop when
+// the other end is closed.
+result_t uevent_loop(mpdhotplug_state *state, int fd)
+{
+  result_t result = RESULT_SUCCESS;
+  state->events = event_queue_new(fd);
+
+  while (1) {
+    pending_event *event;
+    int timeout_ms;
+    while ((event = event_queue_next(state->events, &timeout_ms))) {
+      if (state->instances) {
+	registry_dispatch(state->instances, state, event);
+	continue;
+      }
+      hotplug_event(state, event->mode, event->devpath) &&
+	logprint("error handling event for %s", event->devpath);
+      pending_event_free(event);
+    }
+    if (state->events->closed) {
+      break;
+    }
+    if (RESULT_FAILURE == event_queue_read(state->events, timeout_ms)) {
+      result = RESULT_FAILURE;
+      break;
+    }
+  }
+  logprint("Handled %u of %u uevents",
+	   state->events->dispatched, state->events->received);
+  event_queue_free(state->events);
+  state->events = NULL;
+  return result;
+}
+
+/*----------------------------------------------------------------------
+  
+  ----------------------------------------------------------------------*/
+int main(int argc, char **argv) 
+{
+  mode_t mode = MODE_NONE;
+
+  int resident = 0;
+  int multi = 0;
+
+  if (argc == 2 && !strcmp(argv[1],"daemon")) {
+    mode = MODE_DAEMON;
+  } else if (argc == 2 && !strcmp(argv[1],"resident")) {
+    mode = MODE_DAEMON;
+    resident = 1;
+  } else if (argc == 2 && !strcmp(argv[1],"multi")) {
+    mode = MODE_DAEMON;
+    multi = 1;
+  } else if (argc != 3) {
+    usage(argv[0]);
+  } else if (!strcmp(argv[1],"add")) {
+    mode = MODE_ADD;
+  } else if (!strcmp(argv[1],"remove")) {
+    mode = MODE_REMOVE;
+  } else {
+    usage(argv[0]);
+  }
+
+  mpdhotplug_state *state;
+  state = state_alloc();
+  state->resident = resident;
+  // ms until SIGINT, SIGTERM, SIGKILL and giving up on the old daemon
+  const char *timeline = getenv("MPDHOTPLUG_STOP_TIMELINE");
+  if (timeline && RESULT_FAILURE == stop_timeline_parse(state, timeline)) {
+    error("MPDHOTPLUG_STOP_TIMELINE must be 4 rising times in ms, eg 0,5000,8000,10000");
+  }
+
+  if (mode == MODE_DAEMON) {
+    int fd = uevent_open();
+    if (fd < 0) {
+      error("Could not listen for uevents");
+    }
+    if (state->resident) {
+      // get the daemon going before anything is plugged in
+      resident_start(state) && logprint("error starting resident daemon");
+    }
+    if (multi) {
+#if !GLIB_CHECK_VERSION(2,32,0)
+      g_thread_init(NULL);
+#endif
+      state->instances = registry_new(state->config_dir);
+    }
+    logprint("Listening for uevents");
+    uevent_loop(state, fd);
+    if (state->instances) {
+      registry_free(state->instances);
+      state->instances = NULL;
+    }
+    close(fd);
+  } else {
+    // udev runs us for each event as it comes, so take turns
+    if (RESULT_FAILURE == make_dir(state->config_dir, 0777)) {
+      error("Could not create %s", state->config_dir);
+    }
+    char *lock_file = path_join_alloc(state->config_dir, "mpd.lock");
+    int lock = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (lock < 0 || flock(lock, LOCK_EX)) {
+      error("Could not lock %s", lock_file);
+    }
+    if (RESULT_FAILURE == hotplug_event(state, mode, argv[2])) {
+      error("Failed to handle %s event for %s", argv[1], argv[2]);
+    }
+    close(lock);
+    free(lock_file);
   }
   
   // cleanup
@@ -523,4 +2493,3 @@ int main(int argc, char **argv)
 
   return 0;
 }
-
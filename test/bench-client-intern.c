@@ -0,0 +1,69 @@
+/* Resident memory for a full-library browse of a synthetic 30k song
+ * library, with and without an intern table.  Each way runs in its own
+ * child process: it reads listallinfo, keeping every song as a browser
+ * would, and reports how much its resident set grew. */
+#include "../src/libmpdclient.c"
+#include "fakempd.h"
+#include <sys/wait.h>
+
+#define SONGS 30000
+
+static long resident_kb(void) {
+	long pages = 0;
+	FILE * statm = fopen("/proc/self/statm", "r");
+
+	if(statm) {
+		if(fscanf(statm, "%*s %ld", &pages) != 1) pages = 0;
+		fclose(statm);
+	}
+	return pages*(sysconf(_SC_PAGESIZE)/1024);
+}
+
+static int browse(fake_mpd * mpd, int interned) {
+	mpd_Connection * connection = mpd_newConnection(mpd->path, 0, 10);
+	mpd_InternTable * table = NULL;
+	GPtrArray * songs = g_ptr_array_new();
+	mpd_InfoEntity * entity;
+	long before;
+
+	if(connection->error) {
+		printf("FAILED: %s\n", connection->errorStr);
+		return 1;
+	}
+	if(interned) {
+		table = mpd_newInternTable();
+		mpd_setInternTable(connection, table);
+	}
+	before = resident_kb();
+	mpd_sendListallInfoCommand(connection, "");
+	while((entity = mpd_getNextInfoEntity(connection))) {
+		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG)
+			g_ptr_array_add(songs, entity);
+		else mpd_freeInfoEntity(entity);
+	}
+	mpd_finishCommand(connection);
+	printf("%-9s %6u songs, resident set grew by %6ld kB\n",
+	       interned ? "interned:" : "plain:", songs->len,
+	       resident_kb()-before);
+	fflush(stdout);
+	return connection->error != 0 || songs->len != SONGS+1;
+}
+
+int main(void) {
+	fake_mpd * mpd = fake_mpd_start(SONGS);
+	int failed = 0;
+	int interned;
+
+	for(interned = 0; interned <= 1; interned++) {
+		int status;
+		pid_t pid;
+
+		fflush(stdout);
+		pid = fork();
+		if(pid == 0) _exit(browse(mpd, interned));
+		waitpid(pid, &status, 0);
+		failed += !WIFEXITED(status) || WEXITSTATUS(status);
+	}
+	fake_mpd_stop(mpd);
+	return failed != 0;
+}
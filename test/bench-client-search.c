@@ -0,0 +1,101 @@
+/* Searching a mirror of a synthetic 50k song library as a type-ahead
+ * box would: one search on any tag per prefix of a title, as it is
+ * typed.  The time is that of mpd_commitSearch, which finds the songs,
+ * the best of 7 runs; the songs are then read with
+ * mpd_visitInfoEntities, which isn't timed. */
+#include "../src/libmpdclient.c"
+#include "fakempd.h"
+#include <time.h>
+
+#define SONGS 50000
+#define RUNS 7
+
+static const char typed[] = "Song title number 43210";
+
+static double now_ms(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec*1000.0+ts.tv_nsec/1000000.0;
+}
+
+static int count_song(const mpd_EntityView * view, void * userdata) {
+	(void)view;
+	(*(int *)userdata)++;
+	return 0;
+}
+
+/* best time of searching for prefix, its number of songs in found */
+static double search(mpd_Connection * connection, int type,
+                     const char * prefix, int * found)
+{
+	double best = -1;
+	int run;
+
+	for(run = 0; run < RUNS; run++) {
+		double start = now_ms();
+		double took;
+
+		mpd_startSearch(connection, 0);
+		mpd_addConstraintSearch(connection, type, prefix);
+		mpd_commitSearch(connection);
+		took = now_ms()-start;
+		if(best < 0 || took < best) best = took;
+		*found = 0;
+		mpd_visitInfoEntities(connection, 0, count_song, found);
+		mpd_finishCommand(connection);
+	}
+	return best;
+}
+
+int main(void) {
+	fake_mpd * mpd = fake_mpd_start(SONGS);
+	mpd_Connection * connection = mpd_newConnection(mpd->path, 0, 10);
+	char * path = g_strdup_printf("%s.mirror", mpd->path);
+	int types[] = { MPD_TAG_ITEM_TITLE, MPD_TAG_ITEM_ANY };
+	char prefix[sizeof(typed)];
+	mpd_Mirror * mirror;
+	double start;
+	int length, t;
+
+	if(connection->error) {
+		printf("FAILED: %s\n", connection->errorStr);
+		return 1;
+	}
+	start = now_ms();
+	if(mpd_updateMirror(connection, path) != 1 ||
+	   !(mirror = mpd_openMirror(path)))
+	{
+		printf("FAILED: no mirror: %s\n", connection->errorStr);
+		return 1;
+	}
+	printf("%d songs, mirror written in %.0f ms\n", SONGS+1,
+	       now_ms()-start);
+	mpd_setMirror(connection, mirror);
+
+	for(t = 0; t < (int)G_N_ELEMENTS(types); t++) {
+		double worst = 0;
+
+		printf("search %s:\n", mpdTagItemKeys[types[t]]);
+		for(length = 1; length < (int)sizeof(typed); length++) {
+			double took;
+			int found;
+
+			memcpy(prefix, typed, length);
+			prefix[length] = '\0';
+			took = search(connection, types[t], prefix, &found);
+			printf("  \"%s\"%*s %6d songs %7.3f ms\n", prefix,
+			       (int)sizeof(typed)-length, "", found, took);
+			if(took > worst) worst = took;
+		}
+		printf("  slowest prefix %.3f ms\n", worst);
+	}
+
+	mpd_setMirror(connection, NULL);
+	mpd_closeMirror(mirror);
+	mpd_closeConnection(connection);
+	unlink(path);
+	g_free(path);
+	fake_mpd_stop(mpd);
+	return 0;
+}
@@ -0,0 +1,91 @@
+// Time to something playable on a synthetic 50k file device.
+//
+// Without the starter playlist nothing plays until mpd's update has
+// read every file.  That is stood in for here by a single threaded
+// walk that opens each file, which is a lower bound on what the update
+// costs.  With it, playback starts once the scanner has found
+// STARTER_SIZE files.  Run it twice to compare cold and warm caches.
+#include "hotplug.h"
+
+#define ARTISTS 50
+#define ALBUMS 10
+#define TRACKS 100
+
+static const char header[16] = "ID3\3\0\0\0\0\0\0\0\0";
+
+static void make_tree(const char *root)
+{
+  char path[4096];
+  int a, b, t;
+  for (a = 0; a < ARTISTS; a++) {
+    snprintf(path, sizeof(path), "%s/artist%02d", root, a);
+    mkdir(path, 0777);
+    for (b = 0; b < ALBUMS; b++) {
+      snprintf(path, sizeof(path), "%s/artist%02d/album%02d", root, a, b);
+      mkdir(path, 0777);
+      for (t = 0; t < TRACKS; t++) {
+	snprintf(path, sizeof(path), "%s/artist%02d/album%02d/%03d track.%s",
+		 root, a, b, t, t % 10 ? "mp3" : "jpg");
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if (fd < 0 || write(fd, header, sizeof(header)) != sizeof(header)) {
+	  perror(path);
+	  exit(1);
+	}
+	close(fd);
+      }
+    }
+  }
+}
+
+// what an update has to do at least: look at every file
+static int walk_all(const char *path)
+{
+  DIR *dir = opendir(path);
+  struct dirent *entry;
+  int found = 0;
+  if (!dir) {
+    return 0;
+  }
+  while ((entry = readdir(dir))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char *child = path_join_alloc(path, entry->d_name);
+    if (entry->d_type == DT_DIR) {
+      found += walk_all(child);
+    } else if (audio_extension(entry->d_name) && audio_magic(child)) {
+      found++;
+    }
+    free(child);
+  }
+  closedir(dir);
+  return found;
+}
+
+int main(void)
+{
+  char root[] = "/tmp/mpdhotplug-scanXXXXXX";
+  char rm[64];
+  if (!mkdtemp(root)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  make_tree(root);
+
+  long long start = now_us();
+  int all = walk_all(root);
+  long long walk = now_us() - start;
+
+  start = now_us();
+  GPtrArray *files = scanner_finish(scanner_start(root, STARTER_SIZE));
+  long long scan = now_us() - start;
+
+  printf("%d files, %d audio\n", ARTISTS * ALBUMS * TRACKS, all);
+  printf("full walk:              %8.2f ms\n", walk / 1000.0);
+  printf("starter scan (%d files): %8.2f ms\n", files->len, scan / 1000.0);
+  int ok = files->len == STARTER_SIZE;
+  scan_files_free(files);
+
+  snprintf(rm, sizeof(rm), "rm -rf %s", root);
+  return system(rm) || !ok;
+}
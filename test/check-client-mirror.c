@@ -0,0 +1,179 @@
+/* Writing, reopening and reading the database mirror against a fake
+ * mpd, and opening damaged mirrors, which must be refused rather than
+ * read outside the map. */
+#include "../src/libmpdclient.c"
+#include "fakempd.h"
+
+#define SONGS 3000
+
+static int failed;
+
+#define CHECK(what, ok) do { \
+	int ok_ = (ok); \
+	printf("%-48s %s\n", what, ok_ ? "ok" : "FAILED"); \
+	failed += !ok_; \
+} while(0)
+
+typedef struct counts {
+	int directories;
+	int songs;
+	int playlists;
+} counts;
+
+static int count_entity(const mpd_EntityView * view, void * userdata) {
+	counts * c = userdata;
+
+	if(view->type == MPD_INFO_ENTITY_TYPE_DIRECTORY) c->directories++;
+	else if(view->type == MPD_INFO_ENTITY_TYPE_SONG) c->songs++;
+	else c->playlists++;
+	return 0;
+}
+
+static int read_file(const char * path, char ** data, gsize * length) {
+	return g_file_get_contents(path, data, length, NULL);
+}
+
+/* write data to path with the guint32 at offset set to value */
+static void write_patched(const char * path, const char * data, gsize length,
+                          guint32 offset, guint32 value)
+{
+	FILE * file = fopen(path, "wb");
+	char * copy = g_malloc(length);
+
+	memcpy(copy, data, length);
+	if(offset+sizeof(value) <= length)
+		memcpy(copy+offset, &value, sizeof(value));
+	fwrite(copy, 1, length, file);
+	fclose(file);
+	g_free(copy);
+}
+
+int main(void) {
+	fake_mpd * mpd = fake_mpd_start(SONGS);
+	mpd_Connection * connection = mpd_newConnection(mpd->path, 0, 10);
+	mpd_Arena * arena = mpd_newArena();
+	mpd_InternTable * intern = mpd_newInternTable();
+	char * path = g_strdup_printf("%s.mirror", mpd->path);
+	char * bad = g_strdup_printf("%s.bad", mpd->path);
+	const mpd_MirrorHeader * header;
+	mpd_Mirror * mirror;
+	mpd_Song * song;
+	counts c = { 0, 0, 0 };
+	char * data;
+	gsize length;
+
+	if(connection->error) {
+		printf("FAILED: %s\n", connection->errorStr);
+		return 1;
+	}
+
+	/* building the mirror leaves the caller's arena alone */
+	mpd_setArena(connection, arena);
+	mpd_setInternTable(connection, intern);
+	CHECK("update writes a new mirror",
+	      mpd_updateMirror(connection, path) == 1);
+	CHECK("arena untouched by the update", arena->chunks == NULL);
+	CHECK("arena and intern table still attached",
+	      connection->arena == arena && connection->intern == intern);
+	CHECK("update again finds it current",
+	      mpd_updateMirror(connection, path) == 0 && mpd->listallinfos == 1);
+	mpd->db_update = 2000;
+	CHECK("update after db_update changes rewrites it",
+	      mpd_updateMirror(connection, path) == 1 && mpd->listallinfos == 2);
+
+	mirror = mpd_openMirror(path);
+	CHECK("mirror opens", mirror != NULL);
+	if(!mirror) return 1;
+	CHECK("mirror has the new db_update", mpd_getMirrorDbUpdate(mirror) == 2000);
+	CHECK("the mirror is current", mpd_isMirrorCurrent(connection, mirror) == 1);
+	mpd->db_update = 2500;
+	CHECK("after an update of mpd's database it is stale",
+	      mpd_isMirrorCurrent(connection, mirror) == 0 &&
+	      mpd->listallinfos == 2);
+	mpd->db_update = 2000;
+	mpd_visitMirror(mirror, "", 1, count_entity, &c);
+	CHECK("every entity is visited",
+	      c.songs == SONGS+1 && c.playlists == 1 &&
+	      c.directories == 1+(SONGS+59)/60+(SONGS+11)/12);
+	song = mpd_getMirrorSong(mirror, "music/Artist 3/Album 17/00 Song number 204.flac");
+	CHECK("a song is found by its path",
+	      song && !strcmp(song->title, "Song title number 204") &&
+	      !strcmp(song->composer, "Composer 3, Other Composer 3") &&
+	      song->composers && !strcmp(song->composers[1], "Other Composer 3"));
+	if(song) mpd_freeSong(song);
+	song = mpd_getMirrorSong(mirror, "top.mp3");
+	CHECK("several artists and genres are kept",
+	      song && !strcmp(song->artist, "X, Y") && !strcmp(song->genre, "G1") &&
+	      song->genres && !strcmp(song->genres[1], "G2"));
+	if(song) mpd_freeSong(song);
+	header = mirror->header;
+
+	/* damage it in ways the header checks can't see */
+	read_file(path, &data, &length);
+	write_patched(bad, data, length, header->postings,
+	              header->entityCount);
+	CHECK("a posting past the entities is refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, header->entities+
+	              offsetof(mpd_MirrorEntity, path), header->stringsSize);
+	CHECK("a path past the strings is refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, header->entities+
+	              offsetof(mpd_MirrorEntity, count), 0x7fffffff);
+	CHECK("a directory with too many children is refused",
+	      !mpd_openMirror(bad));
+	{
+		/* a directory in the top one listing itself as its child */
+		guint32 dir = 0;
+		guint32 i;
+
+		for(i = 0; i < header->rootCount; i++) {
+			dir = mirror->children[header->rootFirst+i];
+			if(mirror->entities[dir].type == MPD_INFO_ENTITY_TYPE_DIRECTORY)
+				break;
+		}
+		write_patched(bad, data, length, header->children+
+		              mirror->entities[dir].first*sizeof(guint32), dir);
+		CHECK("a directory inside itself is refused", !mpd_openMirror(bad));
+		write_patched(bad, data, length, header->entities+
+		              dir*sizeof(mpd_MirrorEntity)+
+		              offsetof(mpd_MirrorEntity, parent), dir+1);
+		CHECK("a directory in another's place is refused",
+		      !mpd_openMirror(bad));
+	}
+	write_patched(bad, data, length, header->keys+
+	              offsetof(mpd_MirrorKey, first), 0xffffffff);
+	CHECK("a key's postings past the end are refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, header->trigramKeys, header->keyCount);
+	CHECK("a trigram's key past the end is refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, offsetof(mpd_MirrorHeader, keys),
+	              header->keys+1);
+	CHECK("misaligned keys are refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length/2, 0, 0);
+	CHECK("a truncated mirror is refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, 0, 0);
+	CHECK("a mirror without the magic is refused", !mpd_openMirror(bad));
+	write_patched(bad, data, length, length, 0);
+	{
+		mpd_Mirror * again = mpd_openMirror(bad);
+		CHECK("an undamaged copy opens", again != NULL);
+		if(again) mpd_closeMirror(again);
+	}
+	g_free(data);
+	unlink(bad);
+	mpd_closeMirror(mirror);
+
+	/* a mirror that can't be written says why */
+	mpd->db_update = 3000;
+	mpd_clearError(connection);
+	CHECK("writing where there is no directory fails",
+	      mpd_updateMirror(connection, "/nonexistent/dir/mirror") == -1 &&
+	      strstr(connection->errorStr, strerror(ENOENT)) != NULL);
+
+	mpd_closeConnection(connection);
+	mpd_freeArena(arena);
+	mpd_freeInternTable(intern);
+	unlink(path);
+	g_free(path);
+	g_free(bad);
+	fake_mpd_stop(mpd);
+	return failed != 0;
+}
@@ -0,0 +1,216 @@
+/* Searches answered from the mirror's index against a plain scan of
+ * the songs listallinfo returned: every find and search below must
+ * give the same songs both ways, and one answered by mpd (no
+ * constraints) must not be answered from the mirror. */
+#include "../src/libmpdclient.c"
+#include "fakempd.h"
+
+#define SONGS 3000
+
+typedef struct query {
+	int exact;
+	int count;
+	int types[3];
+	const char * values[3];
+} query;
+
+static const query queries[] = {
+	{ 0, 1, { MPD_TAG_ITEM_TITLE }, { "number 2999" } },
+	{ 0, 1, { MPD_TAG_ITEM_TITLE }, { "s" } },
+	{ 0, 1, { MPD_TAG_ITEM_TITLE }, { "so" } },
+	{ 0, 1, { MPD_TAG_ITEM_TITLE }, { "SONG T" } },
+	{ 0, 1, { MPD_TAG_ITEM_ANY }, { "other composer 3" } },
+	{ 0, 1, { MPD_TAG_ITEM_ANY }, { "album 12/" } },
+	{ 1, 1, { MPD_TAG_ITEM_COMPOSER }, { "Other Composer 3" } },
+	{ 1, 1, { MPD_TAG_ITEM_ARTIST }, { "Artist Name 7" } },
+	{ 1, 1, { MPD_TAG_ITEM_ARTIST }, { "artist name 7" } },
+	{ 1, 2, { MPD_TAG_ITEM_ARTIST, MPD_TAG_ITEM_ALBUM },
+	        { "Artist Name 7", "The Album Called 37" } },
+	{ 0, 2, { MPD_TAG_ITEM_GENRE, MPD_TAG_ITEM_DATE }, { "genre 1", "19" } },
+	{ 1, 1, { MPD_TAG_ITEM_ANY }, { "Y" } },
+	{ 1, 1, { MPD_TAG_ITEM_ARTIST }, { "X, Y" } },
+	{ 1, 1, { MPD_TAG_ITEM_GENRE }, { "G2" } },
+	{ 0, 1, { MPD_TAG_ITEM_FILENAME }, { "album 12/" } },
+	{ 1, 1, { MPD_TAG_ITEM_FILENAME }, { "top.mp3" } },
+	{ 0, 1, { MPD_TAG_ITEM_ARTIST }, { "zzz" } },
+	{ 0, 1, { MPD_TAG_ITEM_ARTIST }, { "" } },
+	{ 0, 3, { MPD_TAG_ITEM_ANY, MPD_TAG_ITEM_ANY, MPD_TAG_ITEM_TRACK },
+	        { "artist 1", "song", "2" } },
+	{ 0, 1, { MPD_TAG_ITEM_ALBUM_ARTIST }, { "name 33" } },
+	{ 0, 1, { MPD_TAG_ITEM_COMMENT }, { "x" } },
+};
+
+static int value_matches(const char * value, const char * wanted, int exact) {
+	char * a;
+	char * b;
+	int match;
+
+	/* like mpd, only search ignores case */
+	if(!value) return 0;
+	if(exact) return !strcmp(value, wanted);
+	a = mpd_fold(value);
+	b = mpd_fold(wanted);
+	match = strstr(a, b) != NULL;
+	g_free(a);
+	g_free(b);
+	return match;
+}
+
+/* whether any value of tag type (or of any tag) matches, looking at
+ * each of several artists or genres */
+static int song_matches(mpd_Song * song, int type, const char * wanted,
+                        int exact)
+{
+	int tag;
+
+	for(tag = 0; tag < MPD_TAG_ITEM_ANY; tag++) {
+		int field = mpd_tagFields[tag];
+		int list = mpd_songList(field);
+		char ** values = list >= 0 ?
+			MPD_SONG_LIST(song, mpd_songLists[list].list) : NULL;
+
+		if(type != MPD_TAG_ITEM_ANY && tag != type) continue;
+		if(values) {
+			for(; *values; values++) {
+				if(value_matches(*values, wanted, exact)) return 1;
+			}
+		}
+		else if(value_matches(MPD_SONG_STRING(song, field), wanted, exact))
+			return 1;
+	}
+	return 0;
+}
+
+/* the files matching q, by looking at every song */
+static GPtrArray * scan(GPtrArray * songs, const query * q) {
+	GPtrArray * found = g_ptr_array_new();
+	guint i;
+	int c;
+
+	for(i = 0; i < songs->len; i++) {
+		mpd_Song * song = g_ptr_array_index(songs, i);
+		int match = 1;
+
+		for(c = 0; c < q->count && match; c++)
+			match = song_matches(song, q->types[c], q->values[c], q->exact);
+		if(match) g_ptr_array_add(found, g_strdup(song->file));
+	}
+	return found;
+}
+
+/* the files matching q, from the mirror; NULL if it went to mpd */
+static GPtrArray * search(mpd_Connection * connection, const query * q) {
+	GPtrArray * found;
+	mpd_InfoEntity * entity;
+	int c;
+
+	mpd_startSearch(connection, q->exact);
+	for(c = 0; c < q->count; c++)
+		mpd_addConstraintSearch(connection, q->types[c], q->values[c]);
+	mpd_commitSearch(connection);
+	if(!connection->mirrorResults) {
+		mpd_finishCommand(connection);
+		return NULL;
+	}
+	found = g_ptr_array_new();
+	while((entity = mpd_getNextInfoEntity(connection))) {
+		g_ptr_array_add(found, g_strdup(entity->info.song->file));
+		mpd_freeInfoEntity(entity);
+	}
+	mpd_finishCommand(connection);
+	return found;
+}
+
+static int compare_files(gconstpointer a, gconstpointer b) {
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static int same_files(GPtrArray * a, GPtrArray * b) {
+	guint i;
+
+	if(a->len != b->len) return 0;
+	g_ptr_array_sort(a, compare_files);
+	g_ptr_array_sort(b, compare_files);
+	for(i = 0; i < a->len; i++) {
+		if(strcmp(g_ptr_array_index(a, i), g_ptr_array_index(b, i)))
+			return 0;
+	}
+	return 1;
+}
+
+static void free_files(GPtrArray * files) {
+	guint i;
+
+	for(i = 0; i < files->len; i++) g_free(g_ptr_array_index(files, i));
+	g_ptr_array_free(files, TRUE);
+}
+
+int main(void) {
+	fake_mpd * mpd = fake_mpd_start(SONGS);
+	mpd_Connection * connection = mpd_newConnection(mpd->path, 0, 10);
+	char * path = g_strdup_printf("%s.mirror", mpd->path);
+	GPtrArray * songs = g_ptr_array_new();
+	mpd_InfoEntity * entity;
+	mpd_Mirror * mirror;
+	int failed = 0;
+	guint i;
+
+	if(connection->error) {
+		printf("FAILED: %s\n", connection->errorStr);
+		return 1;
+	}
+
+	mpd_sendListallInfoCommand(connection, "");
+	while((entity = mpd_getNextInfoEntity(connection))) {
+		if(entity->type == MPD_INFO_ENTITY_TYPE_SONG) {
+			g_ptr_array_add(songs, mpd_songDup(entity->info.song));
+		}
+		mpd_freeInfoEntity(entity);
+	}
+	mpd_finishCommand(connection);
+
+	if(mpd_updateMirror(connection, path) != 1 ||
+	   !(mirror = mpd_openMirror(path)))
+	{
+		printf("FAILED: no mirror: %s\n", connection->errorStr);
+		return 1;
+	}
+	mpd_setMirror(connection, mirror);
+
+	for(i = 0; i < G_N_ELEMENTS(queries); i++) {
+		const query * q = queries+i;
+		GPtrArray * want = scan(songs, q);
+		GPtrArray * got = search(connection, q);
+		int ok = got && same_files(got, want);
+
+		printf("%-6s %-2d constraints \"%s\": %u songs%s\n",
+		       q->exact ? "find" : "search", q->count, q->values[0],
+		       want->len, ok ? "" : "  FAILED");
+		if(!ok && got)
+			printf("       the mirror found %u\n", got->len);
+		failed += !ok;
+		free_files(want);
+		if(got) free_files(got);
+	}
+
+	/* mpd has the error for a search without constraints */
+	mpd_startSearch(connection, 0);
+	mpd_commitSearch(connection);
+	if(connection->mirrorResults) {
+		printf("FAILED: a search without constraints was answered locally\n");
+		failed++;
+	}
+	mpd_finishCommand(connection);
+
+	printf("%u queries, %d failures\n", (unsigned)G_N_ELEMENTS(queries),
+	       failed);
+	mpd_setMirror(connection, NULL);
+	mpd_closeMirror(mirror);
+	mpd_closeConnection(connection);
+	for(i = 0; i < songs->len; i++) mpd_freeSong(g_ptr_array_index(songs, i));
+	g_ptr_array_free(songs, TRUE);
+	unlink(path);
+	g_free(path);
+	fake_mpd_stop(mpd);
+	return failed != 0;
+}
@@ -0,0 +1,69 @@
+/* Sending to an mpd that has stopped reading: once the socket buffers
+ * are full the command can't be sent within the timeout, which must be
+ * reported as MPD_ERROR_TIMEOUT, not as a failed send. */
+#include "../src/libmpdclient.c"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* far more than the socket buffers hold */
+#define COMMAND_LENGTH (8*1024*1024)
+
+static int listener;
+
+/* greet one client, then never read from it */
+static void * greet(void * arg) {
+	int fd = accept(listener, NULL, NULL);
+
+	(void)arg;
+	if(fd >= 0) send(fd, "OK MPD 0.16.0\n", 14, MSG_NOSIGNAL);
+	return (void *)(long)fd;
+}
+
+int main(void) {
+	struct sockaddr_un addr;
+	mpd_Connection * connection;
+	pthread_t thread;
+	char * file;
+	void * fd;
+	int ok;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/sendcheck.%d.socket",
+	         getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp", (int)getpid());
+	unlink(addr.sun_path);
+	listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(listener < 0 ||
+	   bind(listener, (struct sockaddr *)&addr, sizeof(addr)) ||
+	   listen(listener, 1))
+	{
+		perror(addr.sun_path);
+		return 1;
+	}
+	pthread_create(&thread, NULL, greet, NULL);
+
+	connection = mpd_newConnection(addr.sun_path, 0, 0.5);
+	if(connection->error) {
+		printf("FAILED: %s\n", connection->errorStr);
+		return 1;
+	}
+
+	file = malloc(COMMAND_LENGTH+1);
+	memset(file, 'a', COMMAND_LENGTH);
+	file[COMMAND_LENGTH] = '\0';
+	mpd_sendAddCommand(connection, file);
+
+	ok = connection->error == MPD_ERROR_TIMEOUT &&
+	     !strncmp(connection->errorStr, "timeout sending command", 23);
+	printf("send to a peer that doesn't read: error %d, \"%.40s...\" %s\n",
+	       connection->error, connection->errorStr, ok ? "ok" : "FAILED");
+
+	mpd_closeConnection(connection);
+	pthread_join(thread, &fd);
+	close((long)fd);
+	close(listener);
+	unlink(addr.sun_path);
+	free(file);
+	return !ok;
+}
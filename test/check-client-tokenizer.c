@@ -0,0 +1,127 @@
+/* The SSE2 and AVX2 line scans against the plain byte loop: random
+ * input full of newlines and colons is fed to the tokenizer in random
+ * sized pieces, as recv would, and every line found must match what a
+ * straightforward scan of the whole input finds. */
+#include "../src/libmpdclient.c"
+
+#define INPUTS 2000
+#define INPUT_LENGTH 3000
+
+typedef int (*mpd_ScanFunc)(mpd_LineScan * scan, int pos, int end);
+
+static unsigned seed = 1;
+
+static unsigned next_random(void) {
+	seed = seed*1103515245 + 12345;
+	return seed >> 16;
+}
+
+/* feed input through mpd_tokenize with scanner, taking each line as
+ * mpd_getNextReturnElement would; spans are written to found as
+ * start, colon, end triples and the number of lines returned */
+static int run_scan(mpd_ScanFunc scanner, const char * input, int length,
+                    const int * pieces, int * found)
+{
+	mpd_Connection connection;
+	int count = 0;
+	int piece = 0;
+
+	memset(&connection, 0, sizeof(connection));
+	connection.buffer = malloc(length+1);
+	connection.lineColon = -1;
+	mpd_scanLines = scanner;
+
+	while(connection.buflen < length) {
+		int add = pieces[piece++];
+		if(add > length-connection.buflen) add = length-connection.buflen;
+		memcpy(connection.buffer+connection.buflen,
+		       input+connection.buflen, add);
+		connection.buflen += add;
+		connection.buffer[connection.buflen] = '\0';
+
+		while(connection.lineNext < connection.lineCount ||
+		      mpd_tokenize(&connection)) {
+			mpd_LineSpan * line = &connection.lines[connection.lineNext++];
+			found[count*3] = line->start;
+			found[count*3+1] = line->colon;
+			found[count*3+2] = line->end;
+			connection.bufstart = line->end+1;
+			count++;
+		}
+	}
+	free(connection.buffer);
+	return count;
+}
+
+/* the lines of input the obvious way */
+static int reference(const char * input, int length, int * found) {
+	int count = 0;
+	int start = 0;
+	int colon = -1;
+	int i;
+
+	for(i = 0; i < length; i++) {
+		if(input[i] == ':' && colon < 0) colon = i;
+		if(input[i] == '\n') {
+			found[count*3] = start;
+			found[count*3+1] = colon;
+			found[count*3+2] = i;
+			count++;
+			start = i+1;
+			colon = -1;
+		}
+	}
+	return count;
+}
+
+int main(void) {
+	static char input[INPUT_LENGTH];
+	static int pieces[INPUT_LENGTH];
+	static int want[INPUT_LENGTH*3];
+	static int got[INPUT_LENGTH*3];
+	struct { const char * name; mpd_ScanFunc scanner; } scanners[] = {
+		{ "scalar", mpd_scanBytes },
+#ifdef MPD_HAVE_SSE2
+		{ "sse2", mpd_scanSse2 },
+#endif
+#ifdef MPD_HAVE_AVX2
+		{ "avx2", __builtin_cpu_supports("avx2") ? mpd_scanAvx2 : NULL },
+#endif
+	};
+	int failed = 0;
+	int n, i, s;
+
+	for(n = 0; n < INPUTS; n++) {
+		int length = next_random() % INPUT_LENGTH;
+		/* mostly short lines, sometimes long ones */
+		int density = n % 3 ? 8 : 200;
+		int lines;
+
+		for(i = 0; i < length; i++) {
+			unsigned r = next_random() % density;
+			input[i] = r == 0 ? '\n' : r == 1 ? ':' : 'a'+r%26;
+		}
+		for(i = 0; i < length; i++)
+			pieces[i] = 1+next_random()%(n % 2 ? 7 : 700);
+		lines = reference(input, length, want);
+
+		for(s = 0; s < (int)G_N_ELEMENTS(scanners); s++) {
+			int count;
+			if(!scanners[s].scanner) continue;
+			count = run_scan(scanners[s].scanner, input, length,
+			                 pieces, got);
+			if(count != lines ||
+			   memcmp(got, want, lines*3*sizeof(int))) {
+				printf("FAILED: %s on input %d (%d bytes): "
+				       "%d lines, wanted %d\n", scanners[s].name,
+				       n, length, count, lines);
+				failed++;
+			}
+		}
+	}
+	for(s = 0; s < (int)G_N_ELEMENTS(scanners); s++)
+		printf("%s: %s\n", scanners[s].name,
+		       scanners[s].scanner ? "checked" : "not supported here");
+	printf("%d inputs, %d failures\n", INPUTS, failed);
+	return failed != 0;
+}
@@ -0,0 +1,140 @@
+// Replay 1000 synthetic uevents through the coalescing queue and count
+// how many times mpd would be restarted, against one restart per add
+// event when udev ran us for each.
+//
+// The events come in bursts, as from a stick with several partitions
+// or a loose connector: each burst is a run of add and remove events
+// for a few partitions sent back to back, and bursts are further apart
+// than COALESCE_WINDOW.  So each partition a burst touches should be
+// dispatched exactly once, in the state of its last event.
+#include "hotplug.h"
+
+#define EVENTS 1000
+#define BURSTS 10
+#define PARTITIONS 4
+#define BURST_GAP (COALESCE_WINDOW + 150)  // ms
+
+typedef struct replay
+{
+  int fd;
+  hotplug_mode_t modes[EVENTS];
+  int partitions[EVENTS];
+} replay;
+
+static void replay_make(replay *r)
+{
+  unsigned seed = 12345;
+  int i;
+  for (i = 0; i < EVENTS; i++) {
+    seed = seed * 1103515245 + 12345;
+    r->partitions[i] = (seed >> 16) % PARTITIONS;
+    r->modes[i] = (seed >> 8) & 1 ? MODE_ADD : MODE_REMOVE;
+  }
+}
+
+static void *replay_send(void *arg)
+{
+  replay *r = (replay *)arg;
+  char packet[512];
+  int i;
+  for (i = 0; i < EVENTS; i++) {
+    const char *action = r->modes[i] == MODE_ADD ? "add" : "remove";
+    char devpath[128];
+    snprintf(devpath, sizeof(devpath),
+	     "/devices/pci0000:00/usb1/1-1/host4/block/sda/sda%d",
+	     r->partitions[i] + 1);
+    int len = snprintf(packet, sizeof(packet),
+		       "%s@%s%cACTION=%s%cDEVPATH=%s%cSUBSYSTEM=block%c"
+		       "DEVTYPE=partition%c",
+		       action, devpath, 0, action, 0, devpath, 0, 0, 0);
+    if (send(r->fd, packet, len, 0) != len) {
+      perror("send");
+      exit(1);
+    }
+    if ((i + 1) % (EVENTS / BURSTS) == 0) {
+      ms_sleep(BURST_GAP);
+    }
+  }
+  close(r->fd);  // ends the loop
+  return NULL;
+}
+
+int main(void)
+{
+  static replay r;
+  int fds[2];
+  pthread_t sender;
+  int i, b;
+
+  // the queue logs every event it replaces
+  freopen("/dev/null", "w", stderr);
+
+  replay_make(&r);
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds)) {
+    perror("socketpair");
+    return 1;
+  }
+  r.fd = fds[1];
+
+  // what we expect: each partition a burst touches once, in its last
+  // state, and before coalescing one restart per add
+  int naive = 0, expected = 0, expected_restarts = 0;
+  for (b = 0; b < BURSTS; b++) {
+    hotplug_mode_t last[PARTITIONS] = { MODE_NONE };
+    for (i = b * (EVENTS / BURSTS); i < (b + 1) * (EVENTS / BURSTS); i++) {
+      last[r.partitions[i]] = r.modes[i];
+      naive += r.modes[i] == MODE_ADD;
+    }
+    for (i = 0; i < PARTITIONS; i++) {
+      expected += last[i] != MODE_NONE;
+      expected_restarts += last[i] == MODE_ADD;
+    }
+  }
+
+  pthread_create(&sender, NULL, replay_send, &r);
+
+  // uevent_loop(), with the daemon restarts counted rather than done
+  event_queue *queue = event_queue_new(fds[0]);
+  int dispatched = 0, restarts = 0, stops = 0;
+  char *active = NULL;
+  while (1) {
+    pending_event *event;
+    int timeout_ms;
+    while ((event = event_queue_next(queue, &timeout_ms))) {
+      dispatched++;
+      if (event->mode == MODE_ADD) {
+	restarts++;
+	free(active);
+	active = strdup(event->mount);
+      } else if (!active || !strcmp(active, event->mount)) {
+	stops++;
+	free(active);
+	active = NULL;
+      }
+      pending_event_free(event);
+    }
+    if (queue->closed) {
+      break;
+    }
+    if (RESULT_FAILURE == event_queue_read(queue, timeout_ms)) {
+      printf("FAILED reading events\n");
+      return 1;
+    }
+  }
+  pthread_join(sender, NULL);
+
+  printf("%u events received in %d bursts\n", queue->received, BURSTS);
+  printf("one run per event: %d mpd restarts\n", naive);
+  printf("coalesced: %d dispatched, %d mpd restarts, %d stops\n",
+	 dispatched, restarts, stops);
+  int ok = queue->received == EVENTS && dispatched == expected &&
+    restarts == expected_restarts;
+  if (!ok) {
+    printf("FAILED: wanted %d dispatched, %d restarts\n",
+	   expected, expected_restarts);
+  }
+  free(active);
+  event_queue_free(queue);
+  close(fds[0]);
+  return !ok;
+}
@@ -0,0 +1,78 @@
+// pid_stop() against stub children that take different amounts of
+// persuading, on a short timeline.
+#include "hotplug.h"
+
+#define SLACK 80  // ms allowed for scheduling
+
+// Fork a child that ignores the first `ignored` stop signals and, if
+// exit_ms is set, exits by itself after that long.
+static pid_t stub_child(int ignored, int exit_ms)
+{
+  int ready[2];
+  char c;
+  if (pipe(ready)) {
+    perror("pipe");
+    exit(1);
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    int i;
+    for (i = 0; i < ignored; i++) {
+      signal(stop_signals[i], SIG_IGN);
+    }
+    write(ready[1], "", 1);
+    if (exit_ms) {
+      ms_sleep(exit_ms);
+      _exit(0);
+    }
+    while (1) pause();
+  }
+  // don't signal it before its handlers are set
+  read(ready[0], &c, 1);
+  close(ready[0]);
+  close(ready[1]);
+  return pid;
+}
+
+static int check(const char *what, mpdhotplug_state *state,
+		 int ignored, int exit_ms, int want_signal, int want_ms)
+{
+  pid_t pid = stub_child(ignored, exit_ms);
+  long long start = now_ms();
+  result_t result = pid_stop(state, pid);
+  long long took = now_ms() - start;
+  int status;
+  waitpid(pid, &status, 0);
+  int signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+  int ok = result == RESULT_SUCCESS && signal == want_signal &&
+    took >= want_ms - 5 && took <= want_ms + SLACK;
+  printf("%-28s %s: signal %d after %lld ms, wanted %d after %d ms\n",
+	 what, ok ? "ok" : "FAILED", signal, took, want_signal, want_ms);
+  return !ok;
+}
+
+int main(void)
+{
+  mpdhotplug_state *state = state_alloc();
+  int failed = 0;
+
+  failed += stop_timeline_parse(state, "0,200,400,600") != RESULT_SUCCESS;
+  failed += check("stops on SIGINT", state, 0, 0, SIGINT, 0);
+  failed += check("stops on SIGTERM", state, 1, 0, SIGTERM, 200);
+  failed += check("needs SIGKILL", state, 2, 0, SIGKILL, 400);
+
+  // a daemon already going is given until the first step
+  failed += stop_timeline_parse(state, "300,500,700,900") != RESULT_SUCCESS;
+  failed += check("exits before SIGINT", state, 0, 100, 0, 100);
+  failed += check("SIGINT at the first step", state, 0, 0, SIGINT, 300);
+
+  // bad timelines are refused and leave the old one in place
+  failed += stop_timeline_parse(state, "0,5000,8000") != RESULT_FAILURE;
+  failed += stop_timeline_parse(state, "0,5000,4000,10000") != RESULT_FAILURE;
+  failed += stop_timeline_parse(state, "0,5000,8000,10000,") != RESULT_FAILURE;
+  failed += stop_timeline_parse(state, "0,x,8000,10000") != RESULT_FAILURE;
+  failed += state->stop_timeline[0] != 300 || state->stop_timeline[3] != 900;
+
+  state_free(state);
+  return failed != 0;
+}
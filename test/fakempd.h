@@ -0,0 +1,166 @@
+/* A stand-in for mpd serving a synthetic library on a unix socket, for
+ * the client checks and benchmarks.  It answers listallinfo with the
+ * library, stats with its size and db_update, and anything else with
+ * a bare OK.
+ *
+ * The library has an artist per 60 songs and an album per 12, laid
+ * out as music/Artist N/Album M/, with the tags repeating the way they
+ * do in a real collection.  One song at the top has several artists
+ * and genres. */
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+typedef struct fake_mpd {
+	char path[108];
+	int fd;
+	pthread_t thread;
+	int songs;
+	GString * library;
+	/* what stats reports, may be changed while it runs */
+	volatile unsigned long db_update;
+	volatile int listallinfos;
+} fake_mpd;
+
+typedef struct fake_client {
+	fake_mpd * mpd;
+	int fd;
+} fake_client;
+
+static inline void fake_mpd_library(fake_mpd * mpd) {
+	GString * out = g_string_new("directory: music\n");
+	int i;
+
+	for(i = 0; i < mpd->songs; i++) {
+		int artist = i/60;
+		int album = i/12;
+
+		if(i%60 == 0)
+			g_string_append_printf(out, "directory: music/Artist %d\n",
+			                       artist);
+		if(i%12 == 0)
+			g_string_append_printf(out,
+				"directory: music/Artist %d/Album %d\n",
+				artist, album);
+		g_string_append_printf(out,
+			"file: music/Artist %d/Album %d/%02d Song number %d.flac\n"
+			"Last-Modified: 2009-01-01T10:00:00Z\n"
+			"Time: %d\n"
+			"Artist: Artist Name %d\n"
+			"AlbumArtist: Artist Name %d\n"
+			"Album: The Album Called %d\n"
+			"Title: Song title number %d\n"
+			"Track: %d\n"
+			"Date: %d\n"
+			"Genre: Genre %d\n"
+			"Composer: Composer %d\n"
+			"Composer: Other Composer %d\n",
+			artist, album, i%12, i, 100+i%300, artist, artist,
+			album, i, i%12+1, 1960+album%50, artist%20,
+			artist%40, artist%7);
+	}
+	g_string_append(out, "file: top.mp3\nTitle: Top\n"
+	                "Artist: X\nArtist: Y\nGenre: G1\nGenre: G2\n");
+	g_string_append(out, "playlist: music/list.m3u\n");
+	mpd->library = out;
+}
+
+static inline int fake_mpd_send(int fd, const char * data, size_t length) {
+	while(length > 0) {
+		ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR) continue;
+		if(sent <= 0) return -1;
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+static inline void * fake_mpd_serve(void * arg) {
+	fake_client * client = arg;
+	fake_mpd * mpd = client->mpd;
+	GString * input = g_string_new("");
+	char buf[4096];
+	char * newline;
+	ssize_t n;
+
+	fake_mpd_send(client->fd, "OK MPD 0.16.0\n", 14);
+	while((n = recv(client->fd, buf, sizeof(buf), 0)) > 0) {
+		g_string_append_len(input, buf, n);
+		while((newline = memchr(input->str, '\n', input->len))) {
+			int length = newline-input->str;
+			int failed;
+
+			if(!strncmp(input->str, "listallinfo", 11)) {
+				mpd->listallinfos++;
+				failed = fake_mpd_send(client->fd, mpd->library->str,
+				                       mpd->library->len) ||
+				         fake_mpd_send(client->fd, "OK\n", 3);
+			}
+			else if(!strncmp(input->str, "stats", 5)) {
+				char stats[128];
+				int len = snprintf(stats, sizeof(stats),
+					"songs: %d\ndb_update: %lu\nOK\n",
+					mpd->songs+1, mpd->db_update);
+				failed = fake_mpd_send(client->fd, stats, len);
+			}
+			else failed = fake_mpd_send(client->fd, "OK\n", 3);
+			g_string_erase(input, 0, length+1);
+			if(failed) break;
+		}
+	}
+	close(client->fd);
+	g_string_free(input, TRUE);
+	free(client);
+	return NULL;
+}
+
+static inline void * fake_mpd_accept(void * arg) {
+	fake_mpd * mpd = arg;
+	int fd;
+
+	while((fd = accept(mpd->fd, NULL, NULL)) >= 0) {
+		fake_client * client = malloc(sizeof(*client));
+		pthread_t thread;
+
+		client->mpd = mpd;
+		client->fd = fd;
+		pthread_create(&thread, NULL, fake_mpd_serve, client);
+		pthread_detach(thread);
+	}
+	return NULL;
+}
+
+static inline fake_mpd * fake_mpd_start(int songs) {
+	fake_mpd * mpd = calloc(1, sizeof(*mpd));
+	struct sockaddr_un addr;
+
+	mpd->songs = songs;
+	mpd->db_update = 1000;
+	fake_mpd_library(mpd);
+	snprintf(mpd->path, sizeof(mpd->path), "%s/fakempd.%d.socket",
+	         getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp", (int)getpid());
+	unlink(mpd->path);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, mpd->path);
+	mpd->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(mpd->fd < 0 || bind(mpd->fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	   listen(mpd->fd, 8)) {
+		perror(mpd->path);
+		exit(1);
+	}
+	pthread_create(&mpd->thread, NULL, fake_mpd_accept, mpd);
+	return mpd;
+}
+
+/* connections still open are left to the end of the process */
+static inline void fake_mpd_stop(fake_mpd * mpd) {
+	shutdown(mpd->fd, SHUT_RDWR);
+	pthread_join(mpd->thread, NULL);
+	close(mpd->fd);
+	unlink(mpd->path);
+	g_string_free(mpd->library, TRUE);
+	free(mpd);
+}
@@ -0,0 +1,40 @@
+// Builds mpdhotplug.c into a test program so its functions can be
+// called directly.  Its mode_t enum would clash with the system's, so
+// the system headers it uses are included first and the enum renamed.
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/vfs.h>
+#include <sys/inotify.h>
+#include <sys/syscall.h>
+#include <sys/file.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <linux/netlink.h>
+#include <linux/magic.h>
+
+#define mode_t hotplug_mode_t
+#define main mpdhotplug_main
+#include "../src/mpdhotplug.c"
+#undef main
+#undef mode_t
+
+// microseconds on the monotonic clock, for timing
+static inline long long now_us(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
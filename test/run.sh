@@ -0,0 +1,42 @@
+#!/bin/sh
+# Build and run the checks against the sources in ../src, or with
+# "bench" the benchmarks.  Needs a C compiler and glib's pkg-config
+# files; set CC and CFLAGS to override the defaults.
+#
+#   check-*.c  exit non-zero on failure
+#   bench-*.c  print their measurements
+#
+# A *-hotplug-* program includes mpdhotplug.c (see hotplug.h) and is
+# linked with libmpdclient.c; a *-client-* one includes libmpdclient.c
+# so it can reach its static functions.
+
+cd "$(dirname "$0")" || exit 1
+kind=${1:-check}
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--Wall -O2 -g}
+GLIB_CFLAGS=$(pkg-config --cflags glib-2.0 gthread-2.0) || exit 1
+GLIB_LIBS=$(pkg-config --libs glib-2.0 gthread-2.0) || exit 1
+out=${TMPDIR:-/tmp}/mpdhotplug-test.$$
+mkdir -p "$out" || exit 1
+trap 'rm -rf "$out"' EXIT
+
+failed=0
+for src in "$kind"-*.c; do
+  [ -e "$src" ] || continue
+  name=${src%.c}
+  extra=
+  case $name in
+    *-hotplug-*) extra=../src/libmpdclient.c ;;
+  esac
+  echo "== $name"
+  if ! $CC $CFLAGS -pthread -I../src $GLIB_CFLAGS -o "$out/$name" \
+       "$src" $extra $GLIB_LIBS; then
+    echo "FAIL: $name did not build"
+    failed=$((failed + 1))
+  elif ! "$out/$name"; then
+    echo "FAIL: $name"
+    failed=$((failed + 1))
+  fi
+done
+[ $failed -eq 0 ] && echo "all passed" || echo "$failed failed"
+exit $failed